@@ -0,0 +1,56 @@
+#include <stdlib.h>
+#include <stddef.h>
+
+#include "i286dis.h"
+
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+struct arena_block {
+    struct arena_block *next;
+    max_align_t data[];
+};
+
+void arena_init(struct arena *arena)
+{
+    arena->head = NULL;
+    arena->used = 0;
+    arena->size = 0;
+    arena->total = 0;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (arena->used + size > arena->size) {
+        // Oversized requests get a block of their own
+        size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        struct arena_block *block = malloc(sizeof(struct arena_block) + cap);
+        if (!block)
+            return NULL;
+
+        block->next = arena->head;
+        arena->head = block;
+        arena->used = 0;
+        arena->size = cap;
+        arena->total += sizeof(struct arena_block) + cap;
+    }
+
+    void *ptr = (char *)arena->head->data + arena->used;
+    arena->used += size;
+    return ptr;
+}
+
+void arena_release(struct arena *arena)
+{
+    struct arena_block *tmp, *block = arena->head;
+
+    while (block) {
+        tmp = block->next;
+        free(block);
+        block = tmp;
+    }
+
+    arena_init(arena);
+}
@@ -0,0 +1,395 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "i286dis.h"
+#include "testdata.h"
+
+#define CORPUS_LEN (1 << 20)
+#define CORPUS_MAX 8
+#define BENCH_TIME 0.5
+// Traversals get an entry point every this many bytes, the way an image
+// with many handlers would
+#define DISASM_STRIDE 256
+
+struct corpus {
+    const char *name;
+    uint8_t *bytes;
+    uint32_t len;
+    // Instructions in a linear sweep, for benchmarks that can't count
+    uint32_t insns;
+    // The corpus as a file, for the CLI
+    char path[32];
+};
+
+static const char *cli;
+static bool machine;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Two operand ALU and mov forms with every ModRM addressing mode, what
+// the ModRM descriptor table speeds up
+static uint8_t *corpus_modrm(uint32_t len, uint32_t seed)
+{
+    static const uint8_t ops[] = {
+        0x00, 0x01, 0x02, 0x03, 0x08, 0x09, 0x0A, 0x0B,
+        0x20, 0x21, 0x22, 0x23, 0x28, 0x29, 0x2A, 0x2B,
+        0x30, 0x31, 0x32, 0x33, 0x38, 0x39, 0x3A, 0x3B,
+        0x84, 0x85, 0x88, 0x89, 0x8A, 0x8B, 0x8D, 0xC4,
+    };
+
+    uint8_t *bytes = malloc(len);
+    uint32_t i = 0;
+
+    while (i + 4 <= len) {
+        uint8_t modrm = next_rand(&seed);
+        uint8_t mod = modrm >> 6;
+
+        bytes[i++] = ops[next_rand(&seed) % sizeof(ops)];
+        bytes[i++] = modrm;
+
+        if (mod == 1 || mod == 2 || (mod == 0 && (modrm & 0x7) == 6))
+            bytes[i++] = next_rand(&seed);
+        if (mod == 2 || (mod == 0 && (modrm & 0x7) == 6))
+            bytes[i++] = next_rand(&seed);
+    }
+
+    while (i < len)
+        bytes[i++] = 0x90;
+
+    return bytes;
+}
+
+static void emit(uint8_t *bytes, uint32_t *pos, int n, ...)
+{
+    va_list args;
+    va_start(args, n);
+
+    for (int i = 0; i < n; i++)
+        bytes[(*pos)++] = va_arg(args, int);
+
+    va_end(args);
+}
+
+// Functions the way a 16-bit compiler lays them out: frame setup, locals
+// on the stack, arithmetic, short conditional jumps and a call to the
+// next function, so a traversal from 0 reaches all of them
+static uint8_t *corpus_synthetic(uint32_t len, uint32_t seed)
+{
+    uint8_t *bytes = malloc(len);
+    uint32_t pos = 0, call = 0;
+
+    while (pos + 256 <= len) {
+        // Point the previous function's call here
+        if (call) {
+            uint16_t rel = pos - (call + 2);
+            bytes[call] = rel;
+            bytes[call + 1] = rel >> 8;
+        }
+
+        uint8_t frame = next_rand(&seed) % 32 * 2 + 2;
+        emit(bytes, &pos, 3, 0x55, 0x8B, 0xEC);
+        emit(bytes, &pos, 3, 0x83, 0xEC, frame);
+
+        for (int n = next_rand(&seed) % 24 + 4; n > 0; n--) {
+            uint8_t local = -(next_rand(&seed) % frame + 1);
+            uint32_t r = next_rand(&seed);
+
+            switch (r % 10) {
+                case 0:
+                    emit(bytes, &pos, 3, 0x8B, 0x46, local);
+                    break;
+                case 1:
+                    emit(bytes, &pos, 3, 0x89, 0x46, local);
+                    break;
+                case 2:
+                    emit(bytes, &pos, 3, 0x05, r >> 8 & 0xFF, r >> 16 & 0xFF);
+                    break;
+                case 3:
+                    emit(bytes, &pos, 3, 0x83, 0xF8, r >> 8 & 0xFF);
+                    emit(bytes, &pos, 2, 0x75, 0x02);
+                    emit(bytes, &pos, 2, 0x8B, 0xC3);
+                    break;
+                case 4:
+                    emit(bytes, &pos, 3, 0xBB, r >> 8 & 0xFF, r >> 16 & 0xFF);
+                    break;
+                case 5:
+                    emit(bytes, &pos, 3, 0x8D, 0x40, r >> 8 & 0xFF);
+                    break;
+                case 6:
+                    emit(bytes, &pos, 1, 0x40 + (r >> 8) % 16);
+                    break;
+                case 7:
+                    emit(bytes, &pos, 4, 0x8A, 0x87, r >> 8 & 0xFF, r >> 16 & 0xFF);
+                    break;
+                case 8:
+                    emit(bytes, &pos, 2, 0x50 + (r >> 8) % 8, 0x58 + (r >> 16) % 8);
+                    break;
+                case 9:
+                    emit(bytes, &pos, 4, 0x26, 0x8B, 0x07, 0x90);
+                    break;
+            }
+        }
+
+        emit(bytes, &pos, 1, 0xE8);
+        call = pos;
+        emit(bytes, &pos, 2, 0x00, 0x00);
+        emit(bytes, &pos, 4, 0x8B, 0xE5, 0x5D, 0xC3);
+    }
+
+    while (pos < len)
+        bytes[pos++] = 0xCC;
+
+    return bytes;
+}
+
+static uint8_t *corpus_file(const char *path, uint32_t *len)
+{
+    FILE *fp = fopen(path, "rb");
+    if (!fp)
+        return NULL;
+
+    fseek(fp, 0, SEEK_END);
+    *len = ftell(fp);
+    rewind(fp);
+
+    uint8_t *bytes = malloc(*len ? *len : 1);
+    if (fread(bytes, 1, *len, fp) != *len) {
+        free(bytes);
+        bytes = NULL;
+    }
+
+    fclose(fp);
+    return bytes;
+}
+
+static uint32_t sweep_length(const struct corpus *corpus)
+{
+    struct dis dis;
+    dis_init(&dis, corpus->bytes, corpus->len, 0, DIS_COMPACT);
+
+    uint32_t n = 0;
+    for (uint32_t addr = 0; addr < corpus->len; n++) {
+        int l = dis_insn_length(&dis, addr);
+        addr += l ? l : 1;
+    }
+
+    dis_deinit(&dis);
+    return n;
+}
+
+static uint32_t sweep_decode_rec(const struct corpus *corpus)
+{
+    struct dis dis;
+    dis_init(&dis, corpus->bytes, corpus->len, 0, DIS_COMPACT);
+
+    uint32_t n = 0;
+    struct insn_rec rec;
+    while (dis.ip < dis.limit) {
+        dis_decode_rec(&dis, &rec);
+        n++;
+    }
+
+    dis_deinit(&dis);
+    return n;
+}
+
+static uint32_t sweep_decode_batch(const struct corpus *corpus)
+{
+    struct dis dis;
+    dis_init(&dis, corpus->bytes, corpus->len, 0, DIS_COMPACT);
+
+    uint32_t n = 0;
+    struct insn_rec recs[64];
+    for (size_t got = 1; got; n += got)
+        got = dis_decode_batch(&dis, dis.ip, recs, 64);
+
+    dis_deinit(&dis);
+    return n;
+}
+
+static uint32_t sweep_decode(const struct corpus *corpus)
+{
+    struct dis dis;
+    dis_init(&dis, corpus->bytes, corpus->len, 0, DIS_COMPACT);
+
+    uint32_t n = 0;
+    while (dis.ip < dis.limit) {
+        dis_decode(&dis);
+        n++;
+    }
+
+    dis_deinit(&dis);
+    return n;
+}
+
+static uint32_t sweep_disasm(const struct corpus *corpus)
+{
+    struct dis dis;
+    dis_init(&dis, corpus->bytes, corpus->len, 0, DIS_COMPACT);
+    for (uint32_t addr = 0; addr < corpus->len; addr += DISASM_STRIDE)
+        dis_push_entry(&dis, addr);
+
+    dis_disasm(&dis);
+
+    uint32_t n = dis.store.n;
+    dis_deinit(&dis);
+    return n;
+}
+
+static uint32_t sweep_format_with(const struct corpus *corpus,
+                                  int (*format)(struct fmt *, struct insn *, char *, size_t))
+{
+    struct dis dis;
+    dis_init(&dis, corpus->bytes, corpus->len, 0, DIS_COMPACT);
+
+    struct fmt fmt;
+    fmt_init(&fmt, FMT_DEFAULT);
+
+    uint32_t n = 0;
+    struct insn_rec recs[64];
+    struct insn ins;
+    char buf[0x100];
+
+    for (size_t got = 1; got; n += got) {
+        got = dis_decode_batch(&dis, dis.ip, recs, 64);
+        for (size_t i = 0; i < got; i++) {
+            insn_unpack(&ins, &recs[i]);
+            format(&fmt, &ins, buf, sizeof(buf));
+        }
+    }
+
+    dis_deinit(&dis);
+    return n;
+}
+
+static uint32_t sweep_format(const struct corpus *corpus)
+{
+    return sweep_format_with(corpus, fmt_insn);
+}
+
+static uint32_t sweep_format_fast(const struct corpus *corpus)
+{
+    return sweep_format_with(corpus, fmt_insn_fast);
+}
+
+// Full linear sweep listing through the CLI, output discarded
+static uint32_t sweep_cli(const struct corpus *corpus)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s -l %s > /dev/null", cli, corpus->path);
+
+    if (system(cmd) != 0) {
+        fprintf(stderr, "Failed to run %s\n", cli);
+        exit(1);
+    }
+
+    return corpus->insns;
+}
+
+static void run(const char *name, uint32_t (*sweep)(const struct corpus *),
+                const struct corpus *corpus)
+{
+    uint64_t insns = 0, total = 0;
+    double start = now(), elapsed;
+
+    do {
+        insns += sweep(corpus);
+        total += corpus->len;
+        elapsed = now() - start;
+    } while (elapsed < BENCH_TIME);
+
+    if (machine) {
+        printf("%s,%s,%llu,%llu,%.6f,%.0f,%.0f\n", name, corpus->name,
+               (unsigned long long)insns, (unsigned long long)total, elapsed,
+               insns / elapsed, total / elapsed);
+    } else {
+        printf("%-12s %-10s %10.2f Minsn/s %10.2f MB/s\n", name, corpus->name,
+               insns / elapsed / 1e6, total / elapsed / 1e6);
+    }
+}
+
+#define usage(x) \
+    fprintf(stderr, "Usage: %s [-m] [-c CLI] [FILE...]\n", x);
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "mc:")) != -1) {
+        switch (opt) {
+            case 'm':
+                machine = true;
+                break;
+            case 'c':
+                cli = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    struct corpus corpora[CORPUS_MAX] = {
+        { .name = "random", .bytes = random_bytes(CORPUS_LEN, 0x286), .len = CORPUS_LEN },
+        { .name = "synthetic", .bytes = corpus_synthetic(CORPUS_LEN, 0x286), .len = CORPUS_LEN },
+        { .name = "modrm", .bytes = corpus_modrm(CORPUS_LEN, 0x286), .len = CORPUS_LEN },
+    };
+    int n = 3;
+
+    for (int i = optind; i < argc && n < CORPUS_MAX; i++) {
+        struct corpus *corpus = &corpora[n];
+        corpus->bytes = corpus_file(argv[i], &corpus->len);
+        if (!corpus->bytes) {
+            perror(argv[i]);
+            return 1;
+        }
+
+        const char *slash = strrchr(argv[i], '/');
+        corpus->name = slash ? slash + 1 : argv[i];
+        n++;
+    }
+
+    if (machine)
+        printf("bench,corpus,insns,bytes,seconds,insns_per_sec,bytes_per_sec\n");
+
+    for (int i = 0; i < n; i++) {
+        struct corpus *corpus = &corpora[i];
+        corpus->insns = sweep_decode_rec(corpus);
+
+        run("length", sweep_length, corpus);
+        run("decode_rec", sweep_decode_rec, corpus);
+        run("batch", sweep_decode_batch, corpus);
+        run("decode", sweep_decode, corpus);
+        run("disasm", sweep_disasm, corpus);
+        run("format", sweep_format, corpus);
+        run("format_fast", sweep_format_fast, corpus);
+
+        if (cli) {
+            strcpy(corpus->path, "/tmp/i286bench.XXXXXX");
+            int fd = mkstemp(corpus->path);
+            if (fd < 0 || write(fd, corpus->bytes, corpus->len) != (ssize_t)corpus->len) {
+                perror("Failed to write the corpus");
+                return 1;
+            }
+
+            close(fd);
+            run("cli", sweep_cli, corpus);
+            unlink(corpus->path);
+        }
+
+        free(corpus->bytes);
+    }
+
+    return 0;
+}
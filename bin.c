@@ -0,0 +1,202 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "i286dis.h"
+
+#define BIN_MAGIC "I286BIN"
+#define BIN_ORDER 0x01020304u
+#define BIN_ALIGN 64
+
+// Records are read in place, their layout is part of the format
+_Static_assert(sizeof(struct oper_rec) == 4, "oper_rec layout changed");
+_Static_assert(sizeof(struct insn_rec) == 20, "insn_rec layout changed");
+
+static uint64_t bin_align(uint64_t off)
+{
+    return (off + BIN_ALIGN - 1) & ~(uint64_t)(BIN_ALIGN - 1);
+}
+
+static bool bin_pad(FILE *fp, uint64_t *off, uint64_t to)
+{
+    static const uint8_t zero[BIN_ALIGN];
+    size_t n = to - *off;
+
+    *off = to;
+    return fwrite(zero, 1, n, fp) == n;
+}
+
+bool dis_bin_write(struct dis *dis, const char *path)
+{
+    uint32_t len = dis->limit - dis->base;
+    uint32_t words = (len + 63) / 64;
+    uint64_t *code = calloc(words ? words : 1, sizeof(uint64_t));
+    uint32_t *rank = malloc((words ? words : 1) * sizeof(uint32_t));
+
+    // Instruction starts, including the ones inside other instructions
+    struct insn *ins;
+    uint32_t n = 0;
+    for (uint32_t idx = 0; dis_iterate_code(dis, &idx, &ins); n++) {
+        uint32_t off = ins->addr - dis->base;
+        code[off / 64] |= 1ULL << (off % 64);
+        idx = off + 1;
+    }
+
+    for (uint32_t i = 0, sum = 0; i < words; i++) {
+        rank[i] = sum;
+        sum += __builtin_popcountll(code[i]);
+    }
+
+    struct dis_bin_header header = { .magic = BIN_MAGIC };
+    header.version = DIS_BIN_VERSION;
+    header.order = BIN_ORDER;
+    header.base = dis->base;
+    header.len = len;
+    header.n = n;
+    header.words = words;
+    header.code = bin_align(sizeof(header));
+    header.rank = bin_align(header.code + words * sizeof(uint64_t));
+    header.recs = bin_align(header.rank + words * sizeof(uint32_t));
+    header.bytes = bin_align(header.recs + (uint64_t)n * sizeof(struct insn_rec));
+    header.size = header.bytes + len;
+
+    bool ok = false;
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        goto out;
+
+    uint64_t off = sizeof(header);
+    ok = fwrite(&header, sizeof(header), 1, fp) == 1
+      && bin_pad(fp, &off, header.code)
+      && fwrite(code, sizeof(uint64_t), words, fp) == words;
+
+    off += words * sizeof(uint64_t);
+    ok = ok && bin_pad(fp, &off, header.rank)
+      && fwrite(rank, sizeof(uint32_t), words, fp) == words;
+
+    off += words * sizeof(uint32_t);
+    ok = ok && bin_pad(fp, &off, header.recs);
+
+    // In batches, the records are packed from whatever dis keeps
+    struct insn_rec recs[256];
+    uint32_t batch = 0;
+    for (uint32_t idx = 0; ok && dis_iterate_code(dis, &idx, &ins); ) {
+        idx = ins->addr - dis->base + 1;
+        insn_pack(&recs[batch++], ins);
+
+        if (batch == sizeof(recs) / sizeof(recs[0])) {
+            ok = fwrite(recs, sizeof(struct insn_rec), batch, fp) == batch;
+            batch = 0;
+        }
+    }
+
+    ok = ok && fwrite(recs, sizeof(struct insn_rec), batch, fp) == batch;
+
+    off += (uint64_t)n * sizeof(struct insn_rec);
+    ok = ok && bin_pad(fp, &off, header.bytes)
+      && fwrite(dis->bytes, 1, len, fp) == len;
+
+    ok &= fclose(fp) == 0;
+
+out:
+    free(code);
+    free(rank);
+    return ok;
+}
+
+// Every rank is the count of the bits before its word, the bits add up
+// to n and none is set past len
+static bool bin_index_ok(const uint8_t *map, const struct dis_bin_header *header)
+{
+    const uint64_t *code = (const uint64_t *)(map + header->code);
+    const uint32_t *rank = (const uint32_t *)(map + header->rank);
+    uint32_t sum = 0;
+
+    for (uint32_t i = 0; i < header->words; i++) {
+        if (rank[i] != sum)
+            return false;
+
+        sum += __builtin_popcountll(code[i]);
+    }
+
+    if (header->len % 64 && code[header->words - 1] >> (header->len % 64))
+        return false;
+
+    return sum == header->n;
+}
+
+bool dis_bin_open(struct dis_bin *bin, const char *path)
+{
+    memset(bin, 0, sizeof(struct dis_bin));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct dis_bin_header)) {
+        close(fd);
+        return false;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    const struct dis_bin_header *header = map;
+    uint32_t words = (header->len + 63) / 64;
+
+    // The sections have to fit the file, and the bitmap and ranks have to
+    // agree with n so dis_bin_lookup stays within recs. The instructions
+    // themselves are trusted to be what dis_bin_write put there.
+    if (memcmp(header->magic, BIN_MAGIC, sizeof(BIN_MAGIC)) != 0
+        || header->version != DIS_BIN_VERSION || header->order != BIN_ORDER
+        || header->words != words || header->n > header->len
+        || header->size != (uint64_t)st.st_size
+        || header->code % BIN_ALIGN || header->rank % BIN_ALIGN || header->recs % BIN_ALIGN
+        || header->code < sizeof(struct dis_bin_header)
+        || header->rank < header->code + words * sizeof(uint64_t)
+        || header->recs < header->rank + words * sizeof(uint32_t)
+        || header->bytes < header->recs + (uint64_t)header->n * sizeof(struct insn_rec)
+        || header->bytes + header->len != header->size
+        || !bin_index_ok(map, header)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    const uint8_t *base = map;
+    bin->header = header;
+    bin->code = (const uint64_t *)(base + header->code);
+    bin->rank = (const uint32_t *)(base + header->rank);
+    bin->recs = (const struct insn_rec *)(base + header->recs);
+    bin->bytes = base + header->bytes;
+    bin->n = header->n;
+    bin->size = st.st_size;
+    return true;
+}
+
+void dis_bin_close(struct dis_bin *bin)
+{
+    if (bin->header)
+        munmap((void *)bin->header, bin->size);
+
+    memset(bin, 0, sizeof(struct dis_bin));
+}
+
+const struct insn_rec *dis_bin_lookup(const struct dis_bin *bin, uint32_t addr)
+{
+    uint32_t off = addr - bin->header->base;
+    if (off >= bin->header->len || !(bin->code[off / 64] >> (off % 64) & 1))
+        return NULL;
+
+    uint64_t below = bin->code[off / 64] & ((1ULL << (off % 64)) - 1);
+    return &bin->recs[bin->rank[off / 64] + __builtin_popcountll(below)];
+}
@@ -0,0 +1,379 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "i286dis.h"
+
+#define CACHE_MAGIC "I286DIS"
+// Written in host byte order, a cache from a machine of the other
+// order reads this back swapped and is ignored
+#define CACHE_ORDER 0x01020304u
+
+#define HASH_MUL1 0x9E3779B97F4A7C15ULL
+#define HASH_MUL2 0xC2B2AE3D27D4EB4FULL
+
+struct cache_hash {
+    uint64_t h[2];
+};
+
+static uint64_t rotl(uint64_t x, int n)
+{
+    return x << n | x >> (64 - n);
+}
+
+static void hash_init(struct cache_hash *hash, uint64_t seed)
+{
+    hash->h[0] = seed ^ HASH_MUL1;
+    hash->h[1] = seed ^ HASH_MUL2;
+}
+
+static void hash_word(struct cache_hash *hash, uint64_t w)
+{
+    hash->h[0] = rotl((hash->h[0] ^ w) * HASH_MUL1, 29);
+    hash->h[1] = rotl((hash->h[1] + w) * HASH_MUL2, 31) ^ hash->h[0];
+}
+
+// Eight bytes a step, the image hash has to stay well ahead of decoding
+static void hash_bytes(struct cache_hash *hash, const void *bytes, size_t len)
+{
+    const uint8_t *p = bytes;
+
+    for (; len >= 8; p += 8, len -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        hash_word(hash, w);
+    }
+
+    uint64_t w = 0;
+    memcpy(&w, p, len);
+    hash_word(hash, w ^ (uint64_t)len << 56);
+}
+
+static void hash_final(struct cache_hash *hash)
+{
+    for (int i = 0; i < 2; i++) {
+        uint64_t h = hash->h[i] ^ hash->h[1 - i] >> 17;
+        h ^= h >> 33;
+        h *= HASH_MUL1;
+        h ^= h >> 29;
+        hash->h[i] = h;
+    }
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The entries sorted without duplicates, the traversal doesn't depend on
+// their order
+static uint32_t cache_roots(const struct dis *dis, uint32_t **roots)
+{
+    const struct worklist *work = &dis->entries;
+    uint32_t n = 0;
+
+    *roots = malloc((work->nroots ? work->nroots : 1) * sizeof(uint32_t));
+    memcpy(*roots, work->roots, work->nroots * sizeof(uint32_t));
+    qsort(*roots, work->nroots, sizeof(uint32_t), compare_u32);
+
+    for (uint32_t i = 0; i < work->nroots; i++) {
+        if (n == 0 || (*roots)[n - 1] != (*roots)[i])
+            (*roots)[n++] = (*roots)[i];
+    }
+
+    return n;
+}
+
+static void cache_key(const struct dis *dis, const uint32_t *roots, uint32_t nroots,
+                      uint64_t key[2])
+{
+    struct cache_hash hash;
+    hash_init(&hash, DIS_CACHE_VERSION);
+
+    hash_bytes(&hash, dis->bytes, dis->limit - dis->base);
+    hash_word(&hash, (uint64_t)dis->base << 32 | (dis->limit - dis->base));
+    hash_bytes(&hash, roots, nroots * sizeof(uint32_t));
+    hash_final(&hash);
+
+    key[0] = hash.h[0];
+    key[1] = hash.h[1];
+}
+
+static char *cache_path(const char *dir, const uint64_t key[2], const char *suffix)
+{
+    size_t size = strlen(dir) + 64;
+    char *path = malloc(size);
+
+    snprintf(path, size, "%s/%016llx%016llx%s", dir, (unsigned long long)key[0],
+             (unsigned long long)key[1], suffix);
+    return path;
+}
+
+uint64_t dis_cache_sum(const void *payload, size_t size)
+{
+    struct cache_hash hash;
+    hash_init(&hash, CACHE_ORDER);
+    hash_bytes(&hash, payload, size);
+    hash_final(&hash);
+
+    return hash.h[0];
+}
+
+static size_t payload_size(const struct dis_cache_header *header)
+{
+    return (size_t)header->nroots * sizeof(uint32_t) + (size_t)header->n * 8
+         + (size_t)header->nslots * sizeof(struct oper_rec);
+}
+
+// Whether an operand slot read back from a file unpacks to something
+// the rest of the library can index its tables with
+static bool cache_oper_ok(const struct oper_rec *oper)
+{
+    switch (oper->flags) {
+        case I286_OPER_IMM8:
+        case I286_OPER_IMM16:
+        case I286_OPER_IMM32:
+            return true;
+        case I286_OPER_REG:
+            return oper->sel <= I286_REG_DI;
+        case I286_OPER_SEG:
+            return oper->sel <= I286_SEG_DS;
+        case I286_OPER_MEM:
+            return oper->sel <= I286_MEM_DS_BX;
+    }
+
+    return false;
+}
+
+bool dis_cache_load(struct dis *dis, const char *dir)
+{
+    uint32_t *roots;
+    uint32_t nroots = cache_roots(dis, &roots);
+
+    uint64_t key[2];
+    cache_key(dis, roots, nroots, key);
+
+    char *path = cache_path(dir, key, ".dis");
+    FILE *fp = fopen(path, "rb");
+    free(path);
+
+    if (!fp) {
+        free(roots);
+        return false;
+    }
+
+    bool hit = false;
+    uint8_t *payload = NULL;
+    struct dis_cache_header header;
+
+    if (fread(&header, sizeof(header), 1, fp) != 1)
+        goto out;
+
+    if (memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+        || header.version != DIS_CACHE_VERSION || header.order != CACHE_ORDER
+        || header.key[0] != key[0] || header.key[1] != key[1]
+        || header.base != dis->base || header.len != dis->limit - dis->base
+        || header.nroots != nroots || header.n > header.len)
+        goto out;
+
+    size_t size = payload_size(&header);
+    payload = malloc(size ? size : 1);
+
+    if (fread(payload, 1, size, fp) != size || fgetc(fp) != EOF)
+        goto out;
+
+    if (dis_cache_sum(payload, size) != header.sum)
+        goto out;
+
+    // Guards against the key colliding
+    if (memcmp(payload, roots, nroots * sizeof(uint32_t)) != 0)
+        goto out;
+
+    const uint32_t *addr = (const uint32_t *)(payload + nroots * sizeof(uint32_t));
+    const uint8_t *len = (const uint8_t *)(addr + header.n);
+    const uint8_t *op = len + header.n;
+    const uint8_t *pref = op + header.n;
+    const uint8_t *nopers = pref + header.n;
+    const struct oper_rec *opers = (const struct oper_rec *)(nopers + header.n);
+
+    // Check everything before touching dis, a bad file is just a miss
+    uint32_t slots = 0;
+    for (uint32_t i = 0; i < header.n; i++) {
+        uint32_t off = addr[i] - dis->base;
+        if (off >= header.len || len[i] == 0 || len[i] > DIS_INSN_MAX
+            || len[i] > header.len - off || op[i] >= I286_OPCODE_N
+            || nopers[i] > I286_OPER_N || (i && addr[i] <= addr[i - 1]))
+            goto out;
+
+        uint32_t first = slots;
+        for (int j = 0; j < nopers[i] && slots < header.nslots; j++) {
+            if (!cache_oper_ok(&opers[slots]))
+                goto out;
+
+            slots += opers[slots].flags == I286_OPER_IMM32 ? 2 : 1;
+        }
+
+        if (slots - first > I286_OPER_N)
+            goto out;
+    }
+
+    if (slots != header.nslots)
+        goto out;
+
+    if (dis->flags & DIS_COMPACT && dis->store.n == 0) {
+        store_load(&dis->store, header.n, addr, len, op, pref, nopers, opers, header.nslots);
+
+        // Filled without dis_insert, which would have seen the branches
+        for (uint32_t i = 0; dis->flags & DIS_XREFS && i < header.n; i++)
+            dis_xref_add(dis, dis_lookup(dis, addr[i]));
+    } else {
+        struct insn_rec rec;
+        slots = 0;
+
+        for (uint32_t i = 0; i < header.n; i++) {
+            memset(&rec, 0, sizeof(rec));
+            rec.addr = addr[i];
+            rec.len = len[i];
+            rec.op = op[i];
+            rec.pref = pref[i];
+            rec.nopers = nopers[i];
+
+            int n = 0;
+            for (int j = 0; j < rec.nopers; j++)
+                n += opers[slots + n].flags == I286_OPER_IMM32 ? 2 : 1;
+
+            memcpy(rec.opers, opers + slots, n * sizeof(struct oper_rec));
+            slots += n;
+
+            dis_insert(dis, &rec);
+        }
+
+        if (dis->flags & DIS_COMPACT)
+            store_finalize(&dis->store);
+    }
+
+    // The entries were consumed, as by dis_disasm
+    dis->entries.n = 0;
+    hit = true;
+
+out:
+    fclose(fp);
+    free(payload);
+    free(roots);
+    return hit;
+}
+
+bool dis_cache_save(struct dis *dis, const char *dir)
+{
+    struct dis_cache_header header = { .magic = CACHE_MAGIC };
+    header.version = DIS_CACHE_VERSION;
+    header.order = CACHE_ORDER;
+    header.base = dis->base;
+    header.len = dis->limit - dis->base;
+
+    uint32_t *roots;
+    header.nroots = cache_roots(dis, &roots);
+    cache_key(dis, roots, header.nroots, header.key);
+
+    struct store *store = &dis->store;
+    bool compact = dis->flags & DIS_COMPACT;
+
+    struct insn *ins;
+    uint32_t idx = 0;
+    if (compact) {
+        store_finalize(store);
+        header.n = store->n;
+    } else {
+        while (dis_iterate_code(dis, &idx, &ins)) {
+            header.n++;
+            idx = ins->addr - dis->base + 1;
+        }
+    }
+
+    // Worst case, every operand an IMM32
+    size_t size = (size_t)header.nroots * sizeof(uint32_t) + (size_t)header.n * 8
+                + (size_t)header.n * I286_OPER_N * 2 * sizeof(struct oper_rec);
+    uint8_t *payload = malloc(size ? size : 1);
+
+    memcpy(payload, roots, header.nroots * sizeof(uint32_t));
+    uint32_t *addr = (uint32_t *)(payload + header.nroots * sizeof(uint32_t));
+    uint8_t *len = (uint8_t *)(addr + header.n);
+    uint8_t *op = len + header.n;
+    uint8_t *pref = op + header.n;
+    uint8_t *nopers = pref + header.n;
+    struct oper_rec *opers = (struct oper_rec *)(nopers + header.n);
+
+    if (compact) {
+        // The columns are copied as they are. The operand slots are
+        // copied instruction by instruction, which drops the dead slots
+        // of removed and replaced instructions.
+        memcpy(addr, store->addr, header.n * sizeof(uint32_t));
+        memcpy(len, store->len, header.n);
+        memcpy(op, store->op, header.n);
+        memcpy(pref, store->pref, header.n);
+        memcpy(nopers, store->nopers, header.n);
+
+        for (uint32_t i = 0; i < header.n; i++) {
+            const struct oper_rec *from = store->opers + store->oper[i];
+            for (int j = 0; j < nopers[i]; j++) {
+                opers[header.nslots++] = *from;
+                if (from++->flags == I286_OPER_IMM32)
+                    opers[header.nslots++] = *from++;
+            }
+        }
+    } else {
+        // Every start is kept, instructions can overlap
+        struct insn_rec rec;
+        uint32_t i = 0;
+        idx = 0;
+        while (dis_iterate_code(dis, &idx, &ins)) {
+            idx = ins->addr - dis->base + 1;
+            insn_pack(&rec, ins);
+
+            addr[i] = rec.addr;
+            len[i] = rec.len;
+            op[i] = rec.op;
+            pref[i] = rec.pref;
+            nopers[i] = rec.nopers;
+            i++;
+
+            int n = 0;
+            for (int j = 0; j < rec.nopers; j++)
+                n += rec.opers[n].flags == I286_OPER_IMM32 ? 2 : 1;
+
+            memcpy(opers + header.nslots, rec.opers, n * sizeof(struct oper_rec));
+            header.nslots += n;
+        }
+    }
+
+    size = payload_size(&header);
+    header.sum = dis_cache_sum(payload, size);
+
+    // Written aside and renamed into place, so concurrent jobs only ever
+    // see complete files
+    char *path = cache_path(dir, header.key, ".dis");
+    char *tmp = malloc(strlen(path) + 32);
+    sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+
+    bool ok = false;
+    FILE *fp = fopen(tmp, "wb");
+    if (fp) {
+        ok = fwrite(&header, sizeof(header), 1, fp) == 1
+          && fwrite(payload, 1, size, fp) == size;
+        ok &= fclose(fp) == 0;
+        ok = ok && rename(tmp, path) == 0;
+
+        if (!ok)
+            remove(tmp);
+    }
+
+    free(tmp);
+    free(path);
+    free(payload);
+    free(roots);
+    return ok;
+}
@@ -0,0 +1,930 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i286dis.h"
+
+#define CALLS_MIN 1024
+// Stack words a frame keeps track of, enough for the registers a
+// function saves
+#define FRAME_SAVED 16
+// Stack offset that isn't known, anything added to it stays unknown
+#define SP_UNKNOWN INT32_MIN
+
+#define CLOBBER_SEG(seg) (1u << (8 + (seg)))
+#define CLOBBER_GPRS (0xffu & ~SUMMARY_REG(I286_REG_SP))
+#define CLOBBER_ALL (CLOBBER_GPRS | CLOBBER_SEG(I286_SEG_ES) | CLOBBER_SEG(I286_SEG_DS))
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+// The function starting at addr, CFG_NONE if none does
+static uint32_t func_at(const struct cfg *cfg, const struct funcs *funcs, uint32_t addr)
+{
+    uint32_t b = cfg_block_of(cfg, addr);
+    if (b == CFG_NONE || funcs->func_of[b] == CFG_NONE
+        || funcs->items[funcs->func_of[b]].start != addr)
+        return CFG_NONE;
+
+    return funcs->func_of[b];
+}
+
+// Tarjan's algorithm without recursion, components are numbered as they
+// complete, which puts callees first
+static void callgraph_scc(struct callgraph *graph)
+{
+    uint32_t n = graph->n;
+    uint32_t *index = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *low = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *pos = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *stack = malloc((n ? n : 1) * sizeof(uint32_t));
+    uint32_t *path = malloc((n ? n : 1) * sizeof(uint32_t));
+    bool *on_stack = calloc(n ? n : 1, sizeof(bool));
+
+    for (uint32_t f = 0; f < n; f++)
+        index[f] = CFG_NONE;
+
+    uint32_t next = 0, nstack = 0;
+
+    for (uint32_t root = 0; root < n; root++) {
+        if (index[root] != CFG_NONE)
+            continue;
+
+        uint32_t depth = 0;
+        path[depth++] = root;
+        index[root] = low[root] = next++;
+        pos[root] = graph->call_idx[root];
+        stack[nstack++] = root;
+        on_stack[root] = true;
+
+        while (depth) {
+            uint32_t f = path[depth - 1];
+
+            if (pos[f] < graph->call_idx[f + 1]) {
+                uint32_t g = graph->calls[pos[f]++];
+
+                if (index[g] == CFG_NONE) {
+                    index[g] = low[g] = next++;
+                    pos[g] = graph->call_idx[g];
+                    stack[nstack++] = g;
+                    on_stack[g] = true;
+                    path[depth++] = g;
+                } else if (on_stack[g] && index[g] < low[f]) {
+                    low[f] = index[g];
+                }
+                continue;
+            }
+
+            depth--;
+            if (depth && low[f] < low[path[depth - 1]])
+                low[path[depth - 1]] = low[f];
+
+            if (low[f] != index[f])
+                continue;
+
+            uint32_t g;
+            do {
+                g = stack[--nstack];
+                on_stack[g] = false;
+                graph->scc_of[g] = graph->nsccs;
+            } while (g != f);
+
+            graph->nsccs++;
+        }
+    }
+
+    // Members of each component in address order
+    graph->scc_idx = calloc(graph->nsccs + 1, sizeof(uint32_t));
+    graph->members = malloc((n ? n : 1) * sizeof(uint32_t));
+
+    for (uint32_t f = 0; f < n; f++)
+        graph->scc_idx[graph->scc_of[f] + 1]++;
+
+    for (uint32_t c = 0; c < graph->nsccs; c++)
+        graph->scc_idx[c + 1] += graph->scc_idx[c];
+
+    memcpy(pos, graph->scc_idx, graph->nsccs * sizeof(uint32_t));
+    for (uint32_t f = 0; f < n; f++)
+        graph->members[pos[graph->scc_of[f]]++] = f;
+
+    free(index);
+    free(low);
+    free(pos);
+    free(stack);
+    free(path);
+    free(on_stack);
+}
+
+void callgraph_build(struct callgraph *graph, const struct cfg *cfg, const struct funcs *funcs)
+{
+    memset(graph, 0, sizeof(struct callgraph));
+    graph->n = funcs->n;
+    graph->call_idx = calloc(funcs->n + 1, sizeof(uint32_t));
+    graph->scc_of = malloc((funcs->n ? funcs->n : 1) * sizeof(uint32_t));
+    graph->summaries = calloc(funcs->n ? funcs->n : 1, sizeof(struct summary));
+
+    // Every edge out of a function's blocks into the start of a function
+    // is a call or a tail call, the function's own start included
+    uint32_t cap = CALLS_MIN;
+    graph->calls = malloc(cap * sizeof(uint32_t));
+
+    for (uint32_t f = 0; f < funcs->n; f++) {
+        uint32_t first = graph->ncalls;
+
+        for (uint32_t i = funcs->block_idx[f]; i < funcs->block_idx[f + 1]; i++) {
+            uint32_t b = funcs->blocks[i];
+
+            for (uint32_t e = cfg->succ_idx[b]; e < cfg->succ_idx[b + 1]; e++) {
+                uint32_t g = func_at(cfg, funcs, cfg->start[cfg->succ[e]]);
+                if (g == CFG_NONE)
+                    continue;
+
+                if (graph->ncalls == cap) {
+                    cap *= 2;
+                    graph->calls = realloc(graph->calls, cap * sizeof(uint32_t));
+                }
+
+                graph->calls[graph->ncalls++] = g;
+            }
+        }
+
+        qsort(graph->calls + first, graph->ncalls - first, sizeof(uint32_t), compare_u32);
+
+        uint32_t n = first;
+        for (uint32_t i = first; i < graph->ncalls; i++) {
+            if (n == first || graph->calls[n - 1] != graph->calls[i])
+                graph->calls[n++] = graph->calls[i];
+        }
+
+        graph->ncalls = n;
+        graph->call_idx[f + 1] = n;
+    }
+
+    callgraph_scc(graph);
+}
+
+void callgraph_deinit(struct callgraph *graph)
+{
+    free(graph->call_idx);
+    free(graph->calls);
+    free(graph->scc_of);
+    free(graph->scc_idx);
+    free(graph->members);
+    free(graph->summaries);
+}
+
+struct summarize {
+    struct dis *dis;
+    const struct cfg *cfg;
+    const struct funcs *funcs;
+    struct callgraph *graph;
+};
+
+// A stack word known to hold the value reg had on entry, at offset off
+// from the entry sp
+struct saved {
+    int32_t off;
+    uint32_t reg;
+};
+
+// What is known at a point of a function. dirty has the registers whose
+// value may differ from the one on entry, saved the stack words that
+// still hold entry values for pop to restore. Only words at or above
+// sp are kept, writes through bp into them are noticed and writes
+// through other pointers are assumed to miss them.
+struct frame {
+    int32_t sp;
+    int32_t bp;
+    uint32_t dirty;
+    uint32_t nsaved;
+    struct saved saved[FRAME_SAVED];
+};
+
+// State of one path through a function
+struct path {
+    struct frame frame;
+    bool have_delta;
+    struct summary sum;
+};
+
+static int32_t sp_add(int32_t sp, int32_t n)
+{
+    return sp == SP_UNKNOWN ? SP_UNKNOWN : sp + n;
+}
+
+static uint32_t reg_clobber(const struct oper *oper)
+{
+    if (!oper)
+        return 0;
+
+    if (oper->flags == I286_OPER_SEG)
+        return CLOBBER_SEG(oper->seg);
+
+    if (oper->flags == I286_OPER_REG && oper->reg != I286_REG_SP)
+        return SUMMARY_REG(oper->reg);
+
+    return 0;
+}
+
+// Registers an instruction writes besides the stack pointer
+static uint32_t insn_clobbers(const struct insn *ins)
+{
+    const struct oper *first = ins->opers;
+    const struct oper *second = first ? first->next : NULL;
+    uint32_t regs = 0;
+    uint32_t si = SUMMARY_REG(I286_REG_SI), di = SUMMARY_REG(I286_REG_DI);
+
+    if (ins->pref & (PRE_REP | PRE_REPNE))
+        regs |= SUMMARY_REG(I286_REG_CX);
+
+    switch (ins->op) {
+        case I286_MUL:
+        case I286_DIV:
+        case I286_IDIV:
+            return SUMMARY_REG(I286_REG_AX) | SUMMARY_REG(I286_REG_DX);
+
+        case I286_IMUL:
+            if (second)
+                return reg_clobber(first);
+            return SUMMARY_REG(I286_REG_AX) | SUMMARY_REG(I286_REG_DX);
+
+        case I286_CWD:
+            return SUMMARY_REG(I286_REG_DX);
+
+        case I286_AAA:
+        case I286_AAD:
+        case I286_AAM:
+        case I286_AAS:
+        case I286_DAA:
+        case I286_DAS:
+        case I286_CBW:
+        case I286_LAHF:
+        case I286_SALC:
+        case I286_XLAT:
+            return SUMMARY_REG(I286_REG_AX);
+
+        case I286_LODSB:
+        case I286_LODSW:
+            return regs | SUMMARY_REG(I286_REG_AX) | si;
+        case I286_MOVSB:
+        case I286_MOVSW:
+        case I286_CMPSB:
+        case I286_CMPSW:
+            return regs | si | di;
+        case I286_STOSB:
+        case I286_STOSW:
+        case I286_SCASB:
+        case I286_SCASW:
+        case I286_INSB:
+        case I286_INSW:
+            return regs | di;
+        case I286_OUTSB:
+        case I286_OUTSW:
+            return regs | si;
+
+        case I286_LOOP:
+        case I286_LOOPZ:
+        case I286_LOOPNZ:
+            return SUMMARY_REG(I286_REG_CX);
+
+        case I286_XCHG:
+            return reg_clobber(first) | reg_clobber(second);
+        case I286_LDS:
+            return reg_clobber(first) | CLOBBER_SEG(I286_SEG_DS);
+        case I286_LES:
+            return reg_clobber(first) | CLOBBER_SEG(I286_SEG_ES);
+
+        case I286_POPA:
+            return CLOBBER_GPRS;
+        case I286_ENTER:
+        case I286_LEAVE:
+            return SUMMARY_REG(I286_REG_BP);
+
+        // Interrupt handlers are unknown code
+        case I286_INT:
+            return CLOBBER_ALL;
+
+        // The first operand is only read
+        case I286_CMP:
+        case I286_TEST:
+        case I286_PUSH:
+        case I286_OUT:
+        case I286_BOUND:
+        case I286_CALL:
+        case I286_CALLF:
+        case I286_JMP:
+        case I286_JMPF:
+        case I286_LLDT:
+        case I286_LMSW:
+        case I286_LTR:
+        case I286_VERR:
+        case I286_VERW:
+            return 0;
+
+        default:
+            return first ? reg_clobber(first) : 0;
+    }
+}
+
+// Forgets the saved words overlapping the bytes lo up to hi
+static void frame_forget(struct frame *frame, int32_t lo, int32_t hi)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < frame->nsaved; i++) {
+        int32_t off = frame->saved[i].off;
+        if (lo == SP_UNKNOWN || hi == SP_UNKNOWN || (off + 2 > lo && off < hi))
+            continue;
+
+        frame->saved[n++] = frame->saved[i];
+    }
+
+    frame->nsaved = n;
+}
+
+// Words below sp are gone once sp moves back up past them
+static void frame_trim(struct frame *frame)
+{
+    if (frame->sp != SP_UNKNOWN)
+        frame_forget(frame, INT32_MIN + 1, frame->sp);
+}
+
+// Stores the value of reg into the word at off, which saves it when the
+// register still has its entry value. reg is 0 for anything else.
+static void frame_store(struct frame *frame, int32_t off, uint32_t reg)
+{
+    if (off == SP_UNKNOWN)
+        return;
+
+    frame_forget(frame, off, off + 2);
+    if (reg && !(frame->dirty & reg) && frame->nsaved < FRAME_SAVED)
+        frame->saved[frame->nsaved++] = (struct saved){ off, reg };
+}
+
+// Loads reg from the word at off, restoring its entry value if it was
+// saved there
+static void frame_load(struct frame *frame, int32_t off, uint32_t reg)
+{
+    frame->dirty |= reg;
+    if (off == SP_UNKNOWN)
+        return;
+
+    for (uint32_t i = 0; i < frame->nsaved; i++) {
+        if (frame->saved[i].off == off && frame->saved[i].reg == reg)
+            frame->dirty &= ~reg;
+    }
+}
+
+// Pushes and pops of pusha and popa, ax first
+static const enum reg pusha_regs[] = {
+    I286_REG_AX, I286_REG_CX, I286_REG_DX, I286_REG_BX,
+    I286_REG_SP, I286_REG_BP, I286_REG_SI, I286_REG_DI,
+};
+
+// Writes to the stack through bp, the saved words they hit are gone
+static void frame_write(struct frame *frame, const struct insn *ins)
+{
+    const struct oper *first = ins->opers;
+    if (!first || first->flags != I286_OPER_MEM || ins->op == I286_CMP || ins->op == I286_TEST
+        || ins->op == I286_PUSH)
+        return;
+
+    switch (first->mem.mode) {
+        case I286_MEM_SS_BP: {
+            int32_t at = sp_add(frame->bp, first->mem.disp);
+            frame_forget(frame, at, sp_add(at, 2));
+            break;
+        }
+
+        case I286_MEM_SS_BP_SI:
+        case I286_MEM_SS_BP_DI:
+            frame_forget(frame, SP_UNKNOWN, SP_UNKNOWN);
+            break;
+    }
+}
+
+static void path_exit(struct path *path, int32_t sp)
+{
+    struct summary *sum = &path->sum;
+    sum->flags &= ~SUMMARY_NORETURN;
+    sum->clobbers |= path->frame.dirty;
+
+    // sp is 16 bits, a ret 0xfffe pops -2 as well
+    if (sp != SP_UNKNOWN)
+        sp = (int16_t)sp;
+
+    if (sp == SP_UNKNOWN) {
+        sum->flags |= SUMMARY_NODELTA;
+    } else if (!path->have_delta) {
+        path->have_delta = true;
+        sum->delta = sp;
+    } else if (sum->delta != sp) {
+        sum->flags |= SUMMARY_NODELTA;
+    }
+}
+
+// Applies the summary of function g, CFG_NONE for unknown code, which
+// is assumed to come back. A tail call leaves the function. Returns
+// false if control doesn't go on.
+static bool path_enter(struct summarize *ctx, struct path *path, uint32_t g, bool tail)
+{
+    struct frame *frame = &path->frame;
+    int32_t sp = SP_UNKNOWN;
+
+    if (g == CFG_NONE) {
+        frame->dirty |= CLOBBER_ALL;
+        path->sum.flags |= SUMMARY_INDIRECT;
+    } else {
+        const struct summary *callee = &ctx->graph->summaries[g];
+        if (callee->flags & SUMMARY_NORETURN)
+            return false;
+
+        frame->dirty |= callee->clobbers;
+        path->sum.flags |= callee->flags & SUMMARY_INDIRECT;
+        if (!(callee->flags & SUMMARY_NODELTA))
+            sp = sp_add(frame->sp, callee->delta);
+    }
+
+    if (tail) {
+        path_exit(path, sp);
+        return false;
+    }
+
+    // The callee's frame was below sp
+    frame->sp = sp;
+    frame_trim(frame);
+    return true;
+}
+
+static uint32_t branch_func(struct summarize *ctx, struct insn *ins)
+{
+    uint32_t target;
+    if (!insn_get_branch(ins, &target))
+        return CFG_NONE;
+
+    return func_at(ctx->cfg, ctx->funcs, target);
+}
+
+// Steps the path over ins, false when control doesn't go on to the
+// next instruction
+static bool path_step(struct summarize *ctx, struct path *path, struct insn *ins)
+{
+    struct frame *frame = &path->frame;
+    const struct oper *first = ins->opers;
+    const struct oper *second = first ? first->next : NULL;
+    bool sp_dst = first && first->flags == I286_OPER_REG && first->reg == I286_REG_SP;
+    bool bp_dst = first && first->flags == I286_OPER_REG && first->reg == I286_REG_BP;
+
+    frame_write(frame, ins);
+
+    // Pops take care of their own registers, enter saves bp first
+    if (ins->op != I286_POP && ins->op != I286_POPA && ins->op != I286_LEAVE
+        && ins->op != I286_ENTER)
+        frame->dirty |= insn_clobbers(ins);
+
+    switch (ins->op) {
+        case I286_BAD:
+            return false;
+
+        case I286_PUSH:
+            frame->sp = sp_add(frame->sp, -2);
+            frame_store(frame, frame->sp, reg_clobber(first));
+            return true;
+
+        case I286_PUSHF:
+            frame->sp = sp_add(frame->sp, -2);
+            frame_store(frame, frame->sp, 0);
+            return true;
+
+        case I286_POP:
+            frame_load(frame, frame->sp, reg_clobber(first));
+            frame->sp = sp_dst ? SP_UNKNOWN : sp_add(frame->sp, 2);
+            if (bp_dst)
+                frame->bp = SP_UNKNOWN;
+            frame_trim(frame);
+            return true;
+
+        case I286_POPF:
+            frame->sp = sp_add(frame->sp, 2);
+            frame_trim(frame);
+            return true;
+
+        case I286_PUSHA:
+            for (int i = 0; i < 8; i++) {
+                frame->sp = sp_add(frame->sp, -2);
+                frame_store(frame, frame->sp, reg_clobber(&(struct oper){
+                    .flags = I286_OPER_REG, .reg = pusha_regs[i] }));
+            }
+            return true;
+
+        case I286_POPA:
+            for (int i = 7; i >= 0; i--) {
+                if (pusha_regs[i] != I286_REG_SP) {
+                    frame_load(frame, frame->sp, reg_clobber(&(struct oper){
+                        .flags = I286_OPER_REG, .reg = pusha_regs[i] }));
+                }
+                frame->sp = sp_add(frame->sp, 2);
+            }
+            frame->bp = SP_UNKNOWN;
+            frame_trim(frame);
+            return true;
+
+        case I286_ENTER: {
+            frame->sp = sp_add(frame->sp, -2);
+            frame_store(frame, frame->sp, SUMMARY_REG(I286_REG_BP));
+            frame->dirty |= SUMMARY_REG(I286_REG_BP);
+            frame->bp = frame->sp;
+
+            // The nesting level copies frame pointers below
+            int32_t sp = sp_add(frame->sp, -2 * (second->imm8 & 0x1f));
+            frame_forget(frame, sp, frame->sp);
+            frame->sp = sp_add(sp, -(int32_t)first->imm16);
+            return true;
+        }
+
+        case I286_LEAVE:
+            frame->sp = frame->bp;
+            frame_load(frame, frame->sp, SUMMARY_REG(I286_REG_BP));
+            frame->sp = sp_add(frame->sp, 2);
+            frame->bp = SP_UNKNOWN;
+            frame_trim(frame);
+            return true;
+
+        case I286_MOV:
+            if (sp_dst) {
+                frame->sp = second->flags == I286_OPER_REG && second->reg == I286_REG_BP
+                          ? frame->bp : SP_UNKNOWN;
+                frame_trim(frame);
+            } else if (bp_dst) {
+                frame->bp = second->flags == I286_OPER_REG && second->reg == I286_REG_SP
+                          ? frame->sp : SP_UNKNOWN;
+            }
+            return true;
+
+        case I286_ADD:
+        case I286_SUB:
+            if (sp_dst) {
+                int32_t n = second->flags == I286_OPER_IMM8 ? (int8_t)second->imm8
+                          : second->flags == I286_OPER_IMM16 ? (int16_t)second->imm16
+                          : SP_UNKNOWN;
+                if (n == SP_UNKNOWN)
+                    frame->sp = SP_UNKNOWN;
+                else
+                    frame->sp = sp_add(frame->sp, ins->op == I286_ADD ? n : -n);
+                frame_trim(frame);
+            } else if (bp_dst) {
+                frame->bp = SP_UNKNOWN;
+            }
+            return true;
+
+        case I286_CALL:
+        case I286_CALLF:
+            return path_enter(ctx, path, branch_func(ctx, ins), false);
+
+        case I286_JMP:
+        case I286_JMPF: {
+            // Far jumps are tail calls, near ones are followed as edges
+            uint32_t target;
+            if (ins->op == I286_JMPF || !insn_get_branch(ins, &target))
+                path_enter(ctx, path, branch_func(ctx, ins), true);
+            return false;
+        }
+
+        case I286_RET:
+        case I286_RETF:
+        case I286_IRET:
+            path_exit(path, sp_add(frame->sp, first && first->flags == I286_OPER_IMM16
+                                              ? first->imm16 : 0));
+            return false;
+
+        default: {
+            bool xchg = ins->op == I286_XCHG && second && second->flags == I286_OPER_REG;
+            if (sp_dst || (xchg && second->reg == I286_REG_SP))
+                frame->sp = SP_UNKNOWN;
+            if (bp_dst || (xchg && second->reg == I286_REG_BP))
+                frame->bp = SP_UNKNOWN;
+            return true;
+        }
+    }
+}
+
+// Position of block b among the blocks of function f, or CFG_NONE
+static uint32_t func_block(const struct funcs *funcs, uint32_t f, uint32_t b)
+{
+    uint32_t lo = funcs->block_idx[f], hi = funcs->block_idx[f + 1];
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (funcs->blocks[mid] < b)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == funcs->block_idx[f + 1] || funcs->blocks[lo] != b)
+        return CFG_NONE;
+
+    return lo - funcs->block_idx[f];
+}
+
+// Merges frame into the entry state of a block, true if it changed
+static bool block_merge(struct frame *in, bool *seen, uint32_t i, const struct frame *frame)
+{
+    struct frame *to = &in[i];
+
+    if (!seen[i]) {
+        seen[i] = true;
+        *to = *frame;
+        return true;
+    }
+
+    bool changed = false;
+    if (to->sp != frame->sp && to->sp != SP_UNKNOWN) {
+        to->sp = SP_UNKNOWN;
+        changed = true;
+    }
+    if (to->bp != frame->bp && to->bp != SP_UNKNOWN) {
+        to->bp = SP_UNKNOWN;
+        changed = true;
+    }
+    if ((to->dirty | frame->dirty) != to->dirty) {
+        to->dirty |= frame->dirty;
+        changed = true;
+    }
+
+    // Only words saved on both ways in stay
+    uint32_t n = 0;
+    for (uint32_t j = 0; j < to->nsaved; j++) {
+        bool both = false;
+        for (uint32_t k = 0; k < frame->nsaved; k++) {
+            both |= frame->saved[k].off == to->saved[j].off
+                 && frame->saved[k].reg == to->saved[j].reg;
+        }
+
+        if (both)
+            to->saved[n++] = to->saved[j];
+    }
+
+    changed |= n != to->nsaved;
+    to->nsaved = n;
+    return changed;
+}
+
+// Summary of f from the current summaries of its callees. Frames flow
+// through the blocks until they settle, a block reached with two
+// different offsets gets an unknown one. A register counts as clobbered
+// if its value may differ from the entry one at some return.
+static struct summary summarize_func(struct summarize *ctx, uint32_t f)
+{
+    const struct funcs *funcs = ctx->funcs;
+    const struct cfg *cfg = ctx->cfg;
+    uint32_t first = funcs->block_idx[f];
+    uint32_t nblocks = funcs->block_idx[f + 1] - first;
+
+    struct frame *in = malloc((nblocks ? nblocks : 1) * sizeof(struct frame));
+    bool *seen = calloc(nblocks ? nblocks : 1, sizeof(bool));
+    bool *queued = calloc(nblocks ? nblocks : 1, sizeof(bool));
+    uint32_t *work = malloc((nblocks ? nblocks : 1) * sizeof(uint32_t));
+
+    struct path path = { .sum = { .flags = SUMMARY_NORETURN } };
+    uint32_t n = 0;
+
+    uint32_t start = func_block(funcs, f, cfg_block_of(cfg, funcs->items[f].start));
+    block_merge(in, seen, start, &(struct frame){ .sp = 0, .bp = SP_UNKNOWN });
+    work[n++] = start;
+    queued[start] = true;
+
+    while (n) {
+        uint32_t i = work[--n];
+        uint32_t b = funcs->blocks[first + i];
+        queued[i] = false;
+
+        path.frame = in[i];
+
+        uint32_t addr = cfg->start[b];
+        bool runs_on = true;
+
+        for (uint32_t j = 0; j < cfg->ninsns[b] && runs_on; j++) {
+            struct insn buf, *ins = dis_lookup_r(ctx->dis, addr, &buf);
+            runs_on = path_step(ctx, &path, ins);
+            addr += ins->len;
+        }
+
+        for (uint32_t e = cfg->succ_idx[b]; e < cfg->succ_idx[b + 1]; e++) {
+            uint32_t to = cfg->succ[e];
+
+            switch (cfg->succ_kind[e]) {
+                case CFG_EDGE_FALL:
+                    if (!runs_on)
+                        continue;
+                    break;
+                case CFG_EDGE_COND:
+                case CFG_EDGE_JUMP:
+                    break;
+                default:
+                    continue;
+            }
+
+            // Into the start of a function, this one's included, is a
+            // tail call. Into the middle of another is unknown.
+            uint32_t g = func_at(cfg, funcs, cfg->start[to]);
+            uint32_t at = func_block(funcs, f, to);
+
+            if (g != CFG_NONE || at == CFG_NONE)
+                path_enter(ctx, &path, g, true);
+            else if (block_merge(in, seen, at, &path.frame) && !queued[at]) {
+                queued[at] = true;
+                work[n++] = at;
+            }
+        }
+    }
+
+    free(in);
+    free(seen);
+    free(queued);
+    free(work);
+
+    if (path.sum.flags & (SUMMARY_NORETURN | SUMMARY_NODELTA))
+        path.sum.delta = 0;
+
+    return path.sum;
+}
+
+// Joins b into a, true if a changed. Summaries of a component only grow,
+// so iterating them stops.
+static bool summary_join(struct summary *a, const struct summary *b)
+{
+    struct summary old = *a;
+
+    a->clobbers |= b->clobbers;
+
+    if (b->flags & SUMMARY_NORETURN) {
+        // Nothing to add
+    } else if (a->flags & SUMMARY_NORETURN) {
+        a->delta = b->delta;
+        a->flags = b->flags | (a->flags & SUMMARY_INDIRECT);
+    } else {
+        a->flags |= b->flags;
+        if (a->delta != b->delta)
+            a->flags |= SUMMARY_NODELTA;
+    }
+
+    if (a->flags & SUMMARY_NODELTA)
+        a->delta = 0;
+
+    return memcmp(&old, a, sizeof(struct summary)) != 0;
+}
+
+// Members start out never returning and are evaluated again until
+// none changes. A function that doesn't call itself settles at once.
+static void summarize_scc(struct summarize *ctx, uint32_t c)
+{
+    struct callgraph *graph = ctx->graph;
+    uint32_t first = graph->scc_idx[c], last = graph->scc_idx[c + 1];
+
+    bool recursive = last - first > 1;
+    for (uint32_t i = first; i < last; i++) {
+        uint32_t f = graph->members[i];
+        graph->summaries[f] = (struct summary){ .flags = SUMMARY_NORETURN };
+
+        for (uint32_t e = graph->call_idx[f]; e < graph->call_idx[f + 1]; e++)
+            recursive |= graph->calls[e] == f;
+    }
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+
+        for (uint32_t i = first; i < last; i++) {
+            uint32_t f = graph->members[i];
+            struct summary sum = summarize_func(ctx, f);
+            changed |= summary_join(&graph->summaries[f], &sum);
+        }
+
+        changed &= recursive;
+    }
+}
+
+// Components wait for the ones they call, pending counts them down and
+// workers take whatever is ready
+struct scc_pool {
+    struct summarize *ctx;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint32_t *pending;
+    uint32_t *dep_idx;
+    uint32_t *deps;
+    uint32_t *ready;
+    uint32_t nready;
+    uint32_t done;
+};
+
+static void *scc_worker(void *arg)
+{
+    struct scc_pool *pool = arg;
+    uint32_t nsccs = pool->ctx->graph->nsccs;
+
+    pthread_mutex_lock(&pool->lock);
+
+    while (true) {
+        while (pool->nready == 0 && pool->done < nsccs)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+
+        if (pool->done == nsccs)
+            break;
+
+        uint32_t c = pool->ready[--pool->nready];
+        pthread_mutex_unlock(&pool->lock);
+
+        summarize_scc(pool->ctx, c);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->done++;
+
+        for (uint32_t i = pool->dep_idx[c]; i < pool->dep_idx[c + 1]; i++) {
+            if (--pool->pending[pool->deps[i]] == 0)
+                pool->ready[pool->nready++] = pool->deps[i];
+        }
+
+        pthread_cond_broadcast(&pool->cond);
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+void callgraph_summarize(struct callgraph *graph, struct dis *dis, const struct cfg *cfg,
+                         const struct funcs *funcs, int threads)
+{
+    struct summarize ctx = { .dis = dis, .cfg = cfg, .funcs = funcs, .graph = graph };
+
+    // Components are numbered callees first, in order they're ready
+    if (threads <= 1) {
+        for (uint32_t c = 0; c < graph->nsccs; c++)
+            summarize_scc(&ctx, c);
+        return;
+    }
+
+    struct scc_pool pool = { .ctx = &ctx };
+    uint32_t nsccs = graph->nsccs;
+    pool.pending = calloc(nsccs ? nsccs : 1, sizeof(uint32_t));
+    pool.dep_idx = calloc(nsccs + 1, sizeof(uint32_t));
+    pool.deps = malloc((graph->ncalls ? graph->ncalls : 1) * sizeof(uint32_t));
+    pool.ready = malloc((nsccs ? nsccs : 1) * sizeof(uint32_t));
+
+    // Calls between components, a component waits once for each
+    for (uint32_t f = 0; f < graph->n; f++) {
+        for (uint32_t e = graph->call_idx[f]; e < graph->call_idx[f + 1]; e++) {
+            uint32_t callee = graph->scc_of[graph->calls[e]];
+            if (callee != graph->scc_of[f]) {
+                pool.dep_idx[callee + 1]++;
+                pool.pending[graph->scc_of[f]]++;
+            }
+        }
+    }
+
+    for (uint32_t c = 0; c < nsccs; c++)
+        pool.dep_idx[c + 1] += pool.dep_idx[c];
+
+    uint32_t *pos = malloc((nsccs ? nsccs : 1) * sizeof(uint32_t));
+    memcpy(pos, pool.dep_idx, nsccs * sizeof(uint32_t));
+
+    for (uint32_t f = 0; f < graph->n; f++) {
+        for (uint32_t e = graph->call_idx[f]; e < graph->call_idx[f + 1]; e++) {
+            uint32_t callee = graph->scc_of[graph->calls[e]];
+            if (callee != graph->scc_of[f])
+                pool.deps[pos[callee]++] = graph->scc_of[f];
+        }
+    }
+
+    free(pos);
+
+    for (uint32_t c = nsccs; c-- > 0; ) {
+        if (pool.pending[c] == 0)
+            pool.ready[pool.nready++] = c;
+    }
+
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    // The calling thread works too
+    pthread_t *tids = malloc((threads - 1) * sizeof(pthread_t));
+    for (int i = 0; i < threads - 1; i++)
+        pthread_create(&tids[i], NULL, scc_worker, &pool);
+
+    scc_worker(&pool);
+
+    for (int i = 0; i < threads - 1; i++)
+        pthread_join(tids[i], NULL);
+
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+
+    free(tids);
+    free(pool.pending);
+    free(pool.dep_idx);
+    free(pool.deps);
+    free(pool.ready);
+}
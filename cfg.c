@@ -0,0 +1,250 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "i286dis.h"
+
+#define CFG_MIN 1024
+
+// What cfg_build needs of each instruction, in address order
+struct cfg_insn {
+    uint32_t addr;
+    uint32_t next;
+    uint32_t target;
+    uint8_t kind;
+    // Last instruction of its block
+    bool ends;
+    // Control can continue at next
+    bool falls;
+};
+
+static bool bit_test(const uint64_t *bits, uint32_t off)
+{
+    return bits[off / 64] >> (off % 64) & 1;
+}
+
+static void bit_set(uint64_t *bits, uint32_t off)
+{
+    bits[off / 64] |= 1ULL << (off % 64);
+}
+
+const char *cfg_edge_names[] = {
+    [CFG_EDGE_FALL] = "fall",
+    [CFG_EDGE_COND] = "cond",
+    [CFG_EDGE_JUMP] = "jump",
+    [CFG_EDGE_CALL] = "call",
+    [CFG_EDGE_FAR]  = "far",
+};
+
+// Index of the instruction starting at off, the caller knows there is one
+static uint32_t cfg_index(const struct cfg *cfg, uint32_t off)
+{
+    uint64_t below = cfg->code[off / 64] & ((1ULL << (off % 64)) - 1);
+    return cfg->rank[off / 64] + __builtin_popcountll(below);
+}
+
+static bool cfg_has(const struct cfg *cfg, uint32_t addr)
+{
+    uint32_t off = addr - cfg->base;
+    return off < cfg->len && bit_test(cfg->code, off);
+}
+
+uint32_t cfg_block_of(const struct cfg *cfg, uint32_t addr)
+{
+    if (!cfg_has(cfg, addr))
+        return CFG_NONE;
+
+    return cfg->block[cfg_index(cfg, addr - cfg->base)];
+}
+
+// Groups the edges by from in CSR form, idx gets nblocks + 1 offsets
+static void cfg_csr(uint32_t nblocks, uint32_t nedges, const uint32_t *from, const uint32_t *to,
+                    const uint8_t *kind, uint32_t **idx, uint32_t **adj, uint8_t **adj_kind)
+{
+    *idx = calloc(nblocks + 1, sizeof(uint32_t));
+    *adj = malloc((nedges ? nedges : 1) * sizeof(uint32_t));
+    *adj_kind = malloc(nedges ? nedges : 1);
+
+    for (uint32_t e = 0; e < nedges; e++)
+        (*idx)[from[e] + 1]++;
+
+    for (uint32_t b = 0; b < nblocks; b++)
+        (*idx)[b + 1] += (*idx)[b];
+
+    uint32_t *pos = malloc((nblocks ? nblocks : 1) * sizeof(uint32_t));
+    memcpy(pos, *idx, nblocks * sizeof(uint32_t));
+
+    for (uint32_t e = 0; e < nedges; e++) {
+        uint32_t at = pos[from[e]]++;
+        (*adj)[at] = to[e];
+        (*adj_kind)[at] = kind[e];
+    }
+
+    free(pos);
+}
+
+void cfg_build(struct cfg *cfg, struct dis *dis)
+{
+    memset(cfg, 0, sizeof(struct cfg));
+    cfg->base = dis->base;
+    cfg->len = dis->limit - dis->base;
+    cfg->words = (cfg->len + 63) / 64;
+    cfg->code = calloc(cfg->words ? cfg->words : 1, sizeof(uint64_t));
+    cfg->rank = calloc(cfg->words ? cfg->words : 1, sizeof(uint32_t));
+
+    // Gather every decoded instruction, starts inside others included
+    uint32_t n = 0, cap = CFG_MIN;
+    struct cfg_insn *insns = malloc(cap * sizeof(struct cfg_insn));
+
+    struct insn *ins;
+    for (uint32_t idx = 0; dis_iterate_code(dis, &idx, &ins); n++) {
+        idx = ins->addr - dis->base + 1;
+
+        if (n == cap) {
+            cap *= 2;
+            insns = realloc(insns, cap * sizeof(struct cfg_insn));
+        }
+
+        struct cfg_insn *in = &insns[n];
+        in->addr = ins->addr;
+        in->next = ins->addr + ins->len;
+        in->target = CFG_NONE;
+        in->kind = CFG_EDGE_FALL;
+        // The traversal carries on past a retf, the flow doesn't
+        bool retf = ins->op == I286_RETF;
+        in->ends = insn_is_bad(ins) || insn_is_branch(ins) || retf;
+        in->falls = !insn_is_bad(ins) && !insn_is_terminator(ins) && !retf;
+
+        uint32_t target;
+        if (insn_is_branch(ins) && insn_get_branch(ins, &target)) {
+            in->target = target;
+            in->kind = insn_branch_kind(ins);
+        }
+
+        bit_set(cfg->code, ins->addr - dis->base);
+    }
+
+    for (uint32_t i = 0, sum = 0; i < cfg->words; i++) {
+        cfg->rank[i] = sum;
+        sum += __builtin_popcountll(cfg->code[i]);
+    }
+
+    // A block starts wherever control can arrive other than by falling
+    // from exactly one instruction inside a block
+    uint64_t *leader = calloc(cfg->words ? cfg->words : 1, sizeof(uint64_t));
+    uint64_t *fell = calloc(cfg->words ? cfg->words : 1, sizeof(uint64_t));
+    uint64_t *fell_twice = calloc(cfg->words ? cfg->words : 1, sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < n; i++) {
+        const struct cfg_insn *in = &insns[i];
+
+        if (cfg_has(cfg, in->target))
+            bit_set(leader, in->target - cfg->base);
+
+        if (!in->falls || !cfg_has(cfg, in->next))
+            continue;
+
+        uint32_t off = in->next - cfg->base;
+        if (in->ends)
+            bit_set(leader, off);
+        else if (bit_test(fell, off))
+            bit_set(fell_twice, off);
+        else
+            bit_set(fell, off);
+    }
+
+    for (uint32_t i = 0; i < dis->entries.nroots; i++) {
+        if (cfg_has(cfg, dis->entries.roots[i]))
+            bit_set(leader, dis->entries.roots[i] - cfg->base);
+    }
+
+    for (uint32_t i = 0; i < cfg->words; i++)
+        leader[i] |= cfg->code[i] & (~fell[i] | fell_twice[i]);
+
+    free(fell);
+    free(fell_twice);
+
+    // Blocks in address order of their first instruction
+    for (uint32_t i = 0; i < cfg->words; i++)
+        cfg->nblocks += __builtin_popcountll(leader[i]);
+
+    cfg->start = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+    cfg->end = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+    cfg->ninsns = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+    cfg->block = malloc((n ? n : 1) * sizeof(uint32_t));
+
+    // Last instruction of each block
+    uint32_t *tail = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+
+    uint32_t b = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!bit_test(leader, insns[i].addr - cfg->base))
+            continue;
+
+        cfg->start[b] = insns[i].addr;
+        cfg->ninsns[b] = 0;
+
+        uint32_t j = i;
+        while (true) {
+            cfg->block[j] = b;
+            cfg->ninsns[b]++;
+
+            const struct cfg_insn *in = &insns[j];
+            if (in->ends || !cfg_has(cfg, in->next)
+                || bit_test(leader, in->next - cfg->base))
+                break;
+
+            j = cfg_index(cfg, in->next - cfg->base);
+        }
+
+        cfg->end[b] = insns[j].next;
+        tail[b++] = j;
+    }
+
+    // Edges as from, to and kind, at most a fall through and a branch
+    // per block. Targets are leaders, their blocks are all known now.
+    uint32_t *from = malloc((cfg->nblocks ? cfg->nblocks : 1) * 2 * sizeof(uint32_t));
+    uint32_t *to = malloc((cfg->nblocks ? cfg->nblocks : 1) * 2 * sizeof(uint32_t));
+    uint8_t *kind = malloc((cfg->nblocks ? cfg->nblocks : 1) * 2);
+
+    for (b = 0; b < cfg->nblocks; b++) {
+        const struct cfg_insn *in = &insns[tail[b]];
+
+        if (in->falls && cfg_has(cfg, in->next)) {
+            from[cfg->nedges] = b;
+            to[cfg->nedges] = cfg_block_of(cfg, in->next);
+            kind[cfg->nedges++] = CFG_EDGE_FALL;
+        }
+
+        if (cfg_has(cfg, in->target)) {
+            from[cfg->nedges] = b;
+            to[cfg->nedges] = cfg_block_of(cfg, in->target);
+            kind[cfg->nedges++] = in->kind;
+        }
+    }
+
+    cfg_csr(cfg->nblocks, cfg->nedges, from, to, kind, &cfg->succ_idx, &cfg->succ, &cfg->succ_kind);
+    cfg_csr(cfg->nblocks, cfg->nedges, to, from, kind, &cfg->pred_idx, &cfg->pred, &cfg->pred_kind);
+
+    free(from);
+    free(to);
+    free(kind);
+    free(tail);
+    free(leader);
+    free(insns);
+}
+
+void cfg_deinit(struct cfg *cfg)
+{
+    free(cfg->code);
+    free(cfg->rank);
+    free(cfg->block);
+    free(cfg->start);
+    free(cfg->end);
+    free(cfg->ninsns);
+    free(cfg->succ_idx);
+    free(cfg->succ);
+    free(cfg->succ_kind);
+    free(cfg->pred_idx);
+    free(cfg->pred);
+    free(cfg->pred_kind);
+}
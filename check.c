@@ -0,0 +1,1073 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "i286dis.h"
+#include "testdata.h"
+
+static int failed;
+static const char *cli;
+
+#define check(cond, ...) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: %s: ", __FILE__, __LINE__, #cond); \
+        fprintf(stderr, __VA_ARGS__); \
+        fputc('\n', stderr); \
+        failed++; \
+    } \
+} while (0)
+
+// Functions with frames, short jumps, calls to each other and a few
+// absolute memory operands, so patches change control flow and data
+// references both
+static uint8_t *synthetic_bytes(uint32_t len, uint32_t seed)
+{
+    uint8_t *bytes = malloc(len);
+    uint32_t pos = 0;
+
+    while (pos + 64 <= len) {
+        static const uint8_t prologue[] = { 0x55, 0x8B, 0xEC, 0x83, 0xEC, 0x08 };
+        memcpy(bytes + pos, prologue, sizeof(prologue));
+        pos += sizeof(prologue);
+
+        for (int n = next_rand(&seed) % 8 + 2; n > 0; n--) {
+            uint32_t r = next_rand(&seed);
+            uint16_t data = 0x200 + (r >> 8) % 64 * 2;
+
+            switch (r % 6) {
+                case 0:
+                    // mov ax, [data]
+                    bytes[pos++] = 0xA1;
+                    bytes[pos++] = data;
+                    bytes[pos++] = data >> 8;
+                    break;
+                case 1:
+                    // mov [data], ax
+                    bytes[pos++] = 0xA3;
+                    bytes[pos++] = data;
+                    bytes[pos++] = data >> 8;
+                    break;
+                case 2:
+                    // cmp ax, 5, jne over mov ax, bx
+                    memcpy(bytes + pos, (uint8_t[]){ 0x83, 0xF8, 0x05, 0x75, 0x02, 0x8B, 0xC3 }, 7);
+                    pos += 7;
+                    break;
+                case 3: {
+                    // call some function start
+                    uint16_t target = (r >> 16) % (pos / 64 + 1) * 64;
+                    uint16_t rel = target - (pos + 3);
+                    bytes[pos++] = 0xE8;
+                    bytes[pos++] = rel;
+                    bytes[pos++] = rel >> 8;
+                    break;
+                }
+                case 4:
+                    // push cx, pop cx
+                    bytes[pos++] = 0x51;
+                    bytes[pos++] = 0x59;
+                    break;
+                case 5:
+                    // inc word [data]
+                    bytes[pos++] = 0xFF;
+                    bytes[pos++] = 0x06;
+                    bytes[pos++] = data;
+                    bytes[pos++] = data >> 8;
+                    break;
+            }
+        }
+
+        memcpy(bytes + pos, (uint8_t[]){ 0x8B, 0xE5, 0x5D, 0xC3 }, 4);
+        pos += 4;
+
+        // Functions start every 64 bytes, int3 in between
+        while (pos % 64)
+            bytes[pos++] = 0xCC;
+    }
+
+    while (pos < len)
+        bytes[pos++] = 0xCC;
+
+    return bytes;
+}
+
+// Every offset of the buffer, so instructions cut off by the end and
+// prefix runs longer than DIS_PREFIX_MAX are both covered
+static void check_length(const uint8_t *bytes, uint32_t len)
+{
+    struct dis dis;
+    dis_init(&dis, bytes, len, 0x100, DIS_NONE);
+
+    for (uint32_t off = 0; off < len; off++) {
+        dis.ip = 0x100 + off;
+        struct insn *ins = dis_decode(&dis);
+
+        int expect = insn_is_bad(ins) ? 0 : ins->len;
+        check(dis_insn_length(&dis, 0x100 + off) == expect,
+              "offset %u: length %d, decoded %d", off, dis_insn_length(&dis, 0x100 + off), expect);
+        check(ins->len <= DIS_INSN_MAX, "offset %u: length %u", off, ins->len);
+    }
+
+    dis_deinit(&dis);
+}
+
+static void test_length(void)
+{
+    uint8_t *bytes = random_bytes(1 << 16, 0x286);
+    check_length(bytes, 1 << 16);
+    free(bytes);
+
+    // Prefix runs around DIS_PREFIX_MAX and far past 255, then a
+    // mov word [bx+si+0x1234], 0x5678
+    uint8_t run[400];
+    memset(run, 0x26, sizeof(run));
+    memcpy(run + 300, (uint8_t[]){ 0xC7, 0x80, 0x34, 0x12, 0x78, 0x56 }, 6);
+    check_length(run, 306);
+
+    uint8_t *p = run + 300 - DIS_PREFIX_MAX;
+    struct dis dis;
+    dis_init(&dis, p, DIS_PREFIX_MAX + 6, 0, DIS_NONE);
+    check(dis_insn_length(&dis, 0) == DIS_INSN_MAX, "longest instruction");
+    dis_deinit(&dis);
+}
+
+// Whether both decoded the same instructions
+static bool same_listing(struct dis *a, struct dis *b)
+{
+    uint32_t i = 0, j = 0;
+    struct insn *x, *y;
+    struct insn_rec rx, ry;
+
+    while (dis_iterate_code(a, &i, &x)) {
+        insn_pack(&rx, x);
+        if (!dis_iterate_code(b, &j, &y))
+            return false;
+
+        insn_pack(&ry, y);
+        if (memcmp(&rx, &ry, sizeof(rx)) != 0)
+            return false;
+    }
+
+    return !dis_iterate_code(b, &j, &y);
+}
+
+static void test_parallel(void)
+{
+    uint32_t len = 1 << 18;
+    uint8_t *bytes = random_bytes(len, 0x11);
+
+    struct dis serial, parallel;
+    dis_init(&serial, bytes, len, 0, DIS_COMPACT);
+    dis_init(&parallel, bytes, len, 0, DIS_COMPACT);
+
+    for (uint32_t addr = 0; addr < len; addr += 97) {
+        dis_push_entry(&serial, addr);
+        dis_push_entry(&parallel, addr);
+    }
+
+    dis_disasm(&serial);
+    dis_disasm_parallel(&parallel, 8);
+    check(same_listing(&serial, &parallel), "8 threads differ from one");
+
+    // Nothing queued, the workers have to notice and stop
+    dis_disasm_parallel(&parallel, 8);
+    check(same_listing(&serial, &parallel), "an empty traversal changed something");
+
+    dis_deinit(&serial);
+    dis_deinit(&parallel);
+    free(bytes);
+}
+
+static int hook_open(char *buf, size_t size, struct insn *ins)
+{
+    (void)ins;
+    return snprintf(buf, size, "<");
+}
+
+static int hook_close(char *buf, size_t size, struct insn *ins)
+{
+    return snprintf(buf, size, ":%u>", ins->len);
+}
+
+static int hook_oper_open(char *buf, size_t size, struct oper *oper)
+{
+    (void)oper;
+    return snprintf(buf, size, "{");
+}
+
+static int hook_oper_close(char *buf, size_t size, struct oper *oper)
+{
+    return snprintf(buf, size, "%d}", oper->flags);
+}
+
+// fmt_insn_fast writes the same bytes as fmt_insn and returns the same
+// length for every flag set, with and without hooks, including where
+// a small buffer cuts the output
+static void check_fmt(struct insn *ins, enum fmt_flag flags, bool hooks)
+{
+    static const size_t sizes[] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 16, 20, 24, 32, 48, 128 };
+
+    struct fmt fmt;
+    fmt_init(&fmt, flags);
+    if (hooks) {
+        fmt.opcode_pre = hook_open;
+        fmt.opcode_post = hook_close;
+        fmt.oper_pre = hook_oper_open;
+        fmt.oper_post = hook_oper_close;
+    }
+
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char slow[160], fast[160];
+        memset(slow, 0x5A, sizeof(slow));
+        memset(fast, 0x5A, sizeof(fast));
+
+        int n = fmt_insn(&fmt, ins, slow, sizes[i]);
+        int m = fmt_insn_fast(&fmt, ins, fast, sizes[i]);
+        check(n == m && !memcmp(slow, fast, sizeof(slow)),
+              "%s at %x, flags %x%s, size %zu: %d \"%.*s\", fast %d \"%.*s\"",
+              opcode_mnemonics[ins->op], ins->addr, flags, hooks ? " with hooks" : "",
+              sizes[i], n, n, slow, m, m, fast);
+    }
+}
+
+static void test_fmt(void)
+{
+    uint32_t len = 2048;
+    uint8_t *bytes = random_bytes(len, 0x13);
+
+    struct dis dis;
+    dis_init(&dis, bytes, len, 0x100, DIS_NONE);
+
+    for (uint32_t off = 0; off < len; off++) {
+        dis.ip = 0x100 + off;
+        struct insn *ins = dis_decode(&dis);
+
+        for (enum fmt_flag flags = 0; flags <= FMT_ALL; flags++) {
+            check_fmt(ins, flags, false);
+            check_fmt(ins, flags, true);
+        }
+    }
+
+    dis_deinit(&dis);
+    free(bytes);
+
+    // Every flag set went through fmt_init above, so each specialised
+    // formatter ran. There are 24 of them besides the generic one, and
+    // fmt_select picks the same one after the flags change.
+    int (*seen[FMT_ALL + 1])(struct fmt *, struct insn *, char *, size_t);
+    uint32_t distinct = 0;
+
+    for (enum fmt_flag flags = 0; flags <= FMT_ALL; flags++) {
+        struct fmt fmt, fresh;
+        fmt_init(&fmt, FMT_ALL & ~flags);
+        fmt.flags = flags;
+        fmt_select(&fmt);
+        fmt_init(&fresh, flags);
+        check(fmt.format == fresh.format, "flags %x picked two formatters", flags);
+
+        uint32_t i = 0;
+        while (i < distinct && seen[i] != fresh.format)
+            i++;
+        if (i == distinct)
+            seen[distinct++] = fresh.format;
+    }
+
+    check(distinct == 25, "%u formatters", distinct);
+}
+
+// Regions guess where their first instruction starts, the seams have
+// to resync to what one thread decodes. Lengths just below twice
+// SWEEP_REGION_MIN get a single thread.
+static void check_sweep(const uint8_t *bytes, uint32_t len, enum dis_flag flags)
+{
+    static const int threads[] = { 2, 3, 4, 7, 8, 16 };
+
+    struct dis serial;
+    dis_init(&serial, bytes, len, 0x100, flags);
+    dis_sweep(&serial, 1);
+
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        struct dis parallel;
+        dis_init(&parallel, bytes, len, 0x100, flags);
+        dis_sweep(&parallel, threads[i]);
+
+        check(same_listing(&serial, &parallel), "sweep of %u bytes on %d threads differs",
+              len, threads[i]);
+        dis_deinit(&parallel);
+    }
+
+    dis_deinit(&serial);
+}
+
+static void test_sweep(void)
+{
+    static const uint32_t lens[] = {
+        2 * SWEEP_REGION_MIN - 1, 2 * SWEEP_REGION_MIN, 2 * SWEEP_REGION_MIN + 1,
+        3 * SWEEP_REGION_MIN - 1, 3 * SWEEP_REGION_MIN + 1, 16 * SWEEP_REGION_MIN + 7,
+    };
+
+    for (size_t i = 0; i < sizeof(lens) / sizeof(lens[0]); i++) {
+        uint8_t *bytes = random_bytes(lens[i], 0x10 + i);
+        check_sweep(bytes, lens[i], DIS_COMPACT);
+        check_sweep(bytes, lens[i], DIS_NONE);
+        free(bytes);
+
+        // Prefix runs and long instructions straddle the seams
+        bytes = synthetic_bytes(lens[i], 0x10 + i);
+        for (uint32_t at = SWEEP_REGION_MIN - 8; at + 16 < lens[i]; at += SWEEP_REGION_MIN / 3)
+            memset(bytes + at, 0x26, 12);
+        check_sweep(bytes, lens[i], DIS_COMPACT);
+        free(bytes);
+    }
+}
+
+// Feeds the image in chunks of chunk bytes, so instructions and prefix
+// runs get split between them, and checks that the stream decodes what
+// a sweep of the whole image does
+static void check_stream(const uint8_t *bytes, uint32_t len, uint32_t chunk)
+{
+    struct dis sweep;
+    dis_init(&sweep, bytes, len, 0x100, DIS_COMPACT);
+    dis_sweep(&sweep, 1);
+
+    struct dis_stream *stream = malloc(sizeof(struct dis_stream));
+    dis_stream_init(stream, 0x100);
+
+    uint32_t idx = 0, off = 0, n = 0;
+    bool same = true;
+
+    while (same) {
+        if (off < len)
+            off += dis_stream_feed(stream, bytes + off, len - off < chunk ? len - off : chunk);
+        else
+            dis_stream_finish(stream);
+
+        struct insn *ins, *want;
+        const uint8_t *at;
+        while (same && dis_stream_next(stream, &ins, &at)) {
+            struct insn_rec got, rec;
+            insn_pack(&got, ins);
+
+            same = dis_iterate_code(&sweep, &idx, &want);
+            if (same) {
+                insn_pack(&rec, want);
+                same = !memcmp(&got, &rec, sizeof(rec));
+            }
+
+            n += same;
+        }
+
+        if (stream->eof)
+            break;
+    }
+
+    struct insn *rest;
+    check(same, "%u byte chunks: instruction %u differs from the sweep", chunk, n);
+    check(!same || !dis_iterate_code(&sweep, &idx, &rest),
+          "%u byte chunks: the stream stopped after %u instructions", chunk, n);
+
+    dis_stream_deinit(stream);
+    free(stream);
+    dis_deinit(&sweep);
+}
+
+static void test_stream(void)
+{
+    // A few windows of random bytes, with prefix runs up to twice
+    // DIS_PREFIX_MAX, one of them across the end of the first window
+    uint32_t len = 3 * DIS_STREAM_WINDOW + 123, seed = 0x09;
+    uint8_t *bytes = random_bytes(len, seed);
+
+    for (uint32_t at = 0; at + 32 < len; at += next_rand(&seed) % 4096)
+        memset(bytes + at, 0x26, next_rand(&seed) % (2 * DIS_PREFIX_MAX) + 1);
+    memset(bytes + DIS_STREAM_WINDOW - 5, 0xF3, 10);
+
+    check_stream(bytes, len, 1);
+    check_stream(bytes, len, 7);
+    check_stream(bytes, len, DIS_STREAM_WINDOW);
+    free(bytes);
+}
+
+static void check_redisasm(enum dis_flag flags)
+{
+    uint32_t len = 1 << 14;
+    uint8_t *bytes = synthetic_bytes(len, 0x18);
+    uint32_t seed = 0x18;
+
+    struct dis dis;
+    dis_init(&dis, bytes, len, 0, flags);
+    dis_push_entry(&dis, 0);
+    for (uint32_t addr = 0; addr < len; addr += 1024)
+        dis_push_entry(&dis, addr);
+    dis_disasm(&dis);
+
+    uint32_t most = 0;
+    for (int round = 0; round < 3000; round++) {
+        // Some patches land on code, some on padding, some turn calls
+        // and jumps elsewhere
+        uint32_t at = next_rand(&seed) % (len - 4), n = next_rand(&seed) % 4 + 1;
+        for (uint32_t i = 0; i < n; i++)
+            bytes[at + i] = next_rand(&seed);
+
+        dis_invalidate_range(&dis, at, n);
+        dis_redisasm(&dis);
+
+        struct dis fresh;
+        dis_init(&fresh, bytes, len, 0, flags);
+        dis_push_entry(&fresh, 0);
+        for (uint32_t addr = 0; addr < len; addr += 1024)
+            dis_push_entry(&fresh, addr);
+        dis_disasm(&fresh);
+
+        check(same_listing(&dis, &fresh), "round %d: patch of %u bytes at %u differs", round, n, at);
+        dis_deinit(&fresh);
+
+        uint32_t live = 0;
+        for (uint32_t i = 0; flags & DIS_COMPACT && i < dis.store.n; i++)
+            live += dis.store.nopers[i];
+
+        if (live > most)
+            most = live;
+    }
+
+    // The operand slots of dropped instructions are reclaimed, opers
+    // stays within a few times the most the instructions ever used
+    if (flags & DIS_COMPACT) {
+        check(dis.store.opers_cap <= 4 * most + 1024, "%u operand slots for at most %u in use",
+              dis.store.opers_cap, most);
+    }
+
+    // An entry still pending when a range is invalidated is queued once
+    uint32_t pending = 0;
+    while (dis_is_decoded(&dis, pending))
+        pending++;
+
+    dis_push_entry(&dis, pending);
+    dis_invalidate_range(&dis, 0, 16);
+    dis_push_entry(&dis, pending);
+
+    uint32_t queued = 0, entry;
+    while (dis_pop_entry(&dis, &entry))
+        queued += entry == pending;
+
+    check(queued == 1, "pending entry queued %u times", queued);
+
+    dis_deinit(&dis);
+    free(bytes);
+}
+
+static void test_redisasm(void)
+{
+    check_redisasm(DIS_COMPACT);
+    check_redisasm(DIS_NONE);
+    check_redisasm(DIS_ARENA);
+}
+
+static uint8_t *read_file(const char *path, size_t *size)
+{
+    FILE *fp = fopen(path, "rb");
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    rewind(fp);
+
+    uint8_t *data = malloc(*size);
+    if (fread(data, 1, *size, fp) != *size)
+        *size = 0;
+
+    fclose(fp);
+    return data;
+}
+
+static void write_file(const char *path, const uint8_t *data, size_t size)
+{
+    FILE *fp = fopen(path, "wb");
+    fwrite(data, 1, size, fp);
+    fclose(fp);
+}
+
+enum corruption {
+    CORRUPT_NONE,
+    CORRUPT_ZERO_LEN,
+    CORRUPT_PAST_END,
+    CORRUPT_OPER_FLAGS,
+    CORRUPT_OPER_REG,
+    // A byte changed without a new sum
+    CORRUPT_SUM,
+
+    CORRUPT_N,
+};
+
+static void test_cache(void)
+{
+    uint32_t len = 1 << 14;
+    uint8_t *bytes = synthetic_bytes(len, 0x19);
+
+    char dir[] = "/tmp/i286check.XXXXXX";
+    check(mkdtemp(dir), "no temporary directory");
+
+    struct dis dis;
+    dis_init(&dis, bytes, len, 0, DIS_COMPACT);
+    dis_push_entry(&dis, 0);
+    dis_disasm(&dis);
+    check(dis_cache_save(&dis, dir), "cache not written");
+    dis_deinit(&dis);
+
+    char path[sizeof(dir) + 256] = "";
+    DIR *d = opendir(dir);
+    for (struct dirent *e; (e = readdir(d)); ) {
+        if (e->d_name[0] != '.')
+            snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    }
+    closedir(d);
+
+    size_t size;
+    uint8_t *good = read_file(path, &size);
+    uint8_t *data = malloc(size);
+
+    for (int c = CORRUPT_NONE; c < CORRUPT_N; c++) {
+        memcpy(data, good, size);
+
+        struct dis_cache_header *header = (struct dis_cache_header *)data;
+        uint8_t *payload = data + sizeof(struct dis_cache_header);
+        uint32_t *addr = (uint32_t *)(payload + header->nroots * sizeof(uint32_t));
+        uint8_t *lens = (uint8_t *)(addr + header->n);
+        uint8_t *nopers = lens + 3 * header->n;
+        struct oper_rec *opers = (struct oper_rec *)(nopers + header->n);
+
+        switch (c) {
+            case CORRUPT_ZERO_LEN:
+                lens[header->n / 2] = 0;
+                break;
+            case CORRUPT_PAST_END:
+                addr[header->n - 1] = len - 1;
+                lens[header->n - 1] = 2;
+                break;
+            case CORRUPT_OPER_FLAGS:
+                opers[header->nslots / 2].flags = I286_OPER_MEM + 1;
+                break;
+            case CORRUPT_OPER_REG:
+                for (uint32_t i = 0; i < header->nslots; i++) {
+                    if (opers[i].flags == I286_OPER_REG) {
+                        opers[i].sel = 0x80;
+                        break;
+                    }
+                }
+                break;
+            case CORRUPT_SUM:
+                data[size - 1] ^= 1;
+                break;
+        }
+
+        // A valid sum, so only the checks on the contents can reject it
+        if (c != CORRUPT_SUM)
+            header->sum = dis_cache_sum(payload, size - sizeof(struct dis_cache_header));
+        write_file(path, data, size);
+
+        dis_init(&dis, bytes, len, 0, DIS_COMPACT);
+        dis_push_entry(&dis, 0);
+        bool hit = dis_cache_load(&dis, dir);
+        check(hit == (c == CORRUPT_NONE), "corruption %d: %s", c, hit ? "hit" : "miss");
+        check(hit || dis.store.n == 0, "corruption %d: a miss touched dis", c);
+        dis_deinit(&dis);
+    }
+
+    unlink(path);
+    rmdir(dir);
+    free(data);
+    free(good);
+    free(bytes);
+}
+
+static void check_bin(enum dis_flag flags)
+{
+    // Not a whole number of bitmap words
+    uint32_t len = (1 << 14) - 5;
+    uint8_t *bytes = synthetic_bytes(len, 0x20);
+
+    struct dis dis;
+    dis_init(&dis, bytes, len, 0x100, flags);
+    for (uint32_t addr = 0x100; addr < 0x100 + len; addr += 1024)
+        dis_push_entry(&dis, addr);
+
+    // Some starts inside other instructions, which the format keeps too
+    dis_push_entry(&dis, 0x101);
+    dis_push_entry(&dis, 0x102);
+    dis_disasm(&dis);
+
+    char path[] = "/tmp/i286check.XXXXXX";
+    int fd = mkstemp(path);
+    check(fd >= 0, "no temporary file");
+    close(fd);
+
+    check(dis_bin_write(&dis, path), "not written");
+
+    struct dis_bin bin;
+    check(dis_bin_open(&bin, path), "not opened");
+
+    if (bin.header) {
+        check(bin.header->base == 0x100 && bin.header->len == len, "wrong image");
+        check(!memcmp(bin.bytes, bytes, len), "bytes differ");
+
+        uint32_t n = 0;
+        for (uint32_t addr = 0x100; addr < 0x100 + len; addr++) {
+            struct insn *ins = dis_lookup(&dis, addr);
+            const struct insn_rec *rec = dis_bin_lookup(&bin, addr);
+
+            if (!ins) {
+                check(!rec, "%x: not decoded, but in the file", addr);
+                continue;
+            }
+
+            struct insn_rec expect;
+            insn_pack(&expect, ins);
+            check(rec && !memcmp(rec, &expect, sizeof(expect)), "%x: differs", addr);
+            check(rec == &bin.recs[n], "%x: not in address order", addr);
+            n++;
+        }
+
+        check(n == bin.n, "%u instructions in the file, %u decoded", bin.n, n);
+        check(!dis_bin_lookup(&bin, 0x100 + len), "found past the end");
+        dis_bin_close(&bin);
+    }
+
+    // A bitmap or ranks that don't add up would send dis_bin_lookup past
+    // recs, such a file doesn't open
+    size_t size;
+    uint8_t *good = read_file(path, &size);
+    uint8_t *data = malloc(size);
+
+    for (int c = 0; c < 4; c++) {
+        memcpy(data, good, size);
+
+        struct dis_bin_header *header = (struct dis_bin_header *)data;
+        uint64_t *code = (uint64_t *)(data + header->code);
+        uint32_t *rank = (uint32_t *)(data + header->rank);
+
+        switch (c) {
+            case 0:
+                rank[1] += 1000;
+                break;
+            case 1:
+                rank[header->words - 1] -= 1;
+                break;
+            case 2:
+                code[header->words - 1] |= 1ULL << (len % 64);
+                break;
+            case 3:
+                code[header->words / 2] ^= 1;
+                break;
+        }
+
+        write_file(path, data, size);
+        bool opened = dis_bin_open(&bin, path);
+        check(!opened, "corruption %d opened", c);
+        if (opened)
+            dis_bin_close(&bin);
+    }
+
+    free(data);
+    free(good);
+    unlink(path);
+    dis_deinit(&dis);
+    free(bytes);
+}
+
+static void test_bin(void)
+{
+    check_bin(DIS_COMPACT);
+    check_bin(DIS_NONE);
+}
+
+static const uint8_t xref_image[] = {
+    0xA1, 0x00, 0x02,               // 100: mov ax, [0x200]
+    0xA3, 0x02, 0x02,               // 103: mov [0x202], ax
+    0x26, 0xFF, 0x06, 0x00, 0x02,   // 106: inc word es:[0x200]
+    0x8D, 0x1E, 0x04, 0x02,         // 10b: lea bx, [0x204]
+    0xBE, 0x06, 0x02,               // 10f: mov si, 0x206
+    0x3B, 0x06, 0x00, 0x02,         // 112: cmp ax, [0x200]
+    0x87, 0x06, 0x02, 0x02,         // 116: xchg [0x202], ax
+    0x74, 0x02,                     // 11a: je 0x11e
+    0xEB, 0x01,                     // 11c: jmp 0x11f
+    0x90,                           // 11e: nop
+    0xE8, 0x01, 0x00,               // 11f: call 0x123
+    0xC3,                           // 122: ret
+    0xC3,                           // 123: ret
+};
+
+static void check_xrefs(enum dis_flag flags)
+{
+    uint8_t bytes[sizeof(xref_image)];
+    memcpy(bytes, xref_image, sizeof(bytes));
+
+    struct dis dis;
+    dis_init(&dis, bytes, sizeof(bytes), 0x100, flags | DIS_XREFS);
+    dis_push_entry(&dis, 0x100);
+    dis_disasm(&dis);
+
+    static const struct xref ds[] = {
+        { 0x100, DIS_DATA_ADDR(I286_SEG_DS, 0x200), DATA_READ },
+        { 0x112, DIS_DATA_ADDR(I286_SEG_DS, 0x200), DATA_READ },
+        { 0x103, DIS_DATA_ADDR(I286_SEG_DS, 0x202), DATA_WRITE },
+        { 0x116, DIS_DATA_ADDR(I286_SEG_DS, 0x202), DATA_READ | DATA_WRITE },
+        { 0x10B, DIS_DATA_ADDR(I286_SEG_DS, 0x204), DATA_ADDR },
+        { 0x10F, DIS_DATA_ADDR(I286_SEG_DS, 0x206), DATA_ADDR },
+    };
+
+    const struct xref *xrefs;
+    uint32_t n = dis_data_xrefs_to(&dis, I286_SEG_DS, 0x200, 8, &xrefs);
+    check(n == 6, "%u data xrefs into ds:200", n);
+
+    for (uint32_t i = 0; i < n && i < 6; i++) {
+        check(xrefs[i].from == ds[i].from && xrefs[i].to == ds[i].to && xrefs[i].kind == ds[i].kind,
+              "data xref %u is %x to %x kind %u", i, xrefs[i].from, xrefs[i].to, xrefs[i].kind);
+    }
+
+    n = dis_data_xrefs_to(&dis, I286_SEG_DS, 0x202, 1, &xrefs);
+    check(n == 2 && xrefs[0].from == 0x103 && xrefs[1].from == 0x116, "%u data xrefs to ds:202", n);
+
+    n = dis_data_xrefs_to(&dis, I286_SEG_ES, 0x200, 2, &xrefs);
+    check(n == 1 && xrefs[0].from == 0x106 && xrefs[0].kind == (DATA_READ | DATA_WRITE),
+          "%u data xrefs to es:200", n);
+
+    const struct xref *xref = dis_data_xref_from(&dis, 0x103);
+    check(xref && xref->kind == DATA_WRITE, "no write from 103");
+    check(!dis_data_xref_from(&dis, 0x11A), "data xref from a branch");
+
+    xref = dis_xref_from(&dis, 0x11A);
+    check(xref && xref->to == 0x11E && xref->kind == CFG_EDGE_COND, "je at 11a");
+    xref = dis_xref_from(&dis, 0x11C);
+    check(xref && xref->to == 0x11F && xref->kind == CFG_EDGE_JUMP, "jmp at 11c");
+    xref = dis_xref_from(&dis, 0x11F);
+    check(xref && xref->to == 0x123 && xref->kind == CFG_EDGE_CALL, "call at 11f");
+    check(!dis_xref_from(&dis, 0x100), "code xref from a mov");
+
+    n = dis_xrefs_to(&dis, 0x11F, &xrefs);
+    check(n == 1 && xrefs[0].from == 0x11C, "%u code xrefs to 11f", n);
+
+    // The write turns into a read, the old xref has to go
+    bytes[0x103 - 0x100] = 0xA1;
+    dis_invalidate_range(&dis, 0x103, 1);
+    dis_redisasm(&dis);
+
+    xref = dis_data_xref_from(&dis, 0x103);
+    check(xref && xref->kind == DATA_READ, "103 still a write after the patch");
+
+    n = dis_data_xrefs_to(&dis, I286_SEG_DS, 0x202, 1, &xrefs);
+    check(n == 2 && xrefs[0].kind == DATA_READ, "%u data xrefs to ds:202 after the patch", n);
+
+    dis_deinit(&dis);
+}
+
+// Code that a patch leaves unreachable takes its xrefs along, even when
+// the index was sorted in between
+static void check_unreachable_xrefs(enum dis_flag flags)
+{
+    uint8_t bytes[] = {
+        0xEB, 0x01,                 // 100: jmp 0x103
+        0x90,                       // 102: nop
+        0xE8, 0x01, 0x00,           // 103: call 0x107
+        0xC3,                       // 106: ret
+        0xC3,                       // 107: ret
+    };
+
+    struct dis dis;
+    dis_init(&dis, bytes, sizeof(bytes), 0x100, flags | DIS_XREFS);
+    dis_push_entry(&dis, 0x100);
+    dis_disasm(&dis);
+
+    const struct xref *xrefs;
+    check(dis_xrefs_to(&dis, 0x107, &xrefs) == 1, "no call to 107");
+
+    bytes[0] = 0xC3;
+    dis_invalidate_range(&dis, 0x100, 1);
+    dis_xrefs_to(&dis, 0x107, &xrefs);
+    dis_redisasm(&dis);
+
+    check(!dis_is_decoded(&dis, 0x103), "103 still decoded");
+    check(!dis_xref_from(&dis, 0x103), "xref from the removed call");
+    check(dis_xrefs_to(&dis, 0x107, &xrefs) == 0, "xref to 107 after the call is gone");
+
+    dis_deinit(&dis);
+}
+
+static void test_xrefs(void)
+{
+    check_xrefs(DIS_COMPACT);
+    check_xrefs(DIS_NONE);
+    check_unreachable_xrefs(DIS_COMPACT);
+    check_unreachable_xrefs(DIS_NONE);
+}
+
+static const uint8_t cfg_image[] = {
+    0x75, 0x02,                     // 100: jne 0x104
+    0xCB,                           // 102: retf
+    0x90,                           // 103: nop
+    0xE8, 0x01, 0x00,               // 104: call 0x108
+    0xC3,                           // 107: ret
+    0xC3,                           // 108: ret
+};
+
+static void test_cfg(void)
+{
+    struct dis dis;
+    dis_init(&dis, cfg_image, sizeof(cfg_image), 0x100, DIS_COMPACT);
+    dis_push_entry(&dis, 0x100);
+    dis_disasm(&dis);
+
+    struct cfg cfg;
+    cfg_build(&cfg, &dis);
+
+    static const uint32_t start[] = { 0x100, 0x102, 0x103, 0x104, 0x107, 0x108 };
+    static const uint32_t end[] = { 0x102, 0x103, 0x104, 0x107, 0x108, 0x109 };
+
+    check(cfg.nblocks == 6, "%u blocks", cfg.nblocks);
+    for (uint32_t b = 0; b < cfg.nblocks && b < 6; b++) {
+        check(cfg.start[b] == start[b] && cfg.end[b] == end[b] && cfg.ninsns[b] == 1,
+              "block %u is %x-%x with %u insns", b, cfg.start[b], cfg.end[b], cfg.ninsns[b]);
+    }
+
+    // Successors of each block in order, then predecessors
+    static const uint32_t succ_idx[] = { 0, 2, 2, 3, 5, 5, 5 };
+    static const uint32_t succ[] = { 1, 3, 3, 4, 5 };
+    static const uint8_t succ_kind[] = {
+        CFG_EDGE_FALL, CFG_EDGE_COND, CFG_EDGE_FALL, CFG_EDGE_FALL, CFG_EDGE_CALL,
+    };
+    static const uint32_t pred_idx[] = { 0, 0, 1, 1, 3, 4, 5 };
+    static const uint32_t pred[] = { 0, 0, 2, 3, 3 };
+    static const uint8_t pred_kind[] = {
+        CFG_EDGE_FALL, CFG_EDGE_COND, CFG_EDGE_FALL, CFG_EDGE_FALL, CFG_EDGE_CALL,
+    };
+
+    check(cfg.nedges == 5, "%u edges", cfg.nedges);
+    if (cfg.nblocks == 6 && cfg.nedges == 5) {
+        check(!memcmp(cfg.succ_idx, succ_idx, sizeof(succ_idx)), "succ_idx differs");
+        check(!memcmp(cfg.succ, succ, sizeof(succ)), "succ differs");
+        check(!memcmp(cfg.succ_kind, succ_kind, sizeof(succ_kind)), "succ_kind differs");
+        check(!memcmp(cfg.pred_idx, pred_idx, sizeof(pred_idx)), "pred_idx differs");
+        check(!memcmp(cfg.pred, pred, sizeof(pred)), "pred differs");
+        check(!memcmp(cfg.pred_kind, pred_kind, sizeof(pred_kind)), "pred_kind differs");
+    }
+
+    static const struct { uint32_t addr, block; } of[] = {
+        { 0x100, 0 }, { 0x101, CFG_NONE }, { 0x103, 2 }, { 0x105, CFG_NONE },
+        { 0x108, 5 }, { 0x109, CFG_NONE }, { 0xFF, CFG_NONE },
+    };
+
+    for (size_t i = 0; i < sizeof(of) / sizeof(of[0]); i++) {
+        uint32_t b = cfg_block_of(&cfg, of[i].addr);
+        check(b == of[i].block, "%x is in block %d", of[i].addr, (int)b);
+    }
+
+    // The nop isn't reached from the jne's function, it starts one
+    struct funcs funcs;
+    funcs_build(&funcs, &dis, &cfg);
+
+    check(funcs.n == 3, "%u functions", funcs.n);
+    for (uint32_t b = 0; b < cfg.nblocks; b++)
+        check(funcs.func_of[b] != CFG_NONE, "no function owns block %u", b);
+
+    funcs_deinit(&funcs);
+    cfg_deinit(&cfg);
+    dis_deinit(&dis);
+}
+
+static const uint8_t summary_image[] = {
+    0xE8, 0x0D, 0x00,               // 100: call 0x110
+    0xE8, 0x16, 0x00,               // 103: call 0x11c
+    0xE8, 0x16, 0x00,               // 106: call 0x11f
+    0xE8, 0x1D, 0x00,               // 109: call 0x129
+    0xE8, 0x25, 0x00,               // 10c: call 0x134
+    0xC3,                           // 10f: ret
+    0x55,                           // 110: push bp
+    0x8B, 0xEC,                     // 111: mov bp, sp
+    0x56,                           // 113: push si
+    0xBE, 0x01, 0x00,               // 114: mov si, 1
+    0x5E,                           // 117: pop si
+    0x8B, 0xE5,                     // 118: mov sp, bp
+    0x5D,                           // 11a: pop bp
+    0xC3,                           // 11b: ret
+    0x50,                           // 11c: push ax
+    0x5B,                           // 11d: pop bx
+    0xC3,                           // 11e: ret
+    0x56,                           // 11f: push si
+    0xBE, 0x01, 0x00,               // 120: mov si, 1
+    0x74, 0x02,                     // 123: je 0x127
+    0x5E,                           // 125: pop si
+    0xC3,                           // 126: ret
+    0x5B,                           // 127: pop bx
+    0xC3,                           // 128: ret
+    0xC8, 0x04, 0x00, 0x00,         // 129: enter 4, 0
+    0xC7, 0x46, 0xFE, 0x00, 0x00,   // 12d: mov word [bp-2], 0
+    0xC9,                           // 132: leave
+    0xC3,                           // 133: ret
+    0x56,                           // 134: push si
+    0x8B, 0xEC,                     // 135: mov bp, sp
+    0xC7, 0x46, 0x00, 0x05, 0x00,   // 137: mov word [bp], 5
+    0x5E,                           // 13c: pop si
+    0xC3,                           // 13d: ret
+};
+
+// Registers saved and restored on every path aren't clobbered
+static void test_summaries(void)
+{
+    struct dis dis;
+    dis_init(&dis, summary_image, sizeof(summary_image), 0x100, DIS_COMPACT);
+    dis_push_entry(&dis, 0x100);
+    dis_disasm(&dis);
+
+    struct cfg cfg;
+    struct funcs funcs;
+    struct callgraph graph;
+    cfg_build(&cfg, &dis);
+    funcs_build(&funcs, &dis, &cfg);
+    callgraph_build(&graph, &cfg, &funcs);
+    callgraph_summarize(&graph, &dis, &cfg, &funcs, 1);
+
+    uint32_t bx = SUMMARY_REG(I286_REG_BX), si = SUMMARY_REG(I286_REG_SI);
+    uint32_t bp = SUMMARY_REG(I286_REG_BP);
+    static const uint32_t start[] = { 0x100, 0x110, 0x11C, 0x11F, 0x129, 0x134 };
+    uint32_t want[] = { bx | si | bp, 0, bx, bx | si, 0, si | bp };
+
+    check(funcs.n == 6, "%u functions", funcs.n);
+    for (uint32_t f = 0; f < funcs.n && f < 6; f++) {
+        check(funcs.items[f].start == start[f] && graph.summaries[f].clobbers == want[f],
+              "function at %x clobbers %x", funcs.items[f].start, graph.summaries[f].clobbers);
+    }
+
+    callgraph_deinit(&graph);
+    funcs_deinit(&funcs);
+    cfg_deinit(&cfg);
+    dis_deinit(&dis);
+}
+
+// Only meaningful with I286_STATS, which make check also builds
+static void test_sweep_stats(void)
+{
+    uint32_t len = 1 << 18;
+    uint8_t *bytes = random_bytes(len, 0x17);
+
+    struct dis serial, parallel;
+    dis_init(&serial, bytes, len, 0, DIS_COMPACT);
+    dis_init(&parallel, bytes, len, 0, DIS_COMPACT);
+    dis_sweep(&serial, 1);
+    dis_sweep(&parallel, 8);
+
+    struct dis_stats a, b;
+    if (dis_get_stats(&serial, &a) && dis_get_stats(&parallel, &b)) {
+        check(!memcmp(a.opcodes, b.opcodes, sizeof(a.opcodes)), "opcode counts differ");
+        check(!memcmp(a.handlers, b.handlers, sizeof(a.handlers)), "handler counts differ");
+        check(a.bad_truncated == b.bad_truncated && a.bad_invalid == b.bad_invalid,
+              "bad counts differ");
+    } else {
+        printf("Skipped the statistics checks, built without I286_STATS\n");
+    }
+
+    dis_deinit(&serial);
+    dis_deinit(&parallel);
+    free(bytes);
+}
+
+// Instruction lines in the CLI listing of path, leaving out the db of
+// bytes that weren't decoded, -1 if it didn't run
+static int cli_count(const char *args, const char *path)
+{
+    char cmd[512];
+    snprintf(cmd, sizeof(cmd), "%s %s %s", cli, args, path);
+
+    FILE *fp = popen(cmd, "r");
+    if (!fp)
+        return -1;
+
+    int n = 0;
+    char line[0x400];
+    while (fgets(line, sizeof(line), fp)) {
+        size_t digits = strspn(line, "0123456789abcdef");
+        n += digits && line[digits] == ':' && line[digits + 1] == ' ' && !strstr(line, " db '");
+    }
+
+    return pclose(fp) == 0 ? n : -1;
+}
+
+static void check_funcs_listing(const uint8_t *bytes, uint32_t len)
+{
+    char path[] = "/tmp/i286check.XXXXXX";
+    int fd = mkstemp(path);
+    check(fd >= 0 && write(fd, bytes, len) == (ssize_t)len, "no temporary file");
+    close(fd);
+
+    int plain = cli_count("-e 0x100", path);
+    int funcs = cli_count("-e 0x100 -f", path);
+    int threads = cli_count("-e 0x100 -f -j4", path);
+
+    check(plain > 0, "%s didn't run", cli);
+    check(funcs == plain, "%d instructions with -f, %d without", funcs, plain);
+    check(threads == plain, "%d instructions with -f -j4, %d without", threads, plain);
+
+    unlink(path);
+}
+
+// Only runs with -c CLI
+static void test_funcs_listing(void)
+{
+    if (!cli)
+        return;
+
+    // The call is only decoded by the traversal running on past the
+    // retf, nothing leads to it so it starts a function of its own
+    static const uint8_t orphan[] = {
+        0xCB,               // 100: retf
+        0xE8, 0x01, 0x00,   // 101: call 0x105
+        0xC3,               // 104: ret
+        0xC3,               // 105: ret
+    };
+    check_funcs_listing(orphan, sizeof(orphan));
+
+    uint32_t len = 1 << 14;
+    uint8_t *bytes = synthetic_bytes(len, 0x24);
+    check_funcs_listing(bytes, len);
+    free(bytes);
+}
+
+#define usage(x) \
+    fprintf(stderr, "Usage: %s [-c CLI]\n", x);
+
+int main(int argc, char **argv)
+{
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cli = optarg;
+                break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    test_length();
+    test_parallel();
+    test_sweep();
+    test_stream();
+    test_fmt();
+    test_sweep_stats();
+    test_redisasm();
+    test_cache();
+    test_bin();
+    test_xrefs();
+    test_cfg();
+    test_summaries();
+    test_funcs_listing();
+
+    if (failed) {
+        fprintf(stderr, "%d checks failed\n", failed);
+        return 1;
+    }
+
+    printf("All checks passed\n");
+    return 0;
+}
@@ -1,41 +1,38 @@
 #include <assert.h>
+#include <string.h>
 
 #include "i286dis.h"
 
-static bool try_fetch8(struct dis *dis, uint8_t *v)
-{
-    if (dis->ip >= dis->limit)
-        return false;
+// Fetches are unchecked, dis_decode_rec makes sure at least DIS_PAD
+// readable bytes follow the opcode before handing them to a decoder
 
-    *v = dis->bytes[dis->ip - dis->base];
-    dis->ip++;
-    return true;
+static uint8_t fetch8(struct dis *dis)
+{
+    return *dis->cur++;
 }
 
-static bool try_fetch16(struct dis *dis, uint16_t *v)
+static uint16_t fetch16(struct dis *dis)
 {
-    if (dis->ip + 1 >= dis->limit)
-        return false;
-
-    *v = (uint16_t)dis->bytes[dis->ip - dis->base]
-       | ((uint16_t)dis->bytes[dis->ip + 1 - dis->base] << 8);
-
-    dis->ip += 2;
-    return true;
+    uint16_t v;
+    memcpy(&v, dis->cur, sizeof(v));
+    dis->cur += sizeof(v);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap16(v);
+#endif
+    return v;
 }
 
-static bool try_fetch32(struct dis *dis, uint32_t *v)
+static uint32_t fetch32(struct dis *dis)
 {
-    if (dis->ip + 3 >= dis->limit)
-        return false;
-
-    *v = (uint32_t)dis->bytes[dis->ip - dis->base]
-       | ((uint32_t)dis->bytes[dis->ip + 1 - dis->base] << 8)
-       | ((uint32_t)dis->bytes[dis->ip + 2 - dis->base] << 16)
-       | ((uint32_t)dis->bytes[dis->ip + 3 - dis->base] << 24);
-
-    dis->ip += 4;
-    return true;
+    uint32_t v;
+    memcpy(&v, dis->cur, sizeof(v));
+    dis->cur += sizeof(v);
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
 }
 
 static enum reg get_reg(uint8_t reg, bool wide)
@@ -88,84 +85,342 @@ static enum seg get_seg(uint8_t seg)
     assert(false);
 }
 
-enum mem get_mem_mode(uint8_t rm, uint8_t mod)
-{
-    switch (rm & 0x7) {
-        case 0:
-            return I286_MEM_DS_BX_SI;
-
-        case 1:
-            return I286_MEM_DS_BX_DI;
-
-        case 2:
-            return I286_MEM_SS_BP_SI;
-
-        case 3:
-            return I286_MEM_SS_BP_DI;
-
-        case 4:
-            return I286_MEM_DS_SI;
+// Everything needed from a ModRM byte: whether r/m names a register,
+// the memory mode or the byte and word register, the reg field and the
+// number of displacement bytes that follow
+struct modrm {
+    bool direct;
+    uint8_t mode;
+    uint8_t rm[2];
+    uint8_t reg;
+    uint8_t disp;
+};
 
-        case 5:
-            return I286_MEM_DS_DI;
+static const struct modrm modrm_table[256] = {
+	/* 0x00 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 0, 0 },
+	/* 0x01 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 0, 0 },
+	/* 0x02 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 0, 0 },
+	/* 0x03 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 0, 0 },
+	/* 0x04 */ { false, I286_MEM_DS_SI, { 0, 0 }, 0, 0 },
+	/* 0x05 */ { false, I286_MEM_DS_DI, { 0, 0 }, 0, 0 },
+	/* 0x06 */ { false, I286_MEM_ABS, { 0, 0 }, 0, 2 },
+	/* 0x07 */ { false, I286_MEM_DS_BX, { 0, 0 }, 0, 0 },
+	/* 0x08 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 1, 0 },
+	/* 0x09 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 1, 0 },
+	/* 0x0A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 1, 0 },
+	/* 0x0B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 1, 0 },
+	/* 0x0C */ { false, I286_MEM_DS_SI, { 0, 0 }, 1, 0 },
+	/* 0x0D */ { false, I286_MEM_DS_DI, { 0, 0 }, 1, 0 },
+	/* 0x0E */ { false, I286_MEM_ABS, { 0, 0 }, 1, 2 },
+	/* 0x0F */ { false, I286_MEM_DS_BX, { 0, 0 }, 1, 0 },
+	/* 0x10 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 2, 0 },
+	/* 0x11 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 2, 0 },
+	/* 0x12 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 2, 0 },
+	/* 0x13 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 2, 0 },
+	/* 0x14 */ { false, I286_MEM_DS_SI, { 0, 0 }, 2, 0 },
+	/* 0x15 */ { false, I286_MEM_DS_DI, { 0, 0 }, 2, 0 },
+	/* 0x16 */ { false, I286_MEM_ABS, { 0, 0 }, 2, 2 },
+	/* 0x17 */ { false, I286_MEM_DS_BX, { 0, 0 }, 2, 0 },
+	/* 0x18 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 3, 0 },
+	/* 0x19 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 3, 0 },
+	/* 0x1A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 3, 0 },
+	/* 0x1B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 3, 0 },
+	/* 0x1C */ { false, I286_MEM_DS_SI, { 0, 0 }, 3, 0 },
+	/* 0x1D */ { false, I286_MEM_DS_DI, { 0, 0 }, 3, 0 },
+	/* 0x1E */ { false, I286_MEM_ABS, { 0, 0 }, 3, 2 },
+	/* 0x1F */ { false, I286_MEM_DS_BX, { 0, 0 }, 3, 0 },
+	/* 0x20 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 4, 0 },
+	/* 0x21 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 4, 0 },
+	/* 0x22 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 4, 0 },
+	/* 0x23 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 4, 0 },
+	/* 0x24 */ { false, I286_MEM_DS_SI, { 0, 0 }, 4, 0 },
+	/* 0x25 */ { false, I286_MEM_DS_DI, { 0, 0 }, 4, 0 },
+	/* 0x26 */ { false, I286_MEM_ABS, { 0, 0 }, 4, 2 },
+	/* 0x27 */ { false, I286_MEM_DS_BX, { 0, 0 }, 4, 0 },
+	/* 0x28 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 5, 0 },
+	/* 0x29 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 5, 0 },
+	/* 0x2A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 5, 0 },
+	/* 0x2B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 5, 0 },
+	/* 0x2C */ { false, I286_MEM_DS_SI, { 0, 0 }, 5, 0 },
+	/* 0x2D */ { false, I286_MEM_DS_DI, { 0, 0 }, 5, 0 },
+	/* 0x2E */ { false, I286_MEM_ABS, { 0, 0 }, 5, 2 },
+	/* 0x2F */ { false, I286_MEM_DS_BX, { 0, 0 }, 5, 0 },
+	/* 0x30 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 6, 0 },
+	/* 0x31 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 6, 0 },
+	/* 0x32 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 6, 0 },
+	/* 0x33 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 6, 0 },
+	/* 0x34 */ { false, I286_MEM_DS_SI, { 0, 0 }, 6, 0 },
+	/* 0x35 */ { false, I286_MEM_DS_DI, { 0, 0 }, 6, 0 },
+	/* 0x36 */ { false, I286_MEM_ABS, { 0, 0 }, 6, 2 },
+	/* 0x37 */ { false, I286_MEM_DS_BX, { 0, 0 }, 6, 0 },
+	/* 0x38 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 7, 0 },
+	/* 0x39 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 7, 0 },
+	/* 0x3A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 7, 0 },
+	/* 0x3B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 7, 0 },
+	/* 0x3C */ { false, I286_MEM_DS_SI, { 0, 0 }, 7, 0 },
+	/* 0x3D */ { false, I286_MEM_DS_DI, { 0, 0 }, 7, 0 },
+	/* 0x3E */ { false, I286_MEM_ABS, { 0, 0 }, 7, 2 },
+	/* 0x3F */ { false, I286_MEM_DS_BX, { 0, 0 }, 7, 0 },
+	/* 0x40 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 0, 1 },
+	/* 0x41 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 0, 1 },
+	/* 0x42 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 0, 1 },
+	/* 0x43 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 0, 1 },
+	/* 0x44 */ { false, I286_MEM_DS_SI, { 0, 0 }, 0, 1 },
+	/* 0x45 */ { false, I286_MEM_DS_DI, { 0, 0 }, 0, 1 },
+	/* 0x46 */ { false, I286_MEM_SS_BP, { 0, 0 }, 0, 1 },
+	/* 0x47 */ { false, I286_MEM_DS_BX, { 0, 0 }, 0, 1 },
+	/* 0x48 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 1, 1 },
+	/* 0x49 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 1, 1 },
+	/* 0x4A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 1, 1 },
+	/* 0x4B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 1, 1 },
+	/* 0x4C */ { false, I286_MEM_DS_SI, { 0, 0 }, 1, 1 },
+	/* 0x4D */ { false, I286_MEM_DS_DI, { 0, 0 }, 1, 1 },
+	/* 0x4E */ { false, I286_MEM_SS_BP, { 0, 0 }, 1, 1 },
+	/* 0x4F */ { false, I286_MEM_DS_BX, { 0, 0 }, 1, 1 },
+	/* 0x50 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 2, 1 },
+	/* 0x51 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 2, 1 },
+	/* 0x52 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 2, 1 },
+	/* 0x53 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 2, 1 },
+	/* 0x54 */ { false, I286_MEM_DS_SI, { 0, 0 }, 2, 1 },
+	/* 0x55 */ { false, I286_MEM_DS_DI, { 0, 0 }, 2, 1 },
+	/* 0x56 */ { false, I286_MEM_SS_BP, { 0, 0 }, 2, 1 },
+	/* 0x57 */ { false, I286_MEM_DS_BX, { 0, 0 }, 2, 1 },
+	/* 0x58 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 3, 1 },
+	/* 0x59 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 3, 1 },
+	/* 0x5A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 3, 1 },
+	/* 0x5B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 3, 1 },
+	/* 0x5C */ { false, I286_MEM_DS_SI, { 0, 0 }, 3, 1 },
+	/* 0x5D */ { false, I286_MEM_DS_DI, { 0, 0 }, 3, 1 },
+	/* 0x5E */ { false, I286_MEM_SS_BP, { 0, 0 }, 3, 1 },
+	/* 0x5F */ { false, I286_MEM_DS_BX, { 0, 0 }, 3, 1 },
+	/* 0x60 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 4, 1 },
+	/* 0x61 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 4, 1 },
+	/* 0x62 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 4, 1 },
+	/* 0x63 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 4, 1 },
+	/* 0x64 */ { false, I286_MEM_DS_SI, { 0, 0 }, 4, 1 },
+	/* 0x65 */ { false, I286_MEM_DS_DI, { 0, 0 }, 4, 1 },
+	/* 0x66 */ { false, I286_MEM_SS_BP, { 0, 0 }, 4, 1 },
+	/* 0x67 */ { false, I286_MEM_DS_BX, { 0, 0 }, 4, 1 },
+	/* 0x68 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 5, 1 },
+	/* 0x69 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 5, 1 },
+	/* 0x6A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 5, 1 },
+	/* 0x6B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 5, 1 },
+	/* 0x6C */ { false, I286_MEM_DS_SI, { 0, 0 }, 5, 1 },
+	/* 0x6D */ { false, I286_MEM_DS_DI, { 0, 0 }, 5, 1 },
+	/* 0x6E */ { false, I286_MEM_SS_BP, { 0, 0 }, 5, 1 },
+	/* 0x6F */ { false, I286_MEM_DS_BX, { 0, 0 }, 5, 1 },
+	/* 0x70 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 6, 1 },
+	/* 0x71 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 6, 1 },
+	/* 0x72 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 6, 1 },
+	/* 0x73 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 6, 1 },
+	/* 0x74 */ { false, I286_MEM_DS_SI, { 0, 0 }, 6, 1 },
+	/* 0x75 */ { false, I286_MEM_DS_DI, { 0, 0 }, 6, 1 },
+	/* 0x76 */ { false, I286_MEM_SS_BP, { 0, 0 }, 6, 1 },
+	/* 0x77 */ { false, I286_MEM_DS_BX, { 0, 0 }, 6, 1 },
+	/* 0x78 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 7, 1 },
+	/* 0x79 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 7, 1 },
+	/* 0x7A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 7, 1 },
+	/* 0x7B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 7, 1 },
+	/* 0x7C */ { false, I286_MEM_DS_SI, { 0, 0 }, 7, 1 },
+	/* 0x7D */ { false, I286_MEM_DS_DI, { 0, 0 }, 7, 1 },
+	/* 0x7E */ { false, I286_MEM_SS_BP, { 0, 0 }, 7, 1 },
+	/* 0x7F */ { false, I286_MEM_DS_BX, { 0, 0 }, 7, 1 },
+	/* 0x80 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 0, 2 },
+	/* 0x81 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 0, 2 },
+	/* 0x82 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 0, 2 },
+	/* 0x83 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 0, 2 },
+	/* 0x84 */ { false, I286_MEM_DS_SI, { 0, 0 }, 0, 2 },
+	/* 0x85 */ { false, I286_MEM_DS_DI, { 0, 0 }, 0, 2 },
+	/* 0x86 */ { false, I286_MEM_SS_BP, { 0, 0 }, 0, 2 },
+	/* 0x87 */ { false, I286_MEM_DS_BX, { 0, 0 }, 0, 2 },
+	/* 0x88 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 1, 2 },
+	/* 0x89 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 1, 2 },
+	/* 0x8A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 1, 2 },
+	/* 0x8B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 1, 2 },
+	/* 0x8C */ { false, I286_MEM_DS_SI, { 0, 0 }, 1, 2 },
+	/* 0x8D */ { false, I286_MEM_DS_DI, { 0, 0 }, 1, 2 },
+	/* 0x8E */ { false, I286_MEM_SS_BP, { 0, 0 }, 1, 2 },
+	/* 0x8F */ { false, I286_MEM_DS_BX, { 0, 0 }, 1, 2 },
+	/* 0x90 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 2, 2 },
+	/* 0x91 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 2, 2 },
+	/* 0x92 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 2, 2 },
+	/* 0x93 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 2, 2 },
+	/* 0x94 */ { false, I286_MEM_DS_SI, { 0, 0 }, 2, 2 },
+	/* 0x95 */ { false, I286_MEM_DS_DI, { 0, 0 }, 2, 2 },
+	/* 0x96 */ { false, I286_MEM_SS_BP, { 0, 0 }, 2, 2 },
+	/* 0x97 */ { false, I286_MEM_DS_BX, { 0, 0 }, 2, 2 },
+	/* 0x98 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 3, 2 },
+	/* 0x99 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 3, 2 },
+	/* 0x9A */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 3, 2 },
+	/* 0x9B */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 3, 2 },
+	/* 0x9C */ { false, I286_MEM_DS_SI, { 0, 0 }, 3, 2 },
+	/* 0x9D */ { false, I286_MEM_DS_DI, { 0, 0 }, 3, 2 },
+	/* 0x9E */ { false, I286_MEM_SS_BP, { 0, 0 }, 3, 2 },
+	/* 0x9F */ { false, I286_MEM_DS_BX, { 0, 0 }, 3, 2 },
+	/* 0xA0 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 4, 2 },
+	/* 0xA1 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 4, 2 },
+	/* 0xA2 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 4, 2 },
+	/* 0xA3 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 4, 2 },
+	/* 0xA4 */ { false, I286_MEM_DS_SI, { 0, 0 }, 4, 2 },
+	/* 0xA5 */ { false, I286_MEM_DS_DI, { 0, 0 }, 4, 2 },
+	/* 0xA6 */ { false, I286_MEM_SS_BP, { 0, 0 }, 4, 2 },
+	/* 0xA7 */ { false, I286_MEM_DS_BX, { 0, 0 }, 4, 2 },
+	/* 0xA8 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 5, 2 },
+	/* 0xA9 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 5, 2 },
+	/* 0xAA */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 5, 2 },
+	/* 0xAB */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 5, 2 },
+	/* 0xAC */ { false, I286_MEM_DS_SI, { 0, 0 }, 5, 2 },
+	/* 0xAD */ { false, I286_MEM_DS_DI, { 0, 0 }, 5, 2 },
+	/* 0xAE */ { false, I286_MEM_SS_BP, { 0, 0 }, 5, 2 },
+	/* 0xAF */ { false, I286_MEM_DS_BX, { 0, 0 }, 5, 2 },
+	/* 0xB0 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 6, 2 },
+	/* 0xB1 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 6, 2 },
+	/* 0xB2 */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 6, 2 },
+	/* 0xB3 */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 6, 2 },
+	/* 0xB4 */ { false, I286_MEM_DS_SI, { 0, 0 }, 6, 2 },
+	/* 0xB5 */ { false, I286_MEM_DS_DI, { 0, 0 }, 6, 2 },
+	/* 0xB6 */ { false, I286_MEM_SS_BP, { 0, 0 }, 6, 2 },
+	/* 0xB7 */ { false, I286_MEM_DS_BX, { 0, 0 }, 6, 2 },
+	/* 0xB8 */ { false, I286_MEM_DS_BX_SI, { 0, 0 }, 7, 2 },
+	/* 0xB9 */ { false, I286_MEM_DS_BX_DI, { 0, 0 }, 7, 2 },
+	/* 0xBA */ { false, I286_MEM_SS_BP_SI, { 0, 0 }, 7, 2 },
+	/* 0xBB */ { false, I286_MEM_SS_BP_DI, { 0, 0 }, 7, 2 },
+	/* 0xBC */ { false, I286_MEM_DS_SI, { 0, 0 }, 7, 2 },
+	/* 0xBD */ { false, I286_MEM_DS_DI, { 0, 0 }, 7, 2 },
+	/* 0xBE */ { false, I286_MEM_SS_BP, { 0, 0 }, 7, 2 },
+	/* 0xBF */ { false, I286_MEM_DS_BX, { 0, 0 }, 7, 2 },
+	/* 0xC0 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 0, 0 },
+	/* 0xC1 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 0, 0 },
+	/* 0xC2 */ { true, 0, { I286_REG_DL, I286_REG_DX }, 0, 0 },
+	/* 0xC3 */ { true, 0, { I286_REG_BL, I286_REG_BX }, 0, 0 },
+	/* 0xC4 */ { true, 0, { I286_REG_AH, I286_REG_SP }, 0, 0 },
+	/* 0xC5 */ { true, 0, { I286_REG_CH, I286_REG_BP }, 0, 0 },
+	/* 0xC6 */ { true, 0, { I286_REG_DH, I286_REG_SI }, 0, 0 },
+	/* 0xC7 */ { true, 0, { I286_REG_BH, I286_REG_DI }, 0, 0 },
+	/* 0xC8 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 1, 0 },
+	/* 0xC9 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 1, 0 },
+	/* 0xCA */ { true, 0, { I286_REG_DL, I286_REG_DX }, 1, 0 },
+	/* 0xCB */ { true, 0, { I286_REG_BL, I286_REG_BX }, 1, 0 },
+	/* 0xCC */ { true, 0, { I286_REG_AH, I286_REG_SP }, 1, 0 },
+	/* 0xCD */ { true, 0, { I286_REG_CH, I286_REG_BP }, 1, 0 },
+	/* 0xCE */ { true, 0, { I286_REG_DH, I286_REG_SI }, 1, 0 },
+	/* 0xCF */ { true, 0, { I286_REG_BH, I286_REG_DI }, 1, 0 },
+	/* 0xD0 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 2, 0 },
+	/* 0xD1 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 2, 0 },
+	/* 0xD2 */ { true, 0, { I286_REG_DL, I286_REG_DX }, 2, 0 },
+	/* 0xD3 */ { true, 0, { I286_REG_BL, I286_REG_BX }, 2, 0 },
+	/* 0xD4 */ { true, 0, { I286_REG_AH, I286_REG_SP }, 2, 0 },
+	/* 0xD5 */ { true, 0, { I286_REG_CH, I286_REG_BP }, 2, 0 },
+	/* 0xD6 */ { true, 0, { I286_REG_DH, I286_REG_SI }, 2, 0 },
+	/* 0xD7 */ { true, 0, { I286_REG_BH, I286_REG_DI }, 2, 0 },
+	/* 0xD8 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 3, 0 },
+	/* 0xD9 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 3, 0 },
+	/* 0xDA */ { true, 0, { I286_REG_DL, I286_REG_DX }, 3, 0 },
+	/* 0xDB */ { true, 0, { I286_REG_BL, I286_REG_BX }, 3, 0 },
+	/* 0xDC */ { true, 0, { I286_REG_AH, I286_REG_SP }, 3, 0 },
+	/* 0xDD */ { true, 0, { I286_REG_CH, I286_REG_BP }, 3, 0 },
+	/* 0xDE */ { true, 0, { I286_REG_DH, I286_REG_SI }, 3, 0 },
+	/* 0xDF */ { true, 0, { I286_REG_BH, I286_REG_DI }, 3, 0 },
+	/* 0xE0 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 4, 0 },
+	/* 0xE1 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 4, 0 },
+	/* 0xE2 */ { true, 0, { I286_REG_DL, I286_REG_DX }, 4, 0 },
+	/* 0xE3 */ { true, 0, { I286_REG_BL, I286_REG_BX }, 4, 0 },
+	/* 0xE4 */ { true, 0, { I286_REG_AH, I286_REG_SP }, 4, 0 },
+	/* 0xE5 */ { true, 0, { I286_REG_CH, I286_REG_BP }, 4, 0 },
+	/* 0xE6 */ { true, 0, { I286_REG_DH, I286_REG_SI }, 4, 0 },
+	/* 0xE7 */ { true, 0, { I286_REG_BH, I286_REG_DI }, 4, 0 },
+	/* 0xE8 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 5, 0 },
+	/* 0xE9 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 5, 0 },
+	/* 0xEA */ { true, 0, { I286_REG_DL, I286_REG_DX }, 5, 0 },
+	/* 0xEB */ { true, 0, { I286_REG_BL, I286_REG_BX }, 5, 0 },
+	/* 0xEC */ { true, 0, { I286_REG_AH, I286_REG_SP }, 5, 0 },
+	/* 0xED */ { true, 0, { I286_REG_CH, I286_REG_BP }, 5, 0 },
+	/* 0xEE */ { true, 0, { I286_REG_DH, I286_REG_SI }, 5, 0 },
+	/* 0xEF */ { true, 0, { I286_REG_BH, I286_REG_DI }, 5, 0 },
+	/* 0xF0 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 6, 0 },
+	/* 0xF1 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 6, 0 },
+	/* 0xF2 */ { true, 0, { I286_REG_DL, I286_REG_DX }, 6, 0 },
+	/* 0xF3 */ { true, 0, { I286_REG_BL, I286_REG_BX }, 6, 0 },
+	/* 0xF4 */ { true, 0, { I286_REG_AH, I286_REG_SP }, 6, 0 },
+	/* 0xF5 */ { true, 0, { I286_REG_CH, I286_REG_BP }, 6, 0 },
+	/* 0xF6 */ { true, 0, { I286_REG_DH, I286_REG_SI }, 6, 0 },
+	/* 0xF7 */ { true, 0, { I286_REG_BH, I286_REG_DI }, 6, 0 },
+	/* 0xF8 */ { true, 0, { I286_REG_AL, I286_REG_AX }, 7, 0 },
+	/* 0xF9 */ { true, 0, { I286_REG_CL, I286_REG_CX }, 7, 0 },
+	/* 0xFA */ { true, 0, { I286_REG_DL, I286_REG_DX }, 7, 0 },
+	/* 0xFB */ { true, 0, { I286_REG_BL, I286_REG_BX }, 7, 0 },
+	/* 0xFC */ { true, 0, { I286_REG_AH, I286_REG_SP }, 7, 0 },
+	/* 0xFD */ { true, 0, { I286_REG_CH, I286_REG_BP }, 7, 0 },
+	/* 0xFE */ { true, 0, { I286_REG_DH, I286_REG_SI }, 7, 0 },
+	/* 0xFF */ { true, 0, { I286_REG_BH, I286_REG_DI }, 7, 0 },
+};
 
-        case 6:
-            return mod == 0 ? I286_MEM_ABS : I286_MEM_SS_BP;
+static struct oper_rec *push_oper(struct insn_rec *ins, enum oper_flag flags)
+{
+    assert(ins->nopers < I286_OPER_N);
 
-        case 7:
-            return I286_MEM_DS_BX;
-    }
+    struct oper_rec *oper = &ins->opers[ins->nopers++];
+    oper->flags = flags;
+    oper->sel = 0;
+    oper->val = 0;
+    return oper;
+}
 
-    assert(false);
+static void push_imm8(struct insn_rec *ins, uint8_t imm8)
+{
+    push_oper(ins, I286_OPER_IMM8)->val = imm8;
 }
 
-static bool try_modrm(struct dis *dis, uint8_t *reg, struct oper **oper_rm, bool wide)
+static void push_reg(struct insn_rec *ins, enum reg reg)
 {
-    uint8_t modrm;
-    if (!try_fetch8(dis, &modrm))
-        return false;
+    push_oper(ins, I286_OPER_REG)->sel = reg;
+}
 
-    uint8_t mod = (modrm >> 6) & 0x3;
-    *reg = (modrm >> 3) & 0x7;
-    uint8_t rm = (modrm >> 0) & 0x7;
+static void push_seg(struct insn_rec *ins, enum seg seg)
+{
+    push_oper(ins, I286_OPER_SEG)->sel = seg;
+}
 
-    *oper_rm = oper_alloc(I286_OPER_MEM);
-    int16_t disp = 0;
-    uint8_t low;
+static void fetch_imm8(struct dis *dis, struct insn_rec *ins)
+{
+    push_oper(ins, I286_OPER_IMM8)->val = fetch8(dis);
+}
 
-    // 00 : No displacement
-    // 01 : 8-bit displacement
-    // 10 : 16-bit displacement
-    // 11 : Register
-    switch (mod) {
-        case 0:
-            if (rm != 6)
-                break;
-            // When mod=00 and r/m=110 get absolute displacement
-            // fall through
+static void fetch_imm16(struct dis *dis, struct insn_rec *ins)
+{
+    push_oper(ins, I286_OPER_IMM16)->val = fetch16(dis);
+}
 
-        case 2:
-            if (!try_fetch16(dis, (uint16_t *)&disp))
-                return false;
-            break;
+static void fetch_imm32(struct dis *dis, struct insn_rec *ins)
+{
+    // The high half is kept in the following slot
+    struct oper_rec *oper = push_oper(ins, I286_OPER_IMM32);
+    uint32_t imm32 = fetch32(dis);
 
-        case 1:
-            if (!try_fetch8(dis, &low))
-                return false;
+    oper[0].val = imm32 & 0xFFFF;
+    oper[1].val = imm32 >> 16;
+}
 
-            // Sign extend to 16 bits
-            disp = (int16_t)(int8_t)low;
-            break;
+static void fetch_modrm(struct dis *dis, uint8_t *reg, struct oper_rec *oper_rm, bool wide)
+{
+    const struct modrm *modrm = &modrm_table[fetch8(dis)];
+    *reg = modrm->reg;
 
-        case 3:
-            (*oper_rm)->flags = I286_OPER_REG;
-            (*oper_rm)->reg = get_reg(rm, wide);
-            return true;
+    if (modrm->direct) {
+        oper_rm->flags = I286_OPER_REG;
+        oper_rm->sel = modrm->rm[wide];
+        return;
     }
 
-    (*oper_rm)->mem.mode = get_mem_mode(rm, mod);
-    (*oper_rm)->mem.disp = disp;
-    return true;
+    // Always load two bytes, the table says how many are displacement
+    uint16_t raw = fetch16(dis);
+    dis->cur -= 2 - modrm->disp;
+
+    oper_rm->flags = I286_OPER_MEM;
+    oper_rm->sel = modrm->mode;
+    oper_rm->val = modrm->disp == 2 ? raw
+                 : modrm->disp == 1 ? (uint16_t)(int8_t)raw
+                 : 0;
 }
 
 // if dir then r/m -> reg else reg -> r/m
@@ -176,154 +431,164 @@ static bool try_modrm(struct dis *dis, uint8_t *reg, struct oper **oper_rm, bool
 #define REG_WIDE   (1UL << 0)
 #define REG_SEG    (1UL << 2)
 
-static bool try_modrm_full(struct dis *dis, struct oper **opers, int flags)
+static void fetch_modrm_full(struct dis *dis, struct insn_rec *ins, int flags)
 {
-    struct oper *o_rm, *o_reg;
+    struct oper_rec o_rm = { 0 }, o_reg = { 0 };
     uint8_t reg;
 
     bool wide = flags & REG_WIDE;
-    if (!try_modrm(dis, &reg, &o_rm, wide))
-        return false;
+    fetch_modrm(dis, &reg, &o_rm, wide);
 
-    o_reg = flags & REG_SEG
-          ? oper_alloc_seg(get_seg(reg))
-          : oper_alloc_reg(get_reg(reg, wide));
+    if (flags & REG_SEG) {
+        o_reg.flags = I286_OPER_SEG;
+        o_reg.sel = get_seg(reg);
+    } else {
+        o_reg.flags = I286_OPER_REG;
+        o_reg.sel = get_reg(reg, wide);
+    }
 
     if (flags & DIR_TO_REG) {
-        o_reg->next = o_rm;
-        *opers = o_reg;
+        *push_oper(ins, o_reg.flags) = o_reg;
+        *push_oper(ins, o_rm.flags) = o_rm;
     } else {
-        o_rm->next = o_reg;
-        *opers = o_rm;
+        *push_oper(ins, o_rm.flags) = o_rm;
+        *push_oper(ins, o_reg.flags) = o_reg;
     }
-
-    return true;
 }
 
 struct optab {
-    bool (*decode)(struct dis *, struct insn *, uintptr_t);
+    bool (*decode)(struct dis *, struct insn_rec *, uintptr_t);
     uintptr_t arg;
 };
 
-static bool decode_simple(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_simple(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     (void)dis;
     ins->op = arg;
     return true;
 }
 
-static bool decode_acc(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_acc(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     ins->op = arg & 0xFFFF;
     int flags = arg >> 16;
 
     if (flags & REG_WIDE) {
-        ins->opers = oper_alloc_reg(I286_REG_AX);
-        ins->opers->next = oper_alloc(I286_OPER_IMM16);
-        return try_fetch16(dis, &ins->opers->next->imm16);
+        push_reg(ins, I286_REG_AX);
+        fetch_imm16(dis, ins);
+        return true;
     }
 
-    ins->opers = oper_alloc_reg(I286_REG_AL);
-    ins->opers->next = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->next->imm8);
+    push_reg(ins, I286_REG_AL);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_imm(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_imm(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     ins->op = arg & 0xFFFF;
     int flags = arg >> 16;
 
     if (flags & REG_WIDE) {
-        ins->opers = oper_alloc(I286_OPER_IMM16);
-        return try_fetch16(dis, &ins->opers->imm16);
+        fetch_imm16(dis, ins);
+        return true;
     }
 
-    ins->opers = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->imm8);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_prefix(struct dis *dis, struct insn *ins, uintptr_t arg);
+static bool decode_prefix(struct dis *dis, struct insn_rec *ins, uintptr_t arg);
 
-static bool decode_modrm(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_modrm(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_MODRM]);
     ins->op = arg & 0xFFFF;
-    return try_modrm_full(dis, &ins->opers, arg >> 16);
+    fetch_modrm_full(dis, ins, arg >> 16);
+    return true;
 }
 
-static bool decode_jmpfar(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_jmpfar(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     // TODO: Maybe split segment and address?
     ins->op = arg;
-    ins->opers = oper_alloc(I286_OPER_IMM32);
-    return try_fetch32(dis, &ins->opers->imm32);
+    fetch_imm32(dis, ins);
+    return true;
 }
 
-static bool decode_int(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_int(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     ins->op = I286_INT;
-    ins->opers = oper_alloc_imm8(arg);
-    return arg || try_fetch8(dis, &ins->opers->imm8);
+    if (arg) {
+        push_imm8(ins, arg);
+        return true;
+    }
+
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_inout(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_inout(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     switch (arg) {
         case 0xEC:
             ins->op = I286_IN;
-            ins->opers = oper_alloc_reg(I286_REG_AL);
-            ins->opers->next = oper_alloc_reg(I286_REG_DX);
+            push_reg(ins, I286_REG_AL);
+            push_reg(ins, I286_REG_DX);
             return true;
 
         case 0xED:
             ins->op = I286_IN;
-            ins->opers = oper_alloc_reg(I286_REG_AX);
-            ins->opers->next = oper_alloc_reg(I286_REG_DX);
+            push_reg(ins, I286_REG_AX);
+            push_reg(ins, I286_REG_DX);
             return true;
 
         case 0xE4:
             ins->op = I286_IN;
-            ins->opers = oper_alloc_reg(I286_REG_AL);
-            ins->opers->next = oper_alloc(I286_OPER_IMM8);
-            return try_fetch8(dis, &ins->opers->next->imm8);
+            push_reg(ins, I286_REG_AL);
+            fetch_imm8(dis, ins);
+            return true;
 
         case 0xE5:
             ins->op = I286_IN;
-            ins->opers = oper_alloc_reg(I286_REG_AX);
-            ins->opers->next = oper_alloc(I286_OPER_IMM8);
-            return try_fetch8(dis, &ins->opers->next->imm8);
+            push_reg(ins, I286_REG_AX);
+            fetch_imm8(dis, ins);
+            return true;
 
         case 0xEE:
             ins->op = I286_OUT;
-            ins->opers = oper_alloc_reg(I286_REG_DX);
-            ins->opers->next = oper_alloc_reg(I286_REG_AL);
+            push_reg(ins, I286_REG_DX);
+            push_reg(ins, I286_REG_AL);
             return true;
 
         case 0xEF:
             ins->op = I286_OUT;
-            ins->opers = oper_alloc_reg(I286_REG_DX);
-            ins->opers->next = oper_alloc_reg(I286_REG_AX);
+            push_reg(ins, I286_REG_DX);
+            push_reg(ins, I286_REG_AX);
             return true;
 
         case 0xE6:
             ins->op = I286_OUT;
-            ins->opers = oper_alloc(I286_OPER_IMM8);
-            ins->opers->next = oper_alloc_reg(I286_REG_AL);
-            return try_fetch8(dis, &ins->opers->imm8);
+            fetch_imm8(dis, ins);
+
+            push_reg(ins, I286_REG_AL);
+            return true;
 
         case 0xE7:
             ins->op = I286_OUT;
-            ins->opers = oper_alloc(I286_OPER_IMM8);
-            ins->opers->next = oper_alloc_reg(I286_REG_AX);
-            return try_fetch8(dis, &ins->opers->imm8);
+            fetch_imm8(dis, ins);
+
+            push_reg(ins, I286_REG_AX);
+            return true;
     }
 
     return false;
 }
 
-static bool decode_regenc(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_regenc(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     uint8_t reg = arg & 0x7;
-    ins->opers = oper_alloc_reg(get_reg(reg, true));
+    push_reg(ins, get_reg(reg, true));
 
     switch (arg & 0xF8) {
         case 0x40:
@@ -348,150 +613,136 @@ static bool decode_regenc(struct dis *dis, struct insn *ins, uintptr_t arg)
 
         case 0xB0:
             ins->op = I286_MOV;
-            ins->opers->next = oper_alloc(I286_OPER_IMM8);
-            return try_fetch8(dis, &ins->opers->next->imm8);
+            fetch_imm8(dis, ins);
+            return true;
 
         case 0xB8:
             ins->op = I286_MOV;
-            ins->opers->next = oper_alloc(I286_OPER_IMM16);
-            return try_fetch16(dis, &ins->opers->next->imm16);
+            fetch_imm16(dis, ins);
+            return true;
     }
 
     return false;
 }
 
-static bool decode_pushpop(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_pushpop(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     // Special case: pop r/m16
     if (arg == 0x8F) {
         ins->op = I286_POP;
 
         uint8_t reg;
-        if (!try_modrm(dis, &reg, &ins->opers, true))
-            return false;
+        fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), true);
 
         return reg == 0;
     }
 
-    ins->opers = oper_alloc(I286_OPER_SEG);
     switch (arg) {
         case 0x06:
             ins->op = I286_PUSH;
-            ins->opers->seg = I286_SEG_ES;
+            push_seg(ins, I286_SEG_ES);
             return true;
 
         case 0x07:
             ins->op = I286_POP;
-            ins->opers->seg = I286_SEG_ES;
+            push_seg(ins, I286_SEG_ES);
             return true;
 
         case 0x0E:
             ins->op = I286_PUSH;
-            ins->opers->seg = I286_SEG_CS;
+            push_seg(ins, I286_SEG_CS);
             return true;
 
         case 0x16:
             ins->op = I286_PUSH;
-            ins->opers->seg = I286_SEG_SS;
+            push_seg(ins, I286_SEG_SS);
             return true;
 
         case 0x17:
             ins->op = I286_POP;
-            ins->opers->seg = I286_SEG_SS;
+            push_seg(ins, I286_SEG_SS);
             return true;
 
         case 0x1E:
             ins->op = I286_PUSH;
-            ins->opers->seg = I286_SEG_DS;
+            push_seg(ins, I286_SEG_DS);
             return true;
 
         case 0x1F:
             ins->op = I286_POP;
-            ins->opers->seg = I286_SEG_DS;
+            push_seg(ins, I286_SEG_DS);
             return true;
     }
 
     return false;
 }
 
-static bool decode_enter(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_enter(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     (void)arg;
     ins->op = I286_ENTER;
-    ins->opers = oper_alloc(I286_OPER_IMM16);
-    if (!try_fetch16(dis, &ins->opers->imm16))
-        return false;
-
-    ins->opers->next = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->next->imm8);
+    fetch_imm16(dis, ins);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_imul(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_imul(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     ins->op = I286_IMUL;
-    if (!try_modrm_full(dis, &ins->opers, DIR_TO_REG))
-        return false;
+    fetch_modrm_full(dis, ins, DIR_TO_REG);
 
     if (arg) {
-        ins->opers->next->next = oper_alloc(I286_OPER_IMM16);
-        return try_fetch16(dis, &ins->opers->next->next->imm16);
+        fetch_imm16(dis, ins);
+        return true;
     }
 
-    ins->opers->next->next = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->next->next->imm8);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_moff(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_moff(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     ins->op = arg & 0xFFFF;
     int flags = arg >> 16;
 
-    struct oper *o_reg, *o_off;
-    int16_t disp = 0;
-
-    o_reg = oper_alloc_reg(flags & REG_WIDE ? I286_REG_AX : I286_REG_AL);
-
-    if (!try_fetch16(dis, (uint16_t *)&disp))
-        return false;
-
-    o_off = oper_alloc(I286_OPER_MEM);
-    o_off->mem.mode = I286_MEM_MOFF;
-    o_off->mem.disp = disp;
-
+    struct oper_rec *o_reg, *o_off;
     if (flags & DIR_TO_REG) {
-        ins->opers = o_reg;
-        o_reg->next = o_off;
+        o_reg = push_oper(ins, I286_OPER_REG);
+        o_off = push_oper(ins, I286_OPER_MEM);
     } else {
-        ins->opers = o_off;
-        o_off->next = o_reg;
+        o_off = push_oper(ins, I286_OPER_MEM);
+        o_reg = push_oper(ins, I286_OPER_REG);
     }
 
+    o_reg->sel = flags & REG_WIDE ? I286_REG_AX : I286_REG_AL;
+    o_off->sel = I286_MEM_MOFF;
+    o_off->val = fetch16(dis);
     return true;
 }
 
-static bool decode_mov(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_mov(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     uint8_t reg;
     bool wide = arg & REG_WIDE;
 
-    if (!try_modrm(dis, &reg, &ins->opers, wide))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), wide);
 
     if (reg != 0)
         return false;
 
     ins->op = I286_MOV;
     if (wide) {
-        ins->opers->next = oper_alloc(I286_OPER_IMM16);
-        return try_fetch16(dis, &ins->opers->next->imm16);
+        fetch_imm16(dis, ins);
+        return true;
     }
 
-    ins->opers->next = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->next->imm8);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_group1(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_group1(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_GROUP1]);
     const enum opcode group[8] = {
         I286_ADD,
         I286_OR,
@@ -506,21 +757,21 @@ static bool decode_group1(struct dis *dis, struct insn *ins, uintptr_t arg)
     uint8_t reg;
     bool wide = arg & 0x1;
 
-    if (!try_modrm(dis, &reg, &ins->opers, wide))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), wide);
 
     ins->op = group[reg & 0x7];
     if (wide && arg != 0x83) {
-        ins->opers->next = oper_alloc(I286_OPER_IMM16);
-        return try_fetch16(dis, &ins->opers->next->imm16);
+        fetch_imm16(dis, ins);
+        return true;
     }
 
-    ins->opers->next = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->next->imm8);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_group2(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_group2(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_GROUP2]);
     const enum opcode group[8] = {
         I286_ROL,
         I286_ROR,
@@ -535,32 +786,32 @@ static bool decode_group2(struct dis *dis, struct insn *ins, uintptr_t arg)
     uint8_t reg;
     bool wide = arg & 0x1;
 
-    if (!try_modrm(dis, &reg, &ins->opers, wide))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), wide);
 
     ins->op = group[reg & 0x7];
     switch (arg) {
         case 0xC0:
         case 0xC1:
-            ins->opers->next = oper_alloc(I286_OPER_IMM8);
-            return try_fetch8(dis, &ins->opers->next->imm8);
+            fetch_imm8(dis, ins);
+            return true;
 
         case 0xD0:
         case 0xD1:
-            ins->opers->next = oper_alloc_imm8(1);
+            push_imm8(ins, 1);
             return true;
 
         case 0xD2:
         case 0xD3:
-            ins->opers->next = oper_alloc_reg(I286_REG_CL);
+            push_reg(ins, I286_REG_CL);
             return true;
     }
 
     return false;
 }
 
-static bool decode_group3(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_group3(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_GROUP3]);
     const enum opcode group[8] = {
         I286_TEST,
         I286_BAD,
@@ -575,24 +826,24 @@ static bool decode_group3(struct dis *dis, struct insn *ins, uintptr_t arg)
     uint8_t reg;
     bool wide = arg & 0x1;
 
-    if (!try_modrm(dis, &reg, &ins->opers, arg & 0x1))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), wide);
 
     ins->op = group[reg & 0x7];
     if (ins->op != I286_TEST)
         return true;
 
     if (wide) {
-        ins->opers->next = oper_alloc(I286_OPER_IMM16);
-        return try_fetch16(dis, &ins->opers->next->imm16);
+        fetch_imm16(dis, ins);
+        return true;
     }
 
-    ins->opers->next = oper_alloc(I286_OPER_IMM8);
-    return try_fetch8(dis, &ins->opers->next->imm8);
+    fetch_imm8(dis, ins);
+    return true;
 }
 
-static bool decode_group4(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_group4(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_GROUP4]);
     const enum opcode group[8] = {
         I286_INC,
         I286_DEC,
@@ -607,8 +858,7 @@ static bool decode_group4(struct dis *dis, struct insn *ins, uintptr_t arg)
     uint8_t reg;
     bool wide = arg & 0x1;
 
-    if (!try_modrm(dis, &reg, &ins->opers, wide))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), wide);
 
     ins->op = group[reg & 0x7];
     if (!wide && ins->op != I286_INC && ins->op != I286_DEC)
@@ -617,7 +867,7 @@ static bool decode_group4(struct dis *dis, struct insn *ins, uintptr_t arg)
     return true;
 }
 
-static bool decode_escape0f(struct dis *dis, struct insn *ins, uintptr_t arg);
+static bool decode_escape0f(struct dis *dis, struct insn_rec *ins, uintptr_t arg);
 
 static struct optab encodings[256] = {
 	/* 0x00 */ { decode_modrm, I286_ADD | DIR_TO_RM << 16 },
@@ -878,8 +1128,11 @@ static struct optab encodings[256] = {
 	/* 0xFF */ { decode_group4, 0xFF },
 };
 
-static bool decode_prefix(struct dis *dis, struct insn *ins, uintptr_t arg)
+// Only records the prefix, dis_decode_rec moves on to the next byte
+static bool decode_prefix(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    (void)dis;
+    DIS_STAT(dis, handlers[DIS_HANDLER_PREFIX]);
     enum prefix mask = 0;
     switch (arg) {
         case PRE_LOCK:
@@ -896,19 +1149,14 @@ static bool decode_prefix(struct dis *dis, struct insn *ins, uintptr_t arg)
             break;
     }
 
-    uint8_t next;
-    if (!try_fetch8(dis, &next))
-        return false;
-
     ins->pref &= ~mask;
     ins->pref |= arg;
-
-    struct optab *optab = &encodings[next];
-    return optab->decode && optab->decode(dis, ins, optab->arg);
+    return true;
 }
 
-static bool decode_group6(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_group6(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_GROUP6]);
     (void)arg;
     const enum opcode group[8] = {
         I286_SLDT,
@@ -922,15 +1170,15 @@ static bool decode_group6(struct dis *dis, struct insn *ins, uintptr_t arg)
     };
 
     uint8_t reg;
-    if (!try_modrm(dis, &reg, &ins->opers, true))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), true);
 
     ins->op = group[reg & 0x7];
     return true;
 }
 
-static bool decode_group7(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_group7(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
+    DIS_STAT(dis, handlers[DIS_HANDLER_GROUP7]);
     (void)arg;
     const enum opcode group[8] = {
         I286_SGDT,
@@ -944,8 +1192,7 @@ static bool decode_group7(struct dis *dis, struct insn *ins, uintptr_t arg)
     };
 
     uint8_t reg;
-    if (!try_modrm(dis, &reg, &ins->opers, true))
-        return false;
+    fetch_modrm(dis, &reg, push_oper(ins, I286_OPER_MEM), true);
 
     ins->op = group[reg & 0x7];
     return true;
@@ -1210,33 +1457,687 @@ static struct optab encodings_0f[256] = {
 	/* 0xFF */ { NULL, 0 },
 };
 
-static bool decode_escape0f(struct dis *dis, struct insn *ins, uintptr_t arg)
+static bool decode_escape0f(struct dis *dis, struct insn_rec *ins, uintptr_t arg)
 {
     (void)arg;
 
-    uint8_t op;
-    if (!try_fetch8(dis, &op))
-        return false;
-
-    struct optab *optab = &encodings_0f[op];
+    struct optab *optab = &encodings_0f[fetch8(dis)];
     return optab->decode && optab->decode(dis, ins, optab->arg);
 }
 
-struct insn *dis_decode(struct dis *dis)
+void dis_decode_rec(struct dis *dis, struct insn_rec *ins)
 {
     uint32_t start = dis->ip;
-    struct insn *ins = insn_alloc(start);
+    memset(ins, 0, sizeof(struct insn_rec));
+    ins->addr = start;
+
+    // Prefixes can run up to the end of the image, so they are taken
+    // with checked reads
+    struct optab *optab = NULL;
+    bool overlong = false;
+    while (dis->ip < dis->limit) {
+        optab = &encodings[dis->bytes[dis->ip++ - dis->base]];
+        if (optab->decode != decode_prefix)
+            break;
 
-    uint8_t op = dis->bytes[dis->ip++ - dis->base];
-    struct optab *optab = &encodings[op];
-    if (!optab->decode || !optab->decode(dis, ins, optab->arg))
+        if (dis->ip - start > DIS_PREFIX_MAX) {
+            overlong = true;
+            break;
+        }
+
+        decode_prefix(dis, ins, optab->arg);
+        optab = NULL;
+    }
+
+    if (overlong) {
+        DIS_STAT(dis, bad_invalid);
+        ins->op = I286_BAD;
+    } else if (!optab) {
+        DIS_STAT(dis, bad_truncated);
         ins->op = I286_BAD;
+    } else if (!optab->decode) {
+        DIS_STAT(dis, bad_invalid);
+        ins->op = I286_BAD;
+    } else {
+        // Whatever follows the prefixes fits in DIS_PAD bytes, so this is
+        // the only bounds check. Near the end of an unpadded image the
+        // decoder reads a zero padded copy of the remaining bytes.
+        uint32_t avail = dis->limit - dis->ip;
+        const uint8_t *from = dis->bytes + (dis->ip - dis->base);
+
+        if (!(dis->flags & DIS_PADDED) && avail < DIS_PAD) {
+            memset(dis->tail, 0, DIS_PAD);
+            memcpy(dis->tail, from, avail);
+            from = dis->tail;
+        }
+
+        dis->cur = from;
+        bool ok = optab->decode(dis, ins, optab->arg);
+        dis->ip += dis->cur - from;
+
+        // Truncated by the end of the image
+        if (dis->ip > dis->limit) {
+            DIS_STAT(dis, bad_truncated);
+            ins->nopers = 0;
+            ins->op = I286_BAD;
+        } else if (!ok || ins->op == I286_BAD) {
+            DIS_STAT(dis, bad_invalid);
+            ins->op = I286_BAD;
+        }
+    }
 
     // XXX: Should bad opcodes reset the len?
     if (ins->op == I286_BAD)
         dis->ip = start + 1;
 
-    dis->decoded[start - dis->base] = ins;
     ins->len = dis->ip - start;
-    return ins;
+    DIS_STAT(dis, opcodes[ins->op]);
+}
+
+struct insn *dis_decode(struct dis *dis)
+{
+    struct insn_rec rec;
+    dis_decode_rec(dis, &rec);
+    return dis_insert(dis, &rec);
+}
+
+size_t dis_decode_batch(struct dis *dis, uint32_t start, struct insn_rec *out, size_t n)
+{
+    if (start < dis->base)
+        return 0;
+
+    size_t i = 0;
+    dis->ip = start;
+
+    while (i < n && dis->ip < dis->limit)
+        dis_decode_rec(dis, &out[i++]);
+
+    return i;
+}
+
+// Length classes mirroring encodings and encodings_0f, used to find
+// instruction boundaries without decoding operands. bad has a bit set
+// for every ModRM reg field that decodes to (bad).
+
+#define LEN_IMM(n)  (n)
+#define LEN_IMM_MASK 0x7
+#define LEN_MODRM   (1 << 3)
+#define LEN_PREFIX  (1 << 4)
+#define LEN_ESCAPE  (1 << 5)
+#define LEN_TEST    (1 << 6)
+#define LEN_BAD     (1 << 7)
+
+struct lentab {
+    uint8_t flags;
+    uint8_t bad;
+};
+
+static const struct lentab lengths[256] = {
+	/* 0x00 */ { LEN_MODRM, 0x00 },
+	/* 0x01 */ { LEN_MODRM, 0x00 },
+	/* 0x02 */ { LEN_MODRM, 0x00 },
+	/* 0x03 */ { LEN_MODRM, 0x00 },
+	/* 0x04 */ { LEN_IMM(1), 0x00 },
+	/* 0x05 */ { LEN_IMM(2), 0x00 },
+	/* 0x06 */ { 0, 0x00 },
+	/* 0x07 */ { 0, 0x00 },
+	/* 0x08 */ { LEN_MODRM, 0x00 },
+	/* 0x09 */ { LEN_MODRM, 0x00 },
+	/* 0x0A */ { LEN_MODRM, 0x00 },
+	/* 0x0B */ { LEN_MODRM, 0x00 },
+	/* 0x0C */ { LEN_IMM(1), 0x00 },
+	/* 0x0D */ { LEN_IMM(2), 0x00 },
+	/* 0x0E */ { 0, 0x00 },
+	/* 0x0F */ { LEN_ESCAPE, 0x00 },
+	/* 0x10 */ { LEN_MODRM, 0x00 },
+	/* 0x11 */ { LEN_MODRM, 0x00 },
+	/* 0x12 */ { LEN_MODRM, 0x00 },
+	/* 0x13 */ { LEN_MODRM, 0x00 },
+	/* 0x14 */ { LEN_IMM(1), 0x00 },
+	/* 0x15 */ { LEN_IMM(2), 0x00 },
+	/* 0x16 */ { 0, 0x00 },
+	/* 0x17 */ { 0, 0x00 },
+	/* 0x18 */ { LEN_MODRM, 0x00 },
+	/* 0x19 */ { LEN_MODRM, 0x00 },
+	/* 0x1A */ { LEN_MODRM, 0x00 },
+	/* 0x1B */ { LEN_MODRM, 0x00 },
+	/* 0x1C */ { LEN_IMM(1), 0x00 },
+	/* 0x1D */ { LEN_IMM(2), 0x00 },
+	/* 0x1E */ { 0, 0x00 },
+	/* 0x1F */ { 0, 0x00 },
+	/* 0x20 */ { LEN_MODRM, 0x00 },
+	/* 0x21 */ { LEN_MODRM, 0x00 },
+	/* 0x22 */ { LEN_MODRM, 0x00 },
+	/* 0x23 */ { LEN_MODRM, 0x00 },
+	/* 0x24 */ { LEN_IMM(1), 0x00 },
+	/* 0x25 */ { LEN_IMM(2), 0x00 },
+	/* 0x26 */ { LEN_PREFIX, 0x00 },
+	/* 0x27 */ { 0, 0x00 },
+	/* 0x28 */ { LEN_MODRM, 0x00 },
+	/* 0x29 */ { LEN_MODRM, 0x00 },
+	/* 0x2A */ { LEN_MODRM, 0x00 },
+	/* 0x2B */ { LEN_MODRM, 0x00 },
+	/* 0x2C */ { LEN_IMM(1), 0x00 },
+	/* 0x2D */ { LEN_IMM(2), 0x00 },
+	/* 0x2E */ { LEN_PREFIX, 0x00 },
+	/* 0x2F */ { 0, 0x00 },
+	/* 0x30 */ { LEN_MODRM, 0x00 },
+	/* 0x31 */ { LEN_MODRM, 0x00 },
+	/* 0x32 */ { LEN_MODRM, 0x00 },
+	/* 0x33 */ { LEN_MODRM, 0x00 },
+	/* 0x34 */ { LEN_IMM(1), 0x00 },
+	/* 0x35 */ { LEN_IMM(2), 0x00 },
+	/* 0x36 */ { LEN_PREFIX, 0x00 },
+	/* 0x37 */ { 0, 0x00 },
+	/* 0x38 */ { LEN_MODRM, 0x00 },
+	/* 0x39 */ { LEN_MODRM, 0x00 },
+	/* 0x3A */ { LEN_MODRM, 0x00 },
+	/* 0x3B */ { LEN_MODRM, 0x00 },
+	/* 0x3C */ { LEN_IMM(1), 0x00 },
+	/* 0x3D */ { LEN_IMM(2), 0x00 },
+	/* 0x3E */ { LEN_PREFIX, 0x00 },
+	/* 0x3F */ { 0, 0x00 },
+	/* 0x40 */ { 0, 0x00 },
+	/* 0x41 */ { 0, 0x00 },
+	/* 0x42 */ { 0, 0x00 },
+	/* 0x43 */ { 0, 0x00 },
+	/* 0x44 */ { 0, 0x00 },
+	/* 0x45 */ { 0, 0x00 },
+	/* 0x46 */ { 0, 0x00 },
+	/* 0x47 */ { 0, 0x00 },
+	/* 0x48 */ { 0, 0x00 },
+	/* 0x49 */ { 0, 0x00 },
+	/* 0x4A */ { 0, 0x00 },
+	/* 0x4B */ { 0, 0x00 },
+	/* 0x4C */ { 0, 0x00 },
+	/* 0x4D */ { 0, 0x00 },
+	/* 0x4E */ { 0, 0x00 },
+	/* 0x4F */ { 0, 0x00 },
+	/* 0x50 */ { 0, 0x00 },
+	/* 0x51 */ { 0, 0x00 },
+	/* 0x52 */ { 0, 0x00 },
+	/* 0x53 */ { 0, 0x00 },
+	/* 0x54 */ { 0, 0x00 },
+	/* 0x55 */ { 0, 0x00 },
+	/* 0x56 */ { 0, 0x00 },
+	/* 0x57 */ { 0, 0x00 },
+	/* 0x58 */ { 0, 0x00 },
+	/* 0x59 */ { 0, 0x00 },
+	/* 0x5A */ { 0, 0x00 },
+	/* 0x5B */ { 0, 0x00 },
+	/* 0x5C */ { 0, 0x00 },
+	/* 0x5D */ { 0, 0x00 },
+	/* 0x5E */ { 0, 0x00 },
+	/* 0x5F */ { 0, 0x00 },
+	/* 0x60 */ { 0, 0x00 },
+	/* 0x61 */ { 0, 0x00 },
+	/* 0x62 */ { LEN_MODRM, 0x00 },
+	/* 0x63 */ { LEN_MODRM, 0x00 },
+	/* 0x64 */ { LEN_BAD, 0x00 },
+	/* 0x65 */ { LEN_BAD, 0x00 },
+	/* 0x66 */ { LEN_BAD, 0x00 },
+	/* 0x67 */ { LEN_BAD, 0x00 },
+	/* 0x68 */ { LEN_IMM(2), 0x00 },
+	/* 0x69 */ { LEN_MODRM | LEN_IMM(2), 0x00 },
+	/* 0x6A */ { LEN_IMM(1), 0x00 },
+	/* 0x6B */ { LEN_MODRM | LEN_IMM(1), 0x00 },
+	/* 0x6C */ { 0, 0x00 },
+	/* 0x6D */ { 0, 0x00 },
+	/* 0x6E */ { 0, 0x00 },
+	/* 0x6F */ { 0, 0x00 },
+	/* 0x70 */ { LEN_IMM(1), 0x00 },
+	/* 0x71 */ { LEN_IMM(1), 0x00 },
+	/* 0x72 */ { LEN_IMM(1), 0x00 },
+	/* 0x73 */ { LEN_IMM(1), 0x00 },
+	/* 0x74 */ { LEN_IMM(1), 0x00 },
+	/* 0x75 */ { LEN_IMM(1), 0x00 },
+	/* 0x76 */ { LEN_IMM(1), 0x00 },
+	/* 0x77 */ { LEN_IMM(1), 0x00 },
+	/* 0x78 */ { LEN_IMM(1), 0x00 },
+	/* 0x79 */ { LEN_IMM(1), 0x00 },
+	/* 0x7A */ { LEN_IMM(1), 0x00 },
+	/* 0x7B */ { LEN_IMM(1), 0x00 },
+	/* 0x7C */ { LEN_IMM(1), 0x00 },
+	/* 0x7D */ { LEN_IMM(1), 0x00 },
+	/* 0x7E */ { LEN_IMM(1), 0x00 },
+	/* 0x7F */ { LEN_IMM(1), 0x00 },
+	/* 0x80 */ { LEN_MODRM | LEN_IMM(1), 0x00 },
+	/* 0x81 */ { LEN_MODRM | LEN_IMM(2), 0x00 },
+	/* 0x82 */ { LEN_BAD, 0x00 },
+	/* 0x83 */ { LEN_MODRM | LEN_IMM(1), 0x00 },
+	/* 0x84 */ { LEN_MODRM, 0x00 },
+	/* 0x85 */ { LEN_MODRM, 0x00 },
+	/* 0x86 */ { LEN_MODRM, 0x00 },
+	/* 0x87 */ { LEN_MODRM, 0x00 },
+	/* 0x88 */ { LEN_MODRM, 0x00 },
+	/* 0x89 */ { LEN_MODRM, 0x00 },
+	/* 0x8A */ { LEN_MODRM, 0x00 },
+	/* 0x8B */ { LEN_MODRM, 0x00 },
+	/* 0x8C */ { LEN_MODRM, 0x00 },
+	/* 0x8D */ { LEN_MODRM, 0x00 },
+	/* 0x8E */ { LEN_MODRM, 0x00 },
+	/* 0x8F */ { LEN_MODRM, 0xFE },
+	/* 0x90 */ { 0, 0x00 },
+	/* 0x91 */ { 0, 0x00 },
+	/* 0x92 */ { 0, 0x00 },
+	/* 0x93 */ { 0, 0x00 },
+	/* 0x94 */ { 0, 0x00 },
+	/* 0x95 */ { 0, 0x00 },
+	/* 0x96 */ { 0, 0x00 },
+	/* 0x97 */ { 0, 0x00 },
+	/* 0x98 */ { 0, 0x00 },
+	/* 0x99 */ { 0, 0x00 },
+	/* 0x9A */ { LEN_IMM(4), 0x00 },
+	/* 0x9B */ { 0, 0x00 },
+	/* 0x9C */ { 0, 0x00 },
+	/* 0x9D */ { 0, 0x00 },
+	/* 0x9E */ { 0, 0x00 },
+	/* 0x9F */ { 0, 0x00 },
+	/* 0xA0 */ { LEN_IMM(2), 0x00 },
+	/* 0xA1 */ { LEN_IMM(2), 0x00 },
+	/* 0xA2 */ { LEN_IMM(2), 0x00 },
+	/* 0xA3 */ { LEN_IMM(2), 0x00 },
+	/* 0xA4 */ { 0, 0x00 },
+	/* 0xA5 */ { 0, 0x00 },
+	/* 0xA6 */ { 0, 0x00 },
+	/* 0xA7 */ { 0, 0x00 },
+	/* 0xA8 */ { LEN_IMM(1), 0x00 },
+	/* 0xA9 */ { LEN_IMM(2), 0x00 },
+	/* 0xAA */ { 0, 0x00 },
+	/* 0xAB */ { 0, 0x00 },
+	/* 0xAC */ { 0, 0x00 },
+	/* 0xAD */ { 0, 0x00 },
+	/* 0xAE */ { 0, 0x00 },
+	/* 0xAF */ { 0, 0x00 },
+	/* 0xB0 */ { LEN_IMM(1), 0x00 },
+	/* 0xB1 */ { LEN_IMM(1), 0x00 },
+	/* 0xB2 */ { LEN_IMM(1), 0x00 },
+	/* 0xB3 */ { LEN_IMM(1), 0x00 },
+	/* 0xB4 */ { LEN_IMM(1), 0x00 },
+	/* 0xB5 */ { LEN_IMM(1), 0x00 },
+	/* 0xB6 */ { LEN_IMM(1), 0x00 },
+	/* 0xB7 */ { LEN_IMM(1), 0x00 },
+	/* 0xB8 */ { LEN_IMM(2), 0x00 },
+	/* 0xB9 */ { LEN_IMM(2), 0x00 },
+	/* 0xBA */ { LEN_IMM(2), 0x00 },
+	/* 0xBB */ { LEN_IMM(2), 0x00 },
+	/* 0xBC */ { LEN_IMM(2), 0x00 },
+	/* 0xBD */ { LEN_IMM(2), 0x00 },
+	/* 0xBE */ { LEN_IMM(2), 0x00 },
+	/* 0xBF */ { LEN_IMM(2), 0x00 },
+	/* 0xC0 */ { LEN_MODRM | LEN_IMM(1), 0x40 },
+	/* 0xC1 */ { LEN_MODRM | LEN_IMM(1), 0x40 },
+	/* 0xC2 */ { LEN_IMM(2), 0x00 },
+	/* 0xC3 */ { 0, 0x00 },
+	/* 0xC4 */ { LEN_MODRM, 0x00 },
+	/* 0xC5 */ { LEN_MODRM, 0x00 },
+	/* 0xC6 */ { LEN_MODRM | LEN_IMM(1), 0xFE },
+	/* 0xC7 */ { LEN_MODRM | LEN_IMM(2), 0xFE },
+	/* 0xC8 */ { LEN_IMM(3), 0x00 },
+	/* 0xC9 */ { 0, 0x00 },
+	/* 0xCA */ { LEN_IMM(2), 0x00 },
+	/* 0xCB */ { 0, 0x00 },
+	/* 0xCC */ { 0, 0x00 },
+	/* 0xCD */ { LEN_IMM(1), 0x00 },
+	/* 0xCE */ { 0, 0x00 },
+	/* 0xCF */ { 0, 0x00 },
+	/* 0xD0 */ { LEN_MODRM, 0x40 },
+	/* 0xD1 */ { LEN_MODRM, 0x40 },
+	/* 0xD2 */ { LEN_MODRM, 0x40 },
+	/* 0xD3 */ { LEN_MODRM, 0x40 },
+	/* 0xD4 */ { LEN_IMM(1), 0x00 },
+	/* 0xD5 */ { LEN_IMM(1), 0x00 },
+	/* 0xD6 */ { 0, 0x00 },
+	/* 0xD7 */ { 0, 0x00 },
+	/* 0xD8 */ { LEN_BAD, 0x00 },
+	/* 0xD9 */ { LEN_BAD, 0x00 },
+	/* 0xDA */ { LEN_BAD, 0x00 },
+	/* 0xDB */ { LEN_BAD, 0x00 },
+	/* 0xDC */ { LEN_BAD, 0x00 },
+	/* 0xDD */ { LEN_BAD, 0x00 },
+	/* 0xDE */ { LEN_BAD, 0x00 },
+	/* 0xDF */ { LEN_BAD, 0x00 },
+	/* 0xE0 */ { LEN_IMM(1), 0x00 },
+	/* 0xE1 */ { LEN_IMM(1), 0x00 },
+	/* 0xE2 */ { LEN_IMM(1), 0x00 },
+	/* 0xE3 */ { LEN_IMM(1), 0x00 },
+	/* 0xE4 */ { LEN_IMM(1), 0x00 },
+	/* 0xE5 */ { LEN_IMM(1), 0x00 },
+	/* 0xE6 */ { LEN_IMM(1), 0x00 },
+	/* 0xE7 */ { LEN_IMM(1), 0x00 },
+	/* 0xE8 */ { LEN_IMM(2), 0x00 },
+	/* 0xE9 */ { LEN_IMM(2), 0x00 },
+	/* 0xEA */ { LEN_IMM(4), 0x00 },
+	/* 0xEB */ { LEN_IMM(1), 0x00 },
+	/* 0xEC */ { 0, 0x00 },
+	/* 0xED */ { 0, 0x00 },
+	/* 0xEE */ { 0, 0x00 },
+	/* 0xEF */ { 0, 0x00 },
+	/* 0xF0 */ { LEN_PREFIX, 0x00 },
+	/* 0xF1 */ { 0, 0x00 },
+	/* 0xF2 */ { LEN_PREFIX, 0x00 },
+	/* 0xF3 */ { LEN_PREFIX, 0x00 },
+	/* 0xF4 */ { 0, 0x00 },
+	/* 0xF5 */ { 0, 0x00 },
+	/* 0xF6 */ { LEN_MODRM | LEN_TEST | LEN_IMM(1), 0x02 },
+	/* 0xF7 */ { LEN_MODRM | LEN_TEST | LEN_IMM(2), 0x02 },
+	/* 0xF8 */ { 0, 0x00 },
+	/* 0xF9 */ { 0, 0x00 },
+	/* 0xFA */ { 0, 0x00 },
+	/* 0xFB */ { 0, 0x00 },
+	/* 0xFC */ { 0, 0x00 },
+	/* 0xFD */ { 0, 0x00 },
+	/* 0xFE */ { LEN_MODRM, 0xFC },
+	/* 0xFF */ { LEN_MODRM, 0x80 },
+};
+
+static const struct lentab lengths_0f[256] = {
+	/* 0x00 */ { LEN_MODRM, 0xC0 },
+	/* 0x01 */ { LEN_MODRM, 0xA0 },
+	/* 0x02 */ { LEN_MODRM, 0x00 },
+	/* 0x03 */ { LEN_BAD, 0x00 },
+	/* 0x04 */ { LEN_BAD, 0x00 },
+	/* 0x05 */ { LEN_BAD, 0x00 },
+	/* 0x06 */ { 0, 0x00 },
+	/* 0x07 */ { LEN_BAD, 0x00 },
+	/* 0x08 */ { LEN_BAD, 0x00 },
+	/* 0x09 */ { LEN_BAD, 0x00 },
+	/* 0x0A */ { LEN_BAD, 0x00 },
+	/* 0x0B */ { LEN_BAD, 0x00 },
+	/* 0x0C */ { LEN_BAD, 0x00 },
+	/* 0x0D */ { LEN_BAD, 0x00 },
+	/* 0x0E */ { LEN_BAD, 0x00 },
+	/* 0x0F */ { LEN_BAD, 0x00 },
+	/* 0x10 */ { LEN_BAD, 0x00 },
+	/* 0x11 */ { LEN_BAD, 0x00 },
+	/* 0x12 */ { LEN_BAD, 0x00 },
+	/* 0x13 */ { LEN_BAD, 0x00 },
+	/* 0x14 */ { LEN_BAD, 0x00 },
+	/* 0x15 */ { LEN_BAD, 0x00 },
+	/* 0x16 */ { LEN_BAD, 0x00 },
+	/* 0x17 */ { LEN_BAD, 0x00 },
+	/* 0x18 */ { LEN_BAD, 0x00 },
+	/* 0x19 */ { LEN_BAD, 0x00 },
+	/* 0x1A */ { LEN_BAD, 0x00 },
+	/* 0x1B */ { LEN_BAD, 0x00 },
+	/* 0x1C */ { LEN_BAD, 0x00 },
+	/* 0x1D */ { LEN_BAD, 0x00 },
+	/* 0x1E */ { LEN_BAD, 0x00 },
+	/* 0x1F */ { LEN_BAD, 0x00 },
+	/* 0x20 */ { LEN_BAD, 0x00 },
+	/* 0x21 */ { LEN_BAD, 0x00 },
+	/* 0x22 */ { LEN_BAD, 0x00 },
+	/* 0x23 */ { LEN_BAD, 0x00 },
+	/* 0x24 */ { LEN_BAD, 0x00 },
+	/* 0x25 */ { LEN_BAD, 0x00 },
+	/* 0x26 */ { LEN_BAD, 0x00 },
+	/* 0x27 */ { LEN_BAD, 0x00 },
+	/* 0x28 */ { LEN_BAD, 0x00 },
+	/* 0x29 */ { LEN_BAD, 0x00 },
+	/* 0x2A */ { LEN_BAD, 0x00 },
+	/* 0x2B */ { LEN_BAD, 0x00 },
+	/* 0x2C */ { LEN_BAD, 0x00 },
+	/* 0x2D */ { LEN_BAD, 0x00 },
+	/* 0x2E */ { LEN_BAD, 0x00 },
+	/* 0x2F */ { LEN_BAD, 0x00 },
+	/* 0x30 */ { LEN_BAD, 0x00 },
+	/* 0x31 */ { LEN_BAD, 0x00 },
+	/* 0x32 */ { LEN_BAD, 0x00 },
+	/* 0x33 */ { LEN_BAD, 0x00 },
+	/* 0x34 */ { LEN_BAD, 0x00 },
+	/* 0x35 */ { LEN_BAD, 0x00 },
+	/* 0x36 */ { LEN_BAD, 0x00 },
+	/* 0x37 */ { LEN_BAD, 0x00 },
+	/* 0x38 */ { LEN_BAD, 0x00 },
+	/* 0x39 */ { LEN_BAD, 0x00 },
+	/* 0x3A */ { LEN_BAD, 0x00 },
+	/* 0x3B */ { LEN_BAD, 0x00 },
+	/* 0x3C */ { LEN_BAD, 0x00 },
+	/* 0x3D */ { LEN_BAD, 0x00 },
+	/* 0x3E */ { LEN_BAD, 0x00 },
+	/* 0x3F */ { LEN_BAD, 0x00 },
+	/* 0x40 */ { LEN_BAD, 0x00 },
+	/* 0x41 */ { LEN_BAD, 0x00 },
+	/* 0x42 */ { LEN_BAD, 0x00 },
+	/* 0x43 */ { LEN_BAD, 0x00 },
+	/* 0x44 */ { LEN_BAD, 0x00 },
+	/* 0x45 */ { LEN_BAD, 0x00 },
+	/* 0x46 */ { LEN_BAD, 0x00 },
+	/* 0x47 */ { LEN_BAD, 0x00 },
+	/* 0x48 */ { LEN_BAD, 0x00 },
+	/* 0x49 */ { LEN_BAD, 0x00 },
+	/* 0x4A */ { LEN_BAD, 0x00 },
+	/* 0x4B */ { LEN_BAD, 0x00 },
+	/* 0x4C */ { LEN_BAD, 0x00 },
+	/* 0x4D */ { LEN_BAD, 0x00 },
+	/* 0x4E */ { LEN_BAD, 0x00 },
+	/* 0x4F */ { LEN_BAD, 0x00 },
+	/* 0x50 */ { LEN_BAD, 0x00 },
+	/* 0x51 */ { LEN_BAD, 0x00 },
+	/* 0x52 */ { LEN_BAD, 0x00 },
+	/* 0x53 */ { LEN_BAD, 0x00 },
+	/* 0x54 */ { LEN_BAD, 0x00 },
+	/* 0x55 */ { LEN_BAD, 0x00 },
+	/* 0x56 */ { LEN_BAD, 0x00 },
+	/* 0x57 */ { LEN_BAD, 0x00 },
+	/* 0x58 */ { LEN_BAD, 0x00 },
+	/* 0x59 */ { LEN_BAD, 0x00 },
+	/* 0x5A */ { LEN_BAD, 0x00 },
+	/* 0x5B */ { LEN_BAD, 0x00 },
+	/* 0x5C */ { LEN_BAD, 0x00 },
+	/* 0x5D */ { LEN_BAD, 0x00 },
+	/* 0x5E */ { LEN_BAD, 0x00 },
+	/* 0x5F */ { LEN_BAD, 0x00 },
+	/* 0x60 */ { LEN_BAD, 0x00 },
+	/* 0x61 */ { LEN_BAD, 0x00 },
+	/* 0x62 */ { LEN_BAD, 0x00 },
+	/* 0x63 */ { LEN_BAD, 0x00 },
+	/* 0x64 */ { LEN_BAD, 0x00 },
+	/* 0x65 */ { LEN_BAD, 0x00 },
+	/* 0x66 */ { LEN_BAD, 0x00 },
+	/* 0x67 */ { LEN_BAD, 0x00 },
+	/* 0x68 */ { LEN_BAD, 0x00 },
+	/* 0x69 */ { LEN_BAD, 0x00 },
+	/* 0x6A */ { LEN_BAD, 0x00 },
+	/* 0x6B */ { LEN_BAD, 0x00 },
+	/* 0x6C */ { LEN_BAD, 0x00 },
+	/* 0x6D */ { LEN_BAD, 0x00 },
+	/* 0x6E */ { LEN_BAD, 0x00 },
+	/* 0x6F */ { LEN_BAD, 0x00 },
+	/* 0x70 */ { LEN_BAD, 0x00 },
+	/* 0x71 */ { LEN_BAD, 0x00 },
+	/* 0x72 */ { LEN_BAD, 0x00 },
+	/* 0x73 */ { LEN_BAD, 0x00 },
+	/* 0x74 */ { LEN_BAD, 0x00 },
+	/* 0x75 */ { LEN_BAD, 0x00 },
+	/* 0x76 */ { LEN_BAD, 0x00 },
+	/* 0x77 */ { LEN_BAD, 0x00 },
+	/* 0x78 */ { LEN_BAD, 0x00 },
+	/* 0x79 */ { LEN_BAD, 0x00 },
+	/* 0x7A */ { LEN_BAD, 0x00 },
+	/* 0x7B */ { LEN_BAD, 0x00 },
+	/* 0x7C */ { LEN_BAD, 0x00 },
+	/* 0x7D */ { LEN_BAD, 0x00 },
+	/* 0x7E */ { LEN_BAD, 0x00 },
+	/* 0x7F */ { LEN_BAD, 0x00 },
+	/* 0x80 */ { LEN_IMM(2), 0x00 },
+	/* 0x81 */ { LEN_IMM(2), 0x00 },
+	/* 0x82 */ { LEN_IMM(2), 0x00 },
+	/* 0x83 */ { LEN_IMM(2), 0x00 },
+	/* 0x84 */ { LEN_IMM(2), 0x00 },
+	/* 0x85 */ { LEN_IMM(2), 0x00 },
+	/* 0x86 */ { LEN_IMM(2), 0x00 },
+	/* 0x87 */ { LEN_IMM(2), 0x00 },
+	/* 0x88 */ { LEN_IMM(2), 0x00 },
+	/* 0x89 */ { LEN_IMM(2), 0x00 },
+	/* 0x8A */ { LEN_IMM(2), 0x00 },
+	/* 0x8B */ { LEN_IMM(2), 0x00 },
+	/* 0x8C */ { LEN_IMM(2), 0x00 },
+	/* 0x8D */ { LEN_IMM(2), 0x00 },
+	/* 0x8E */ { LEN_IMM(2), 0x00 },
+	/* 0x8F */ { LEN_IMM(2), 0x00 },
+	/* 0x90 */ { LEN_BAD, 0x00 },
+	/* 0x91 */ { LEN_BAD, 0x00 },
+	/* 0x92 */ { LEN_BAD, 0x00 },
+	/* 0x93 */ { LEN_BAD, 0x00 },
+	/* 0x94 */ { LEN_BAD, 0x00 },
+	/* 0x95 */ { LEN_BAD, 0x00 },
+	/* 0x96 */ { LEN_BAD, 0x00 },
+	/* 0x97 */ { LEN_BAD, 0x00 },
+	/* 0x98 */ { LEN_BAD, 0x00 },
+	/* 0x99 */ { LEN_BAD, 0x00 },
+	/* 0x9A */ { LEN_BAD, 0x00 },
+	/* 0x9B */ { LEN_BAD, 0x00 },
+	/* 0x9C */ { LEN_BAD, 0x00 },
+	/* 0x9D */ { LEN_BAD, 0x00 },
+	/* 0x9E */ { LEN_BAD, 0x00 },
+	/* 0x9F */ { LEN_BAD, 0x00 },
+	/* 0xA0 */ { LEN_BAD, 0x00 },
+	/* 0xA1 */ { LEN_BAD, 0x00 },
+	/* 0xA2 */ { LEN_BAD, 0x00 },
+	/* 0xA3 */ { LEN_BAD, 0x00 },
+	/* 0xA4 */ { LEN_BAD, 0x00 },
+	/* 0xA5 */ { LEN_BAD, 0x00 },
+	/* 0xA6 */ { LEN_BAD, 0x00 },
+	/* 0xA7 */ { LEN_BAD, 0x00 },
+	/* 0xA8 */ { LEN_BAD, 0x00 },
+	/* 0xA9 */ { LEN_BAD, 0x00 },
+	/* 0xAA */ { LEN_BAD, 0x00 },
+	/* 0xAB */ { LEN_BAD, 0x00 },
+	/* 0xAC */ { LEN_BAD, 0x00 },
+	/* 0xAD */ { LEN_BAD, 0x00 },
+	/* 0xAE */ { LEN_BAD, 0x00 },
+	/* 0xAF */ { LEN_MODRM, 0x00 },
+	/* 0xB0 */ { LEN_BAD, 0x00 },
+	/* 0xB1 */ { LEN_BAD, 0x00 },
+	/* 0xB2 */ { LEN_BAD, 0x00 },
+	/* 0xB3 */ { LEN_BAD, 0x00 },
+	/* 0xB4 */ { LEN_BAD, 0x00 },
+	/* 0xB5 */ { LEN_BAD, 0x00 },
+	/* 0xB6 */ { LEN_BAD, 0x00 },
+	/* 0xB7 */ { LEN_BAD, 0x00 },
+	/* 0xB8 */ { LEN_BAD, 0x00 },
+	/* 0xB9 */ { LEN_BAD, 0x00 },
+	/* 0xBA */ { LEN_BAD, 0x00 },
+	/* 0xBB */ { LEN_BAD, 0x00 },
+	/* 0xBC */ { LEN_BAD, 0x00 },
+	/* 0xBD */ { LEN_BAD, 0x00 },
+	/* 0xBE */ { LEN_BAD, 0x00 },
+	/* 0xBF */ { LEN_BAD, 0x00 },
+	/* 0xC0 */ { LEN_BAD, 0x00 },
+	/* 0xC1 */ { LEN_BAD, 0x00 },
+	/* 0xC2 */ { LEN_BAD, 0x00 },
+	/* 0xC3 */ { LEN_BAD, 0x00 },
+	/* 0xC4 */ { LEN_BAD, 0x00 },
+	/* 0xC5 */ { LEN_BAD, 0x00 },
+	/* 0xC6 */ { LEN_BAD, 0x00 },
+	/* 0xC7 */ { LEN_BAD, 0x00 },
+	/* 0xC8 */ { LEN_BAD, 0x00 },
+	/* 0xC9 */ { LEN_BAD, 0x00 },
+	/* 0xCA */ { LEN_BAD, 0x00 },
+	/* 0xCB */ { LEN_BAD, 0x00 },
+	/* 0xCC */ { LEN_BAD, 0x00 },
+	/* 0xCD */ { LEN_BAD, 0x00 },
+	/* 0xCE */ { LEN_BAD, 0x00 },
+	/* 0xCF */ { LEN_BAD, 0x00 },
+	/* 0xD0 */ { LEN_BAD, 0x00 },
+	/* 0xD1 */ { LEN_BAD, 0x00 },
+	/* 0xD2 */ { LEN_BAD, 0x00 },
+	/* 0xD3 */ { LEN_BAD, 0x00 },
+	/* 0xD4 */ { LEN_BAD, 0x00 },
+	/* 0xD5 */ { LEN_BAD, 0x00 },
+	/* 0xD6 */ { LEN_BAD, 0x00 },
+	/* 0xD7 */ { LEN_BAD, 0x00 },
+	/* 0xD8 */ { LEN_BAD, 0x00 },
+	/* 0xD9 */ { LEN_BAD, 0x00 },
+	/* 0xDA */ { LEN_BAD, 0x00 },
+	/* 0xDB */ { LEN_BAD, 0x00 },
+	/* 0xDC */ { LEN_BAD, 0x00 },
+	/* 0xDD */ { LEN_BAD, 0x00 },
+	/* 0xDE */ { LEN_BAD, 0x00 },
+	/* 0xDF */ { LEN_BAD, 0x00 },
+	/* 0xE0 */ { LEN_BAD, 0x00 },
+	/* 0xE1 */ { LEN_BAD, 0x00 },
+	/* 0xE2 */ { LEN_BAD, 0x00 },
+	/* 0xE3 */ { LEN_BAD, 0x00 },
+	/* 0xE4 */ { LEN_BAD, 0x00 },
+	/* 0xE5 */ { LEN_BAD, 0x00 },
+	/* 0xE6 */ { LEN_BAD, 0x00 },
+	/* 0xE7 */ { LEN_BAD, 0x00 },
+	/* 0xE8 */ { LEN_BAD, 0x00 },
+	/* 0xE9 */ { LEN_BAD, 0x00 },
+	/* 0xEA */ { LEN_BAD, 0x00 },
+	/* 0xEB */ { LEN_BAD, 0x00 },
+	/* 0xEC */ { LEN_BAD, 0x00 },
+	/* 0xED */ { LEN_BAD, 0x00 },
+	/* 0xEE */ { LEN_BAD, 0x00 },
+	/* 0xEF */ { LEN_BAD, 0x00 },
+	/* 0xF0 */ { LEN_BAD, 0x00 },
+	/* 0xF1 */ { LEN_BAD, 0x00 },
+	/* 0xF2 */ { LEN_BAD, 0x00 },
+	/* 0xF3 */ { LEN_BAD, 0x00 },
+	/* 0xF4 */ { LEN_BAD, 0x00 },
+	/* 0xF5 */ { LEN_BAD, 0x00 },
+	/* 0xF6 */ { LEN_BAD, 0x00 },
+	/* 0xF7 */ { LEN_BAD, 0x00 },
+	/* 0xF8 */ { LEN_BAD, 0x00 },
+	/* 0xF9 */ { LEN_BAD, 0x00 },
+	/* 0xFA */ { LEN_BAD, 0x00 },
+	/* 0xFB */ { LEN_BAD, 0x00 },
+	/* 0xFC */ { LEN_BAD, 0x00 },
+	/* 0xFD */ { LEN_BAD, 0x00 },
+	/* 0xFE */ { LEN_BAD, 0x00 },
+	/* 0xFF */ { LEN_BAD, 0x00 },
+};
+
+int dis_insn_length(const struct dis *dis, uint32_t addr)
+{
+    if (addr < dis->base || addr >= dis->limit)
+        return 0;
+
+    const uint8_t *p = dis->bytes + (addr - dis->base);
+    uint32_t avail = dis->limit - addr;
+    uint32_t n = 0;
+
+    const struct lentab *len;
+    do {
+        if (n >= avail || n > DIS_PREFIX_MAX)
+            return 0;
+
+        len = &lengths[p[n++]];
+    } while (len->flags & LEN_PREFIX);
+
+    if (len->flags & LEN_ESCAPE) {
+        if (n >= avail)
+            return 0;
+
+        len = &lengths_0f[p[n++]];
+    }
+
+    if (len->flags & LEN_BAD)
+        return 0;
+
+    uint32_t imm = len->flags & LEN_IMM_MASK;
+    if (len->flags & LEN_MODRM) {
+        if (n >= avail)
+            return 0;
+
+        const struct modrm *modrm = &modrm_table[p[n++]];
+        if (len->bad >> modrm->reg & 1)
+            return 0;
+
+        n += modrm->disp;
+
+        // Only test carries an immediate in group 3
+        if ((len->flags & LEN_TEST) && modrm->reg != 0)
+            imm = 0;
+    }
+
+    n += imm;
+    return n <= avail ? (int)n : 0;
+}
+
+bool dis_is_prefix(uint8_t byte)
+{
+    return lengths[byte].flags & LEN_PREFIX;
 }
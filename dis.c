@@ -98,6 +98,21 @@ bool insn_is_branch(struct insn *ins)
     return insn_is_terminator(ins);
 }
 
+enum cfg_edge insn_branch_kind(struct insn *ins)
+{
+    switch (ins->op) {
+        case I286_CALL:
+            return CFG_EDGE_CALL;
+        case I286_CALLF:
+        case I286_JMPF:
+            return CFG_EDGE_FAR;
+        case I286_JMP:
+            return CFG_EDGE_JUMP;
+        default:
+            return CFG_EDGE_COND;
+    }
+}
+
 bool insn_get_branch(struct insn *ins, uint32_t *target)
 {
     switch (ins->op) {
@@ -185,59 +200,295 @@ struct insn *insn_alloc(uint32_t addr)
 void insn_free(struct insn *ins)
 {
     struct oper *tmp, *oper = ins->opers;
-    free(ins);
 
+    // Operands stored inline are released together with the insn
     while (oper) {
         tmp = oper->next;
-        free(oper);
+        if (oper < ins->oper_buf || oper >= ins->oper_buf + I286_OPER_N)
+            free(oper);
         oper = tmp;
     }
+
+    free(ins);
 }
 
-void dis_init(struct dis *dis, const uint8_t *bytes, uint32_t len, uint32_t base)
+void insn_pack(struct insn_rec *rec, const struct insn *ins)
+{
+    memset(rec, 0, sizeof(struct insn_rec));
+    rec->addr = ins->addr;
+    rec->len = ins->len;
+    rec->op = ins->op;
+    rec->pref = ins->pref;
+
+    for (struct oper *oper = ins->opers; oper; oper = oper->next) {
+        assert(rec->nopers < I286_OPER_N);
+        struct oper_rec *o = &rec->opers[rec->nopers++];
+        o->flags = oper->flags;
+
+        switch (oper->flags) {
+            case I286_OPER_IMM8:
+                o->val = oper->imm8;
+                break;
+
+            case I286_OPER_IMM16:
+                o->val = oper->imm16;
+                break;
+
+            case I286_OPER_IMM32:
+                assert(rec->nopers < I286_OPER_N);
+                o[0].val = oper->imm32 & 0xFFFF;
+                o[1].val = oper->imm32 >> 16;
+                break;
+
+            case I286_OPER_REG:
+                o->sel = oper->reg;
+                break;
+
+            case I286_OPER_SEG:
+                o->sel = oper->seg;
+                break;
+
+            case I286_OPER_MEM:
+                o->sel = oper->mem.mode;
+                o->val = oper->mem.disp;
+                break;
+        }
+    }
+}
+
+void insn_unpack(struct insn *ins, const struct insn_rec *rec)
+{
+    ins->addr = rec->addr;
+    ins->len = rec->len;
+    ins->op = rec->op;
+    ins->pref = rec->pref;
+    ins->opers = NULL;
+
+    struct oper **link = &ins->opers;
+    for (int i = 0; i < rec->nopers; i++) {
+        const struct oper_rec *o = &rec->opers[i];
+        struct oper *oper = &ins->oper_buf[i];
+        oper->flags = o->flags;
+
+        switch (o->flags) {
+            case I286_OPER_IMM8:
+                oper->imm8 = o->val;
+                break;
+
+            case I286_OPER_IMM16:
+                oper->imm16 = o->val;
+                break;
+
+            case I286_OPER_IMM32:
+                oper->imm32 = (uint32_t)o[1].val << 16 | o[0].val;
+                break;
+
+            case I286_OPER_REG:
+                oper->reg = o->sel;
+                break;
+
+            case I286_OPER_SEG:
+                oper->seg = o->sel;
+                break;
+
+            case I286_OPER_MEM:
+                oper->mem.mode = o->sel;
+                oper->mem.disp = o->val;
+                break;
+        }
+
+        *link = oper;
+        link = &oper->next;
+    }
+
+    *link = NULL;
+}
+
+uint8_t *dis_alloc_padded(uint32_t len)
+{
+    uint8_t *bytes = malloc(len + DIS_PAD);
+    if (bytes)
+        memset(bytes + len, 0, DIS_PAD);
+
+    return bytes;
+}
+
+void dis_init(struct dis *dis, const uint8_t *bytes, uint32_t len, uint32_t base, enum dis_flag flags)
 {
     memset(dis, 0, sizeof(struct dis));
     dis->base = base;
     dis->limit = len + base;
     dis->bytes = bytes;
-    dis->decoded = calloc(len, sizeof(struct insn *));
+    dis->flags = flags;
+    dis->entries.queued = calloc((len + 63) / 64, sizeof(uint64_t));
+    arena_init(&dis->arena);
+
+    if (flags & DIS_COMPACT)
+        store_init(&dis->store, base, len);
+    else
+        dis->decoded = calloc(len, sizeof(struct insn *));
 }
 
 void dis_deinit(struct dis *dis)
 {
-    for (size_t i = 0; i < dis->limit - dis->base; i++) {
-        if (dis->decoded[i])
-            insn_free(dis->decoded[i]);
+    free(dis->entries.items);
+    free(dis->entries.queued);
+    free(dis->entries.roots);
+    free(dis->dropped);
+    free(dis->xrefs.items);
+    free(dis->xrefs.by_target);
+    free(dis->data_xrefs.items);
+    free(dis->data_xrefs.by_target);
+
+    if (dis->flags & DIS_COMPACT) {
+        store_deinit(&dis->store);
+        return;
+    }
+
+    // Arena instructions are released all at once
+    if (dis->flags & DIS_ARENA) {
+        arena_release(&dis->arena);
+    } else {
+        for (size_t i = 0; i < dis->limit - dis->base; i++) {
+            if (dis->decoded[i])
+                insn_free(dis->decoded[i]);
+        }
     }
     free(dis->decoded);
 }
 
-void dis_push_entry(struct dis *dis, uint32_t entry)
+struct insn *dis_insn_alloc(struct dis *dis, uint32_t addr)
+{
+    if (!(dis->flags & DIS_ARENA))
+        return insn_alloc(addr);
+
+    struct insn *ins = arena_alloc(&dis->arena, sizeof(struct insn));
+    memset(ins, 0, sizeof(struct insn));
+    ins->addr = addr;
+    return ins;
+}
+
+struct insn *dis_insert(struct dis *dis, const struct insn_rec *rec)
+{
+    uint32_t off = rec->addr - dis->base;
+
+    struct insn *ins;
+    if (dis->flags & DIS_COMPACT) {
+        store_insert(&dis->store, off, rec);
+        ins = &dis->view;
+    } else {
+        ins = dis_insn_alloc(dis, rec->addr);
+        dis->decoded[off] = ins;
+    }
+
+    insn_unpack(ins, rec);
+
+    if (dis->flags & DIS_XREFS)
+        dis_xref_add(dis, ins);
+
+    return ins;
+}
+
+bool dis_is_decoded(struct dis *dis, uint32_t addr)
+{
+    uint32_t off = addr - dis->base;
+
+    if (dis->flags & DIS_COMPACT)
+        return store_has(&dis->store, off);
+
+    return dis->decoded[off] != NULL;
+}
+
+struct insn *dis_lookup(struct dis *dis, uint32_t addr)
+{
+    if (addr < dis->base || addr >= dis->limit)
+        return NULL;
+
+    uint32_t off = addr - dis->base;
+    if (!(dis->flags & DIS_COMPACT))
+        return dis->decoded[off];
+
+    struct insn_rec rec;
+    if (!store_lookup(&dis->store, off, &rec))
+        return NULL;
+
+    insn_unpack(&dis->view, &rec);
+    return &dis->view;
+}
+
+struct insn *dis_lookup_r(struct dis *dis, uint32_t addr, struct insn *buf)
 {
-    if (dis->entry_n >= DIS_ENTRY_N)
+    if (!(dis->flags & DIS_COMPACT))
+        return dis_lookup(dis, addr);
+
+    struct insn_rec rec;
+    if (addr < dis->base || addr >= dis->limit || !store_lookup(&dis->store, addr - dis->base, &rec))
+        return NULL;
+
+    insn_unpack(buf, &rec);
+    return buf;
+}
+
+static void dis_queue(struct dis *dis, uint32_t entry)
+{
+    struct worklist *work = &dis->entries;
+
+    if (entry < dis->base || entry >= dis->limit) {
+        work->out_of_range++;
         return;
+    }
+
+    uint32_t off = entry - dis->base;
+    uint64_t bit = 1ULL << (off % 64);
+
+    if ((work->queued[off / 64] & bit) || dis_is_decoded(dis, entry)) {
+        work->dups++;
+        return;
+    }
+
+    if (work->n == work->cap) {
+        work->cap = work->cap ? work->cap * 2 : 64;
+        work->items = realloc(work->items, work->cap * sizeof(uint32_t));
+    }
 
-    dis->entry_list[dis->entry_n++] = entry;
+    work->queued[off / 64] |= bit;
+    work->items[work->n++] = entry;
+    work->pushes++;
+}
+
+void dis_push_entry(struct dis *dis, uint32_t entry)
+{
+    struct worklist *work = &dis->entries;
+
+    if (entry >= dis->base && entry < dis->limit) {
+        if (work->nroots == work->roots_cap) {
+            work->roots_cap = work->roots_cap ? work->roots_cap * 2 : 16;
+            work->roots = realloc(work->roots, work->roots_cap * sizeof(uint32_t));
+        }
+
+        work->roots[work->nroots++] = entry;
+    }
+
+    dis_queue(dis, entry);
 }
 
 bool dis_pop_entry(struct dis *dis, uint32_t *entry)
 {
-    if (dis->entry_n == 0)
+    if (dis->entries.n == 0)
         return false;
 
-    *entry = dis->entry_list[--dis->entry_n];
+    *entry = dis->entries.items[--dis->entries.n];
     return true;
 }
 
 void dis_disasm(struct dis *dis)
 {
-    while (dis_pop_entry(dis, &dis->ip)) {
-        if (dis->ip < dis->base)
-            continue;
+    DIS_PHASE_BEGIN();
 
+    while (dis_pop_entry(dis, &dis->ip)) {
         while (dis->ip < dis->limit) {
 
-            if (dis->decoded[dis->ip - dis->base])
+            if (dis_is_decoded(dis, dis->ip))
                 break;
 
             // Linear Sweep
@@ -247,12 +498,201 @@ void dis_disasm(struct dis *dis)
 
             uint32_t branch;
             if (insn_get_branch(ins, &branch))
-                dis_push_entry(dis, branch);
+                dis_queue(dis, branch);
 
             if (insn_is_terminator(ins))
                 break;
         }
     }
+
+    if (dis->flags & DIS_COMPACT)
+        store_finalize(&dis->store);
+
+    DIS_PHASE_END(dis, DIS_PHASE_DISASM);
+}
+
+static void dis_remove(struct dis *dis, uint32_t addr)
+{
+    uint32_t off = addr - dis->base;
+
+    // Its xrefs are dropped on the next query
+    dis->xrefs.sorted = false;
+    dis->data_xrefs.sorted = false;
+
+    if (dis->flags & DIS_COMPACT) {
+        store_remove(&dis->store, off);
+        return;
+    }
+
+    // Arena instructions are only released with the arena
+    if (!(dis->flags & DIS_ARENA))
+        insn_free(dis->decoded[off]);
+
+    dis->decoded[off] = NULL;
+}
+
+// Where control can go after ins, returns how many addresses it wrote
+static int dis_successors(struct dis *dis, struct insn *ins, uint32_t succ[2])
+{
+    int n = 0;
+    if (insn_is_bad(ins))
+        return 0;
+
+    uint32_t branch;
+    if (insn_get_branch(ins, &branch) && branch >= dis->base && branch < dis->limit)
+        succ[n++] = branch;
+
+    if (!insn_is_terminator(ins) && ins->addr + ins->len < dis->limit)
+        succ[n++] = ins->addr + ins->len;
+
+    return n;
+}
+
+void dis_invalidate_range(struct dis *dis, uint32_t addr, uint32_t len)
+{
+    if (addr >= dis->limit || addr + len <= dis->base)
+        return;
+
+    uint32_t end = addr + len;
+    if (addr < dis->base)
+        addr = dis->base;
+
+    // Nothing starting DIS_INSN_MAX bytes or more before the range can
+    // reach it
+    uint32_t from = addr - dis->base > DIS_INSN_MAX ? addr - dis->base - DIS_INSN_MAX : 0;
+    uint32_t first = dis->ndropped;
+
+    // Step one byte at a time, instructions can start inside others
+    struct insn *ins;
+    for (uint32_t idx = from; dis_iterate_code(dis, &idx, &ins) && ins->addr < end; ) {
+        idx = ins->addr - dis->base + 1;
+        if (ins->addr + ins->len <= addr)
+            continue;
+
+        if (dis->ndropped == dis->dropped_cap) {
+            dis->dropped_cap = dis->dropped_cap ? dis->dropped_cap * 2 : 16;
+            dis->dropped = realloc(dis->dropped, dis->dropped_cap * sizeof(struct dropped));
+        }
+
+        struct dropped *drop = &dis->dropped[dis->ndropped++];
+        drop->addr = ins->addr;
+        drop->nsucc = dis_successors(dis, ins, drop->succ);
+    }
+
+    // The dropped addresses have to go through again, entries still
+    // pending keep their bits
+    for (uint32_t i = first; i < dis->ndropped; i++) {
+        uint32_t off = dis->dropped[i].addr - dis->base;
+        dis->entries.queued[off / 64] &= ~(1ULL << (off % 64));
+        dis_remove(dis, dis->dropped[i].addr);
+    }
+
+    for (uint32_t i = first; i < dis->ndropped; i++)
+        dis_queue(dis, dis->dropped[i].addr);
+}
+
+// Whether every dropped instruction came back at its address with at
+// least the successors it had. Then every path from the entries still
+// exists and nothing can have become unreachable.
+static bool dis_kept_paths(struct dis *dis)
+{
+    for (uint32_t i = 0; i < dis->ndropped; i++) {
+        const struct dropped *drop = &dis->dropped[i];
+
+        struct insn *ins = dis_lookup(dis, drop->addr);
+        if (!ins)
+            return false;
+
+        uint32_t succ[2];
+        int n = dis_successors(dis, ins, succ);
+
+        for (int j = 0; j < drop->nsucc; j++) {
+            bool found = false;
+            for (int k = 0; k < n; k++)
+                found |= succ[k] == drop->succ[j];
+
+            if (!found)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+// Forgets every instruction that isn't reachable from the roots
+static void dis_sweep_unreachable(struct dis *dis)
+{
+    uint32_t len = dis->limit - dis->base;
+    uint64_t *reached = calloc((len + 63) / 64, sizeof(uint64_t));
+
+    struct worklist *work = &dis->entries;
+    uint32_t n = work->nroots, cap = n ? n : 1;
+    uint32_t *stack = malloc(cap * sizeof(uint32_t));
+    memcpy(stack, work->roots, n * sizeof(uint32_t));
+
+    while (n) {
+        uint32_t addr = stack[--n];
+
+        while (true) {
+            uint32_t off = addr - dis->base;
+            if (reached[off / 64] >> (off % 64) & 1)
+                break;
+
+            struct insn *ins = dis_lookup(dis, addr);
+            if (!ins)
+                break;
+
+            reached[off / 64] |= 1ULL << (off % 64);
+
+            uint32_t succ[2];
+            int nsucc = dis_successors(dis, ins, succ);
+            if (nsucc == 0)
+                break;
+
+            // Keep following the fall through, queue the branch
+            if (nsucc == 2) {
+                if (n == cap) {
+                    cap *= 2;
+                    stack = realloc(stack, cap * sizeof(uint32_t));
+                }
+
+                stack[n++] = succ[0];
+            }
+
+            addr = succ[nsucc - 1];
+        }
+    }
+
+    uint32_t off = 0;
+    if (dis->flags & DIS_COMPACT) {
+        while (store_next(&dis->store, off, &off)) {
+            if (!(reached[off / 64] >> (off % 64) & 1))
+                dis_remove(dis, off + dis->base);
+            off++;
+        }
+    } else {
+        for (; off < len; off++) {
+            if (dis->decoded[off] && !(reached[off / 64] >> (off % 64) & 1))
+                dis_remove(dis, off + dis->base);
+        }
+    }
+
+    free(stack);
+    free(reached);
+}
+
+void dis_redisasm(struct dis *dis)
+{
+    dis_disasm(dis);
+
+    if (!dis_kept_paths(dis))
+        dis_sweep_unreachable(dis);
+
+    if (dis->flags & DIS_COMPACT)
+        store_finalize(&dis->store);
+
+    memset(dis->entries.queued, 0, (dis->limit - dis->base + 63) / 64 * sizeof(uint64_t));
+    dis->ndropped = 0;
 }
 
 bool dis_iterate(struct dis *dis, uint32_t *index, struct insn **ins)
@@ -260,7 +700,27 @@ bool dis_iterate(struct dis *dis, uint32_t *index, struct insn **ins)
     if (*index >= dis->limit - dis->base)
         return false;
 
-    *ins = dis->decoded[*index];
+    *ins = dis_lookup(dis, *index + dis->base);
     *index += *ins ? (*ins)->len : 1;
     return true;
 }
+
+bool dis_iterate_code(struct dis *dis, uint32_t *index, struct insn **ins)
+{
+    uint32_t len = dis->limit - dis->base;
+
+    if (dis->flags & DIS_COMPACT) {
+        if (!store_next(&dis->store, *index, index))
+            return false;
+    } else {
+        while (*index < len && !dis->decoded[*index])
+            (*index)++;
+    }
+
+    if (*index >= len)
+        return false;
+
+    *ins = dis_lookup(dis, *index + dis->base);
+    *index += (*ins)->len;
+    return true;
+}
@@ -156,10 +156,141 @@ const char *opcode_mnemonics[] = {
     "xor",
 };
 
+// strlen of every opcode_mnemonics entry
+static const uint8_t opcode_lengths[] = {
+    /* (bad) */ 5,
+    /* aaa */ 3,
+    /* aad */ 3,
+    /* aam */ 3,
+    /* aas */ 3,
+    /* adc */ 3,
+    /* add */ 3,
+    /* and */ 3,
+    /* arpl */ 4,
+    /* bound */ 5,
+    /* call */ 4,
+    /* call */ 4,
+    /* cbw */ 3,
+    /* clc */ 3,
+    /* cld */ 3,
+    /* cli */ 3,
+    /* clts */ 4,
+    /* cmc */ 3,
+    /* cmp */ 3,
+    /* cmpsb */ 5,
+    /* cmpsw */ 5,
+    /* cwd */ 3,
+    /* daa */ 3,
+    /* das */ 3,
+    /* dec */ 3,
+    /* div */ 3,
+    /* enter */ 5,
+    /* hlt */ 3,
+    /* idiv */ 4,
+    /* imul */ 4,
+    /* in */ 2,
+    /* inc */ 3,
+    /* insb */ 4,
+    /* insw */ 4,
+    /* int */ 3,
+    /* into */ 4,
+    /* iret */ 4,
+    /* jo */ 2,
+    /* jno */ 3,
+    /* jb */ 2,
+    /* jnb */ 3,
+    /* je */ 2,
+    /* jne */ 3,
+    /* jna */ 3,
+    /* ja */ 2,
+    /* js */ 2,
+    /* jns */ 3,
+    /* jp */ 2,
+    /* jnp */ 3,
+    /* jl */ 2,
+    /* jle */ 3,
+    /* jge */ 3,
+    /* jg */ 2,
+    /* jcxz */ 4,
+    /* jmp */ 3,
+    /* jmp */ 3,
+    /* lahf */ 4,
+    /* lar */ 3,
+    /* lds */ 3,
+    /* les */ 3,
+    /* lea */ 3,
+    /* leave */ 5,
+    /* lgdt */ 4,
+    /* lidt */ 4,
+    /* lldt */ 4,
+    /* lmsw */ 4,
+    /* lodsb */ 5,
+    /* lodsw */ 5,
+    /* loop */ 4,
+    /* loopz */ 5,
+    /* loopnz */ 6,
+    /* lsl */ 3,
+    /* ltr */ 3,
+    /* mov */ 3,
+    /* movsb */ 5,
+    /* movsw */ 5,
+    /* mul */ 3,
+    /* neg */ 3,
+    /* nop */ 3,
+    /* not */ 3,
+    /* or */ 2,
+    /* out */ 3,
+    /* outsb */ 5,
+    /* outsw */ 5,
+    /* pop */ 3,
+    /* popa */ 4,
+    /* popf */ 4,
+    /* push */ 4,
+    /* pusha */ 5,
+    /* pushf */ 5,
+    /* rcl */ 3,
+    /* rcr */ 3,
+    /* ret */ 3,
+    /* retf */ 4,
+    /* rol */ 3,
+    /* ror */ 3,
+    /* sahf */ 4,
+    /* salc */ 4,
+    /* sal */ 3,
+    /* sar */ 3,
+    /* sbb */ 3,
+    /* scasb */ 5,
+    /* scasw */ 5,
+    /* shl */ 3,
+    /* shr */ 3,
+    /* sgdt */ 4,
+    /* sidt */ 4,
+    /* sldt */ 4,
+    /* smsw */ 4,
+    /* stc */ 3,
+    /* std */ 3,
+    /* sti */ 3,
+    /* stosb */ 5,
+    /* stosw */ 5,
+    /* str */ 3,
+    /* sub */ 3,
+    /* test */ 4,
+    /* verr */ 4,
+    /* verw */ 4,
+    /* wait */ 4,
+    /* xchg */ 4,
+    /* xlat */ 4,
+    /* xor */ 3,
+};
+
+_Static_assert(sizeof(opcode_lengths) == sizeof(opcode_mnemonics) / sizeof(opcode_mnemonics[0]),
+               "opcode_lengths is out of sync with opcode_mnemonics");
+
 void fmt_init(struct fmt *fmt, enum fmt_flag flags)
 {
     memset(fmt, 0, sizeof(struct fmt));
     fmt->flags = flags;
+    fmt_select(fmt);
 }
 
 bool fmt_is_done(struct fmt *fmt)
@@ -411,11 +542,24 @@ int fmt_iterate(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
             sum += n;
         }
 
+        if (fmt->flags & FMT_COLOR) {
+            n = snprintf(buf, size, FMT_COLOR_ON);
+            if (n < 0 || (unsigned)n > size)
+                return -1;
+
+            buf += n;
+            size -= n;
+            sum += n;
+        }
+
         if (ins->pref & PRE_MASK1) {
             char *pre = (ins->pref & PRE_MASK1) == PRE_LOCK ? "lock "
                       : (ins->pref & PRE_MASK1) == PRE_REP ? "rep "
                       : "repne ";
             n = snprintf(buf, size, "%s", pre);
+            if (n < 0 || (unsigned)n > size)
+                return -1;
+
             buf += n;
             size -= n;
             sum += n;
@@ -426,6 +570,15 @@ int fmt_iterate(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
             return -1;
 
         sum += n;
+        if (fmt->flags & FMT_COLOR) {
+            buf += n;
+            size -= n;
+            n = snprintf(buf, size, FMT_COLOR_OFF);
+            if (n < 0 || (unsigned)n > size)
+                return -1;
+            sum += n;
+        }
+
         if (fmt->opcode_post) {
             buf += n;
             size -= n;
@@ -456,6 +609,9 @@ int fmt_iterate(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
 int fmt_insn(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
 {
     char *start = buf;
+
+    // Views reuse the same insn, always start from the mnemonic
+    fmt->last = NULL;
     for (int i = 0; ; i++) {
         int n = fmt_iterate(fmt, ins, buf, size);
         if (n <= 0 || (unsigned)n > size)
@@ -479,3 +635,392 @@ int fmt_insn(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
 
     return -1;
 }
+
+// Everything below produces the same bytes as fmt_insn, including where
+// output gets cut when buf is too small, without going through snprintf
+
+// Lets every specialisation see its flags as constants
+#define FMT_INLINE static inline __attribute__((always_inline))
+
+struct fmt_out {
+    char *buf;
+    size_t size;
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static const char dec_pairs[] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+// Same as snprintf(buf, size, "%s", str), false when it didn't fit
+static bool out_put(struct fmt_out *out, const char *str, size_t len)
+{
+    if (out->size) {
+        size_t n = len < out->size ? len : out->size - 1;
+        memcpy(out->buf, str, n);
+        out->buf[n] = 0;
+    }
+
+    if (len > out->size)
+        return false;
+
+    out->buf += len;
+    out->size -= len;
+    return true;
+}
+
+static bool out_hex(struct fmt_out *out, uint32_t val)
+{
+    char tmp[10], *p = tmp + sizeof(tmp);
+
+    do {
+        *--p = hex_digits[val & 0xF];
+        val >>= 4;
+    } while (val);
+
+    *--p = 'x';
+    *--p = '0';
+    return out_put(out, p, tmp + sizeof(tmp) - p);
+}
+
+static bool out_dec(struct fmt_out *out, uint32_t val, bool neg)
+{
+    char tmp[11], *p = tmp + sizeof(tmp);
+
+    while (val >= 100) {
+        p -= 2;
+        memcpy(p, dec_pairs + val % 100 * 2, 2);
+        val /= 100;
+    }
+
+    if (val >= 10) {
+        p -= 2;
+        memcpy(p, dec_pairs + val * 2, 2);
+    } else {
+        *--p = '0' + val;
+    }
+
+    if (neg)
+        *--p = '-';
+
+    return out_put(out, p, tmp + sizeof(tmp) - p);
+}
+
+static bool out_signed(struct fmt_out *out, int32_t val)
+{
+    return out_dec(out, val < 0 ? -(uint32_t)val : (uint32_t)val, val < 0);
+}
+
+static bool out_hook(struct fmt_out *out, int n)
+{
+    if (n < 0 || (unsigned)n > out->size)
+        return false;
+
+    out->buf += n;
+    out->size -= n;
+    return true;
+}
+
+// Mirrors fmt_memory
+static const struct {
+    const char *seg;
+    const char *base;
+    uint8_t len;
+} mem_bases[] = {
+    [I286_MEM_ABS]      = { "",    "",        0 },
+    [I286_MEM_MOFF]     = { "",    "",        0 },
+    [I286_MEM_DS_BX_SI] = { "",    "bx + si", 7 },
+    [I286_MEM_DS_BX_DI] = { "",    "bx + di", 7 },
+    [I286_MEM_SS_BP_SI] = { "ss:", "bp + si", 7 },
+    [I286_MEM_SS_BP_DI] = { "ss:", "bp + di", 7 },
+    [I286_MEM_DS_SI]    = { "",    "si",      2 },
+    [I286_MEM_DS_DI]    = { "",    "di",      2 },
+    [I286_MEM_SS_BP]    = { "ss:", "bp",      2 },
+    [I286_MEM_DS_BX]    = { "",    "bx",      2 },
+};
+
+FMT_INLINE bool put_memory(enum fmt_flag flags, struct fmt_out *out, struct oper *oper, enum prefix pref)
+{
+    const char *seg = mem_bases[oper->mem.mode].seg;
+
+    switch (pref & PRE_MASK2) {
+        case PRE_CS:
+            seg = "cs:";
+            break;
+
+        case PRE_DS:
+            seg = "ds:";
+            break;
+
+        case PRE_ES:
+            seg = "es:";
+            break;
+
+        case PRE_SS:
+            seg = "ss:";
+            break;
+    }
+
+    bool hex = flags & FMT_HEX_DISP;
+    uint16_t disp = (uint16_t)oper->mem.disp;
+
+    if (!out_put(out, seg, strlen(seg)) || !out_put(out, "[", 1))
+        return false;
+
+    if (mem_bases[oper->mem.mode].len) {
+        if (!out_put(out, mem_bases[oper->mem.mode].base, mem_bases[oper->mem.mode].len))
+            return false;
+
+        if (disp == 0)
+            return out_put(out, "]", 1);
+
+        if (!out_put(out, oper->mem.disp < 0 ? " - " : " + ", 3))
+            return false;
+    }
+
+    if (!(hex ? out_hex(out, disp) : out_dec(out, disp, false)))
+        return false;
+
+    return out_put(out, "]", 1);
+}
+
+// Mirrors fmt_oper
+FMT_INLINE bool put_oper(struct fmt *fmt, enum fmt_flag flags, bool hooks,
+                         struct fmt_out *out, struct oper *oper, enum prefix pref)
+{
+    bool hex = flags & FMT_HEX_IMM;
+
+    if (hooks && fmt->oper_pre && !out_hook(out, fmt->oper_pre(out->buf, out->size, oper)))
+        return false;
+
+    bool ok = true;
+    switch (oper->flags) {
+        case I286_OPER_IMM8:
+            ok = hex ? out_hex(out, oper->imm8) : out_dec(out, oper->imm8, false);
+            break;
+
+        case I286_OPER_IMM16:
+            ok = hex ? out_hex(out, oper->imm16) : out_dec(out, oper->imm16, false);
+            break;
+
+        case I286_OPER_IMM32:
+            ok = hex ? out_hex(out, oper->imm32) : out_dec(out, oper->imm32, false);
+            break;
+
+        // Every register and segment name is two letters
+        case I286_OPER_REG:
+            ok = out_put(out, reg_mnemonics[oper->reg], 2);
+            break;
+
+        case I286_OPER_SEG:
+            ok = out_put(out, seg_mnemonics[oper->seg], 2);
+            break;
+
+        case I286_OPER_MEM:
+            ok = put_memory(flags, out, oper, pref);
+            break;
+    }
+
+    if (!ok)
+        return false;
+
+    return !hooks || !fmt->oper_post || out_hook(out, fmt->oper_post(out->buf, out->size, oper));
+}
+
+// Mirrors the first state of fmt_iterate
+FMT_INLINE bool put_opcode(struct fmt *fmt, enum fmt_flag flags, bool hooks,
+                           struct fmt_out *out, struct insn *ins)
+{
+    if (hooks && fmt->opcode_pre && !out_hook(out, fmt->opcode_pre(out->buf, out->size, ins)))
+        return false;
+
+    if ((flags & FMT_COLOR) && !out_put(out, FMT_COLOR_ON, sizeof(FMT_COLOR_ON) - 1))
+        return false;
+
+    switch (ins->pref & PRE_MASK1) {
+        case 0:
+            break;
+
+        case PRE_LOCK:
+            if (!out_put(out, "lock ", 5))
+                return false;
+            break;
+
+        case PRE_REP:
+            if (!out_put(out, "rep ", 4))
+                return false;
+            break;
+
+        default:
+            if (!out_put(out, "repne ", 6))
+                return false;
+            break;
+    }
+
+    if (!out_put(out, opcode_mnemonics[ins->op], opcode_lengths[ins->op]))
+        return false;
+
+    if ((flags & FMT_COLOR) && !out_put(out, FMT_COLOR_OFF, sizeof(FMT_COLOR_OFF) - 1))
+        return false;
+
+    return !hooks || !fmt->opcode_post || out_hook(out, fmt->opcode_post(out->buf, out->size, ins));
+}
+
+// Every piece fmt_iterate would return is followed by a space, a piece
+// that doesn't fit ends the output right before it
+#define PIECE(expr)                     \
+    do {                                \
+        end = out.buf;                  \
+        if (!(expr))                    \
+            return end - buf;           \
+    } while (0)
+
+FMT_INLINE int format_insn(struct fmt *fmt, enum fmt_flag flags, bool hooks,
+                           struct insn *ins, char *buf, size_t size)
+{
+    struct fmt_out out = { buf, size };
+    char *end;
+
+    PIECE(put_opcode(fmt, flags, hooks, &out, ins));
+    if (!ins->opers)
+        return out.buf - buf;
+
+    // fmt_iterate never gets to the operands of anything but branches
+    PIECE(out_put(&out, " ", 1));
+    if (!insn_is_branch(ins) || ins->op == I286_RET || ins->op == I286_RETF)
+        return out.buf - buf;
+
+    bool jtype = flags & FMT_JMP_TYPE;
+    bool jaddr = flags & FMT_JMP_ADDR;
+    bool jboth = flags & FMT_JMP_BOTH;
+    struct oper *oper = ins->opers;
+
+    if (ins->op == I286_JMPF || ins->op == I286_CALLF) {
+        if (jtype) {
+            PIECE(out_put(&out, "far", 3));
+            PIECE(out_put(&out, " ", 1));
+        }
+
+        if (oper->flags == I286_OPER_IMM32) {
+            PIECE(out_hex(&out, (uint16_t)(oper->imm32 >> 16))
+                  && out_put(&out, ":", 1)
+                  && out_hex(&out, (uint16_t)oper->imm32));
+        } else {
+            PIECE(put_oper(fmt, flags, hooks, &out, oper, ins->pref));
+        }
+
+        return out.buf - buf;
+    }
+
+    if (oper->flags != I286_OPER_IMM8 && oper->flags != I286_OPER_IMM16) {
+        if (jtype) {
+            PIECE(out_put(&out, "word", 4));
+            PIECE(out_put(&out, " ", 1));
+        }
+
+        PIECE(put_oper(fmt, flags, hooks, &out, oper, ins->pref));
+        return out.buf - buf;
+    }
+
+    bool wide = oper->flags == I286_OPER_IMM16;
+    int32_t rel = wide ? (int16_t)oper->imm16 : (int8_t)oper->imm8;
+    uint32_t addr = ins->addr + ins->len + rel;
+
+    if (jtype) {
+        PIECE(wide ? out_put(&out, "near", 4) : out_put(&out, "short", 5));
+        PIECE(out_put(&out, " ", 1));
+    }
+
+    if (jboth) {
+        PIECE(out_signed(&out, rel));
+        PIECE(out_put(&out, " ", 1));
+        PIECE(out_put(&out, "; ", 2) && out_hex(&out, addr));
+    } else if (jaddr) {
+        PIECE(out_hex(&out, addr));
+    } else {
+        PIECE(out_signed(&out, rel));
+    }
+
+    return out.buf - buf;
+}
+
+static int format_generic(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
+{
+    return format_insn(fmt, fmt->flags, false, ins, buf, size);
+}
+
+#define SPECIALIZE(name, flags)                                                 \
+    static int format_##name(struct fmt *fmt, struct insn *ins, char *buf, size_t size) \
+    {                                                                           \
+        return format_insn(fmt, flags, false, ins, buf, size);                  \
+    }
+
+#define SPECIALIZE_JMP(name, flags)                                             \
+    SPECIALIZE(name, flags)                                                     \
+    SPECIALIZE(name##_type, flags | FMT_JMP_TYPE)                               \
+    SPECIALIZE(name##_addr, flags | FMT_JMP_ADDR)                               \
+    SPECIALIZE(name##_type_addr, flags | FMT_JMP_TYPE | FMT_JMP_ADDR)           \
+    SPECIALIZE(name##_both, flags | FMT_JMP_BOTH)                               \
+    SPECIALIZE(name##_type_both, flags | FMT_JMP_TYPE | FMT_JMP_BOTH)
+
+#define SPECIALIZED_JMP(name, flags)                                            \
+    [flags] = format_##name,                                                    \
+    [flags | FMT_JMP_TYPE] = format_##name##_type,                              \
+    [flags | FMT_JMP_ADDR] = format_##name##_addr,                              \
+    [flags | FMT_JMP_TYPE | FMT_JMP_ADDR] = format_##name##_type_addr,          \
+    [flags | FMT_JMP_BOTH] = format_##name##_both,                              \
+    [flags | FMT_JMP_TYPE | FMT_JMP_BOTH] = format_##name##_type_both,
+
+#define FMT_HEX (FMT_HEX_IMM | FMT_HEX_DISP)
+
+SPECIALIZE_JMP(dec, FMT_NONE)
+SPECIALIZE_JMP(hex, FMT_HEX)
+SPECIALIZE_JMP(dec_color, FMT_COLOR)
+SPECIALIZE_JMP(hex_color, FMT_HEX | FMT_COLOR)
+
+// Indexed by flags, FMT_DEFAULT is hex_type_both
+static int (*const specialized[FMT_ALL + 1])(struct fmt *, struct insn *, char *, size_t) = {
+    SPECIALIZED_JMP(dec, FMT_NONE)
+    SPECIALIZED_JMP(hex, FMT_HEX)
+    SPECIALIZED_JMP(dec_color, FMT_COLOR)
+    SPECIALIZED_JMP(hex_color, FMT_HEX | FMT_COLOR)
+};
+
+void fmt_select(struct fmt *fmt)
+{
+    enum fmt_flag flags = fmt->flags;
+
+    // FMT_JMP_BOTH overrides FMT_JMP_ADDR
+    if (flags & FMT_JMP_BOTH)
+        flags &= ~FMT_JMP_ADDR;
+
+    fmt->format = specialized[flags] ? specialized[flags] : format_generic;
+}
+
+int fmt_insn_fast(struct fmt *fmt, struct insn *ins, char *buf, size_t size)
+{
+    // Hooks can be set any time after fmt_init, only take the
+    // specialised path without them
+    if (fmt->opcode_pre || fmt->opcode_post || fmt->oper_pre || fmt->oper_post)
+        return format_insn(fmt, fmt->flags, true, ins, buf, size);
+
+    return fmt->format(fmt, ins, buf, size);
+}
+
+int fmt_dec(char *buf, size_t size, uint32_t val, bool neg)
+{
+    struct fmt_out out = { buf, size };
+    char *start = buf;
+
+    out_dec(&out, val, neg);
+    return out.buf - start;
+}
@@ -0,0 +1,247 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i286dis.h"
+
+#define FUNCS_MIN 256
+
+static bool is_reg(const struct oper *oper, enum reg reg)
+{
+    return oper && oper->flags == I286_OPER_REG && oper->reg == reg;
+}
+
+// enter, or push bp followed by mov bp, sp
+static bool has_prologue(struct dis *dis, uint32_t addr)
+{
+    struct insn *ins = dis_lookup(dis, addr);
+    if (!ins)
+        return false;
+
+    if (ins->op == I286_ENTER)
+        return true;
+
+    if (ins->op != I286_PUSH || !is_reg(ins->opers, I286_REG_BP))
+        return false;
+
+    ins = dis_lookup(dis, ins->addr + ins->len);
+    return ins && ins->op == I286_MOV && is_reg(ins->opers, I286_REG_BP)
+        && is_reg(ins->opers->next, I286_REG_SP);
+}
+
+// Counts a return ending block b into func
+static void scan_block(struct dis *dis, const struct cfg *cfg, uint32_t b, struct func *func)
+{
+    struct insn *ins = NULL;
+    for (uint32_t i = 0, addr = cfg->start[b]; i < cfg->ninsns[b]; i++, addr += ins->len)
+        ins = dis_lookup(dis, addr);
+
+    switch (ins->op) {
+        case I286_RETF:
+            func->flags |= FUNC_FAR;
+            func->exits++;
+            break;
+
+        case I286_RET:
+        case I286_IRET:
+            func->exits++;
+            break;
+    }
+}
+
+void funcs_build(struct funcs *funcs, struct dis *dis, const struct cfg *cfg)
+{
+    memset(funcs, 0, sizeof(struct funcs));
+    funcs->func_of = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+
+    // Functions start at the entries, where something calls, at frame
+    // setup code and at code nothing leads to, such as what the
+    // traversal decoded past a retf
+    bool *starts = calloc(cfg->nblocks ? cfg->nblocks : 1, sizeof(bool));
+
+    for (uint32_t i = 0; i < dis->entries.nroots; i++) {
+        uint32_t b = cfg_block_of(cfg, dis->entries.roots[i]);
+        if (b != CFG_NONE)
+            starts[b] = true;
+    }
+
+    for (uint32_t e = 0; e < cfg->nedges; e++) {
+        if (cfg->succ_kind[e] == CFG_EDGE_CALL || cfg->succ_kind[e] == CFG_EDGE_FAR)
+            starts[cfg->succ[e]] = true;
+    }
+
+    for (uint32_t b = 0; b < cfg->nblocks; b++) {
+        funcs->func_of[b] = CFG_NONE;
+        if (cfg->pred_idx[b] == cfg->pred_idx[b + 1] || has_prologue(dis, cfg->start[b]))
+            starts[b] = true;
+    }
+
+    uint32_t cap = FUNCS_MIN;
+    funcs->items = malloc(cap * sizeof(struct func));
+
+    uint32_t *stack = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+
+    // In address order, a block reached from two functions stays with
+    // the first. Jumps to another start are tail calls and falling into
+    // one ends the function.
+    for (uint32_t start = 0; start < cfg->nblocks; start++) {
+        if (!starts[start] || funcs->func_of[start] != CFG_NONE)
+            continue;
+
+        if (funcs->n == cap) {
+            cap *= 2;
+            funcs->items = realloc(funcs->items, cap * sizeof(struct func));
+        }
+
+        uint32_t id = funcs->n++;
+        struct func *func = &funcs->items[id];
+        memset(func, 0, sizeof(struct func));
+        func->start = cfg->start[start];
+        func->end = cfg->end[start];
+
+        if (has_prologue(dis, func->start))
+            func->flags |= FUNC_FRAME;
+
+        uint32_t n = 0;
+        stack[n++] = start;
+        funcs->func_of[start] = id;
+
+        while (n) {
+            uint32_t b = stack[--n];
+            func->nblocks++;
+            func->ninsns += cfg->ninsns[b];
+            if (cfg->end[b] > func->end)
+                func->end = cfg->end[b];
+
+            scan_block(dis, cfg, b, func);
+
+            for (uint32_t e = cfg->succ_idx[b]; e < cfg->succ_idx[b + 1]; e++) {
+                uint32_t to = cfg->succ[e];
+
+                switch (cfg->succ_kind[e]) {
+                    case CFG_EDGE_FALL:
+                        if (starts[to])
+                            continue;
+                        break;
+                    case CFG_EDGE_COND:
+                    case CFG_EDGE_JUMP:
+                        if (starts[to]) {
+                            func->tails++;
+                            continue;
+                        }
+                        break;
+                    default:
+                        continue;
+                }
+
+                if (funcs->func_of[to] != CFG_NONE)
+                    continue;
+
+                funcs->func_of[to] = id;
+                stack[n++] = to;
+            }
+        }
+    }
+
+    // Blocks of each function in address order
+    funcs->block_idx = calloc(funcs->n + 1, sizeof(uint32_t));
+    funcs->blocks = malloc((cfg->nblocks ? cfg->nblocks : 1) * sizeof(uint32_t));
+
+    for (uint32_t b = 0; b < cfg->nblocks; b++) {
+        if (funcs->func_of[b] != CFG_NONE)
+            funcs->block_idx[funcs->func_of[b] + 1]++;
+    }
+
+    for (uint32_t f = 0; f < funcs->n; f++)
+        funcs->block_idx[f + 1] += funcs->block_idx[f];
+
+    uint32_t *pos = malloc((funcs->n ? funcs->n : 1) * sizeof(uint32_t));
+    memcpy(pos, funcs->block_idx, funcs->n * sizeof(uint32_t));
+
+    for (uint32_t b = 0; b < cfg->nblocks; b++) {
+        if (funcs->func_of[b] != CFG_NONE)
+            funcs->blocks[pos[funcs->func_of[b]]++] = b;
+    }
+
+    free(pos);
+    free(stack);
+    free(starts);
+}
+
+void funcs_deinit(struct funcs *funcs)
+{
+    free(funcs->items);
+    free(funcs->block_idx);
+    free(funcs->blocks);
+    free(funcs->func_of);
+}
+
+struct func_pool {
+    const struct funcs *funcs;
+    void (*job)(void *, uint32_t);
+    void *ctx;
+    // Functions largest first, so a big one doesn't start last
+    uint32_t *order;
+    atomic_uint next;
+};
+
+static void *func_worker(void *arg)
+{
+    struct func_pool *pool = arg;
+
+    while (true) {
+        uint32_t i = atomic_fetch_add(&pool->next, 1);
+        if (i >= pool->funcs->n)
+            break;
+
+        pool->job(pool->ctx, pool->order[i]);
+    }
+
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+void funcs_run(const struct funcs *funcs, int threads,
+               void (*job)(void *ctx, uint32_t func), void *ctx)
+{
+    if (threads <= 1) {
+        for (uint32_t f = 0; f < funcs->n; f++)
+            job(ctx, f);
+        return;
+    }
+
+    struct func_pool pool = { .funcs = funcs, .job = job, .ctx = ctx };
+    pool.order = malloc((funcs->n ? funcs->n : 1) * sizeof(uint32_t));
+    atomic_init(&pool.next, 0);
+
+    // Sorted as size complement and index in one key
+    uint64_t *keys = malloc((funcs->n ? funcs->n : 1) * sizeof(uint64_t));
+    for (uint32_t f = 0; f < funcs->n; f++)
+        keys[f] = (uint64_t)(UINT32_MAX - funcs->items[f].ninsns) << 32 | f;
+
+    qsort(keys, funcs->n, sizeof(uint64_t), compare_u64);
+
+    for (uint32_t f = 0; f < funcs->n; f++)
+        pool.order[f] = (uint32_t)keys[f];
+
+    free(keys);
+
+    // The calling thread works too
+    pthread_t *tids = malloc((threads - 1) * sizeof(pthread_t));
+    for (int i = 0; i < threads - 1; i++)
+        pthread_create(&tids[i], NULL, func_worker, &pool);
+
+    func_worker(&pool);
+
+    for (int i = 0; i < threads - 1; i++)
+        pthread_join(tids[i], NULL);
+
+    free(tids);
+    free(pool.order);
+}
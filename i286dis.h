@@ -193,6 +193,8 @@ enum opcode {
     I286_XCHG,
     I286_XLAT,
     I286_XOR,
+
+    I286_OPCODE_N,
 };
 
 enum prefix {
@@ -208,34 +210,417 @@ enum prefix {
     PRE_MASK2 = PRE_CS | PRE_DS | PRE_ES | PRE_SS,
 };
 
+#define I286_OPER_N 3
+
 struct insn {
 	uint32_t addr;
     uint8_t len;
 	enum opcode op;
     enum prefix pref;
 	struct oper *opers;
+	struct oper oper_buf[I286_OPER_N];
+};
+
+// Packed operand, sel holds the register, segment or memory mode and val
+// the immediate or displacement. An IMM32 keeps its high half in the val
+// of the following slot.
+struct oper_rec {
+    uint8_t flags;
+    uint8_t sel;
+    uint16_t val;
+};
+
+struct insn_rec {
+    uint32_t addr;
+    uint8_t len;
+    uint8_t op;
+    uint8_t pref;
+    uint8_t nopers;
+    struct oper_rec opers[I286_OPER_N];
+};
+
+struct arena_block;
+
+struct arena {
+    struct arena_block *head;
+    size_t used;
+    size_t size;
+    // Bytes taken from malloc over all blocks
+    size_t total;
+};
+
+// Struct-of-arrays instruction store. A bitmap marks instruction starts
+// by offset, instructions are kept in address order once finalized and
+// rank gives the index of the first instruction of each bitmap word.
+struct store {
+    uint32_t base;
+    uint32_t words;
+    uint64_t *code;
+    uint32_t *rank;
+    uint32_t *addr;
+    uint32_t *oper;
+    uint8_t *len;
+    uint8_t *op;
+    uint8_t *pref;
+    uint8_t *nopers;
+    uint32_t n;
+    uint32_t cap;
+    struct oper_rec *opers;
+    uint32_t opers_n;
+    uint32_t opers_cap;
+    // Slots of removed or replaced instructions, opers is compacted
+    // when it is full and at least half of it is dead
+    uint32_t opers_dead;
+    bool sorted;
+    bool ranked;
+    // Removed instructions still sit in the arrays until store_finalize
+    bool holes;
+};
+
+// Pending traversal entries, queued marks every offset ever pushed so
+// each target is followed at most once
+struct worklist {
+    uint32_t *items;
+    uint32_t n;
+    uint32_t cap;
+    uint64_t *queued;
+    uint32_t pushes;
+    uint32_t dups;
+    uint32_t out_of_range;
+    // Entries pushed by the user, branch targets found on the way
+    // aren't roots
+    uint32_t *roots;
+    uint32_t nroots;
+    uint32_t roots_cap;
+};
+
+enum cfg_edge {
+    CFG_EDGE_FALL,
+    // Taken conditional branch or loop
+    CFG_EDGE_COND,
+    CFG_EDGE_JUMP,
+    CFG_EDGE_CALL,
+    // Far call or jump to a known address
+    CFG_EDGE_FAR,
 };
 
-#define DIS_ENTRY_N 64
+// How a data xref uses the referenced offset
+enum data_access {
+    DATA_READ  = 1 << 0,
+    DATA_WRITE = 1 << 1,
+    // Only the address is taken, by lea or a mov r16, imm16
+    DATA_ADDR  = 1 << 2,
+};
+
+// The to of a data xref, segment and offset in one key
+#define DIS_DATA_ADDR(seg, off) ((uint32_t)(seg) << 16 | (off))
+
+// A reference from the instruction at from. For a branch, to is the
+// target and kind an enum cfg_edge. For data, to is a DIS_DATA_ADDR
+// and kind an enum data_access.
+struct xref {
+    uint32_t from;
+    uint32_t to;
+    uint8_t kind;
+};
+
+// References recorded with DIS_XREFS, in the order found until the
+// first query after a change sorts items by source and by_target by
+// target
+struct xrefs {
+    struct xref *items;
+    struct xref *by_target;
+    uint32_t n;
+    uint32_t cap;
+    bool sorted;
+};
+
+// Bytes that must be readable past the end of a DIS_PADDED image
+#define DIS_PAD 16
+
+// The 286 faults on instructions over 10 bytes, a longer run of prefixes
+// decodes as a one byte (bad). What follows the prefixes takes at most
+// 6 bytes, which bounds every instruction to DIS_INSN_MAX.
+#define DIS_PREFIX_MAX 9
+#define DIS_INSN_MAX (DIS_PREFIX_MAX + 6)
+
+enum dis_flag {
+    // Allocate decoded instructions from an arena owned by struct dis
+    DIS_ARENA    = 1 << 0,
+    // Keep decoded instructions in a struct store instead of a table
+    // with one insn pointer per byte
+    DIS_COMPACT  = 1 << 1,
+    // The caller guarantees DIS_PAD readable bytes after the image
+    DIS_PADDED   = 1 << 2,
+    // Record every branch and absolute data reference dis_insert sees,
+    // see dis_xrefs_to and dis_data_xrefs_to
+    DIS_XREFS    = 1 << 3,
+
+    DIS_NONE     = 0,
+};
+
+enum dis_handler {
+    DIS_HANDLER_PREFIX,
+    DIS_HANDLER_MODRM,
+    DIS_HANDLER_GROUP1,
+    DIS_HANDLER_GROUP2,
+    DIS_HANDLER_GROUP3,
+    DIS_HANDLER_GROUP4,
+    DIS_HANDLER_GROUP6,
+    DIS_HANDLER_GROUP7,
+
+    DIS_HANDLER_N,
+};
+
+enum dis_phase {
+    DIS_PHASE_DISASM,
+    DIS_PHASE_SWEEP,
+
+    DIS_PHASE_N,
+};
+
+// Only collected when built with -DI286_STATS, see dis_get_stats
+struct dis_stats {
+    uint64_t opcodes[I286_OPCODE_N];
+    uint64_t handlers[DIS_HANDLER_N];
+    // (bad) because the image ended, or because the bytes don't encode
+    // an instruction
+    uint64_t bad_truncated;
+    uint64_t bad_invalid;
+    uint64_t pushes;
+    // Entries dropped as already queued, decoded or out of range
+    uint64_t drops;
+    uint64_t allocated;
+    double phases[DIS_PHASE_N];
+};
+
+#ifdef I286_STATS
+#define DIS_STAT(dis, field) ((dis)->stats.field++)
+#define DIS_PHASE_BEGIN() double phase_start = dis_stats_now()
+#define DIS_PHASE_END(dis, phase) ((dis)->stats.phases[phase] += dis_stats_now() - phase_start)
+#else
+#define DIS_STAT(dis, field) ((void)0)
+#define DIS_PHASE_BEGIN() ((void)0)
+#define DIS_PHASE_END(dis, phase) ((void)0)
+#endif
+
+// An instruction dis_invalidate_range dropped and where control could
+// go after it
+struct dropped {
+    uint32_t addr;
+    uint32_t succ[2];
+    int nsucc;
+};
 
 struct dis {
     uint32_t ip;
     uint32_t base;
     uint32_t limit;
     const uint8_t *bytes;
-    uint32_t entry_list[DIS_ENTRY_N];
-    uint32_t entry_n;
+    struct worklist entries;
     struct insn **decoded;
+    enum dis_flag flags;
+    struct arena arena;
+    struct store store;
+    struct insn view;
+    const uint8_t *cur;
+    uint8_t tail[DIS_PAD];
+    struct dropped *dropped;
+    uint32_t ndropped;
+    uint32_t dropped_cap;
+    struct xrefs xrefs;
+    struct xrefs data_xrefs;
+    // Present in every build so the layout doesn't depend on
+    // I286_STATS, only counted with it
+    struct dis_stats stats;
+};
+
+// Bump whenever the cache file layout or the decoder output changes,
+// older cache files are then ignored
+#define DIS_CACHE_VERSION 1
+
+// A dis_cache_save file. Followed by nroots entries, then the
+// instructions as columns the way struct store keeps them: addr, len,
+// op, pref and nopers, then the nslots operand slots of all
+// instructions in address order.
+struct dis_cache_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t base;
+    uint32_t len;
+    uint32_t nroots;
+    uint32_t n;
+    uint32_t nslots;
+    uint32_t reserved;
+    uint64_t key[2];
+    // dis_cache_sum of everything after the header
+    uint64_t sum;
+};
+
+enum func_flag {
+    // Starts with enter or push bp, mov bp, sp
+    FUNC_FRAME = 1 << 0,
+    // Returns with retf
+    FUNC_FAR   = 1 << 1,
+};
+
+// A function, running from start to the end of its last block. exits
+// counts its returns and tails its jumps into other functions.
+struct func {
+    uint32_t start;
+    uint32_t end;
+    uint32_t nblocks;
+    uint32_t ninsns;
+    uint32_t exits;
+    uint32_t tails;
+    enum func_flag flags;
+};
+
+// Functions in address order, the CFG blocks of function f are
+// blocks[block_idx[f]] up to blocks[block_idx[f + 1]] in address order
+// and func_of maps blocks back, CFG_NONE for blocks of no function
+struct funcs {
+    uint32_t n;
+    struct func *items;
+    uint32_t *block_idx;
+    uint32_t *blocks;
+    uint32_t *func_of;
+};
+
+enum summary_flag {
+    // No path from the start comes back to the caller
+    SUMMARY_NORETURN = 1 << 0,
+    // The stack pointer isn't the same on every return, or isn't known
+    SUMMARY_NODELTA  = 1 << 1,
+    // Calls or jumps somewhere unknown, assumed to come back and to
+    // clobber every register
+    SUMMARY_INDIRECT = 1 << 2,
+};
+
+// Bit of a register in struct summary, byte registers count as their
+// word register. Segment register seg is bit 8 + seg.
+#define SUMMARY_REG(reg) (1u << ((reg) >= I286_REG_AX ? (reg) - I286_REG_AX : (reg) / 2))
+
+// What a call to a function does to its caller. delta is how far sp
+// moves over the call, not counting the return address, so 4 for a
+// ret 4. clobbers has the registers that may hold another value when
+// it returns, ones it saves and restores on every path are left out.
+struct summary {
+    uint32_t clobbers;
+    int32_t delta;
+    enum summary_flag flags;
+};
+
+// Calls between functions, tail calls included, condensed into strongly
+// connected components. Function f calls calls[call_idx[f]] up to
+// calls[call_idx[f + 1]], component c holds members[scc_idx[c]] up to
+// members[scc_idx[c + 1]]. Components are numbered callees first, a
+// call goes to a lower numbered component or stays in its own.
+struct callgraph {
+    uint32_t n;
+    uint32_t ncalls;
+    uint32_t *call_idx;
+    uint32_t *calls;
+    uint32_t nsccs;
+    uint32_t *scc_of;
+    uint32_t *scc_idx;
+    uint32_t *members;
+    struct summary *summaries;
 };
 
+#define DIS_BIN_VERSION 1
+
+// Disassembly for other tools to mmap, see dis_bin_write. Offsets are
+// from the start of the file and 64 byte aligned, all in host byte order.
+struct dis_bin_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t order;
+    uint32_t base;
+    uint32_t len;
+    // Instructions, and 64 bit words of the code bitmap
+    uint32_t n;
+    uint32_t words;
+    // Bitmap of instruction starts by offset from base
+    uint64_t code;
+    // Per bitmap word, the index of its first instruction
+    uint64_t rank;
+    // n struct insn_rec in address order
+    uint64_t recs;
+    // The len bytes of the image
+    uint64_t bytes;
+    uint64_t size;
+};
+
+// A mapped dis_bin_write file, the pointers point into the mapping
+struct dis_bin {
+    const struct dis_bin_header *header;
+    const uint64_t *code;
+    const uint32_t *rank;
+    const struct insn_rec *recs;
+    const uint8_t *bytes;
+    uint32_t n;
+    size_t size;
+};
+
+#define CFG_NONE UINT32_MAX
+
+// Basic blocks of a traversal, numbered in address order. Block b runs
+// from start[b] up to end[b], its successors are succ[succ_idx[b]] up to
+// succ[succ_idx[b + 1]] with their kinds in succ_kind, and predecessors
+// likewise. Calls end a block, with a fall through edge to the return.
+// A retf ends its block with no fall through, whatever the traversal
+// decoded after it starts a block of its own.
+struct cfg {
+    uint32_t base;
+    uint32_t len;
+    uint32_t nblocks;
+    uint32_t nedges;
+    uint32_t *start;
+    uint32_t *end;
+    uint32_t *ninsns;
+    uint32_t *succ_idx;
+    uint32_t *succ;
+    uint8_t *succ_kind;
+    uint32_t *pred_idx;
+    uint32_t *pred;
+    uint8_t *pred_kind;
+    // Instruction starts with their rank, and the block of each
+    // instruction by rank, for cfg_block_of
+    uint32_t words;
+    uint64_t *code;
+    uint32_t *rank;
+    uint32_t *block;
+};
+
+#define DIS_STREAM_WINDOW (64 * 1024)
+
+// Linear sweep over input that arrives in chunks
+struct dis_stream {
+    struct dis dis;
+    // Address of buf[0]
+    uint32_t addr;
+    uint32_t len;
+    uint32_t pos;
+    bool eof;
+    uint8_t buf[DIS_STREAM_WINDOW + DIS_PAD];
+};
+
+#define FMT_COLOR_ON  "\e[93m"
+#define FMT_COLOR_OFF "\e[0m"
+
 enum fmt_flag {
     FMT_HEX_IMM  = 1 << 0,
     FMT_HEX_DISP = 1 << 1,
     FMT_JMP_TYPE = 1 << 2,
     FMT_JMP_ADDR = 1 << 3,
     FMT_JMP_BOTH = 1 << 4,
+    // Highlight the mnemonic with FMT_COLOR_ON and FMT_COLOR_OFF
+    FMT_COLOR    = 1 << 5,
 
     FMT_NONE     = 0,
+    FMT_ALL      = (1 << 6) - 1,
     FMT_DEFAULT  = FMT_HEX_IMM | FMT_HEX_DISP
                  | FMT_JMP_TYPE | FMT_JMP_BOTH,
 };
@@ -248,6 +633,8 @@ struct fmt {
     int (*opcode_post)(char *, size_t, struct insn *);
     int (*oper_pre)(char *, size_t, struct oper *);
     int (*oper_post)(char *, size_t, struct oper *);
+    // Picked by fmt_select for the flags, used by fmt_insn_fast
+    int (*format)(struct fmt *, struct insn *, char *, size_t);
 };
 
 extern const char *reg_mnemonics[];
@@ -278,30 +665,242 @@ bool insn_is_branch(struct insn *ins);
 
 bool insn_get_branch(struct insn *ins, uint32_t *target);
 
+// Edge kind of a branch, for instructions with a target
+enum cfg_edge insn_branch_kind(struct insn *ins);
+
 struct insn *insn_alloc(uint32_t addr);
 
 void insn_free(struct insn *ins);
 
-void dis_init(struct dis *dis, const uint8_t *bytes, uint32_t len, uint32_t base);
+void insn_pack(struct insn_rec *rec, const struct insn *ins);
+
+void insn_unpack(struct insn *ins, const struct insn_rec *rec);
+
+void arena_init(struct arena *arena);
+
+void *arena_alloc(struct arena *arena, size_t size);
+
+void arena_release(struct arena *arena);
+
+void store_init(struct store *store, uint32_t base, uint32_t len);
+
+void store_deinit(struct store *store);
+
+bool store_has(const struct store *store, uint32_t off);
+
+bool store_next(const struct store *store, uint32_t off, uint32_t *next);
+
+void store_finalize(struct store *store);
+
+void store_insert(struct store *store, uint32_t off, const struct insn_rec *rec);
+
+bool store_lookup(struct store *store, uint32_t off, struct insn_rec *rec);
+
+void store_remove(struct store *store, uint32_t off);
+
+// Fills an empty store from columns in address order, the operand slots
+// of all instructions back to back in opers
+void store_load(struct store *store, uint32_t n, const uint32_t *addr, const uint8_t *len,
+                const uint8_t *op, const uint8_t *pref, const uint8_t *nopers,
+                const struct oper_rec *opers, uint32_t slots);
+
+uint8_t *dis_alloc_padded(uint32_t len);
+
+void dis_init(struct dis *dis, const uint8_t *bytes, uint32_t len, uint32_t base, enum dis_flag flags);
 
 void dis_deinit(struct dis *dis);
 
+struct insn *dis_insn_alloc(struct dis *dis, uint32_t addr);
+
+struct insn *dis_insert(struct dis *dis, const struct insn_rec *rec);
+
+bool dis_is_decoded(struct dis *dis, uint32_t addr);
+
+// With DIS_COMPACT the returned insn is a view owned by struct dis that
+// is only valid until the next lookup, decode or iteration
+struct insn *dis_lookup(struct dis *dis, uint32_t addr);
+
+// Like dis_lookup, but a DIS_COMPACT instruction is unpacked into buf
+// instead of the view. Safe from several threads while nothing is
+// decoded or removed.
+struct insn *dis_lookup_r(struct dis *dis, uint32_t addr, struct insn *buf);
+
 void dis_push_entry(struct dis *dis, uint32_t entry);
 
 bool dis_pop_entry(struct dis *dis, uint32_t *entry);
 
+void dis_decode_rec(struct dis *dis, struct insn_rec *ins);
+
 struct insn *dis_decode(struct dis *dis);
 
+// Decodes up to n consecutive instructions from start into out and
+// returns how many were decoded. Nothing is allocated or recorded in
+// struct dis, ip is left after the last one.
+size_t dis_decode_batch(struct dis *dis, uint32_t start, struct insn_rec *out, size_t n);
+
+// Length of the instruction at addr, or 0 if dis_decode would give a
+// one byte (bad). Never allocates and never builds operands.
+int dis_insn_length(const struct dis *dis, uint32_t addr);
+
+bool dis_is_prefix(uint8_t byte);
+
 void dis_disasm(struct dis *dis);
 
+// Drops every decoded instruction overlapping the len bytes at addr and
+// queues their addresses again, for when those bytes get patched
+void dis_invalidate_range(struct dis *dis, uint32_t addr, uint32_t len);
+
+// Decodes again what dis_invalidate_range dropped and forgets whatever
+// is no longer reachable from the entries. The result is the same as a
+// fresh dis_disasm over the patched image.
+void dis_redisasm(struct dis *dis);
+
+// Recursive traversal from the queued entries on several threads, the
+// result doesn't depend on the number of threads
+void dis_disasm_parallel(struct dis *dis, int threads);
+
+// Smallest region dis_sweep gives a thread
+#define SWEEP_REGION_MIN 4096
+
+// Linear sweep over the whole image, the result doesn't depend on the
+// number of threads
+void dis_sweep(struct dis *dis, int threads);
+
 bool dis_iterate(struct dis *dis, uint32_t *index, struct insn **ins);
 
+bool dis_iterate_code(struct dis *dis, uint32_t *index, struct insn **ins);
+
+// Loads what dis_disasm would decode for the image, base and pushed
+// entries from a file in the cache directory dir and consumes the
+// entries. Returns false, leaving dis untouched, on a miss.
+bool dis_cache_load(struct dis *dis, const char *dir);
+
+// Files the decoded instructions in dir under the key dis_cache_load
+// looks for, call after dis_disasm
+bool dis_cache_save(struct dis *dis, const char *dir);
+
+// Checksum of the payload of a cache file
+uint64_t dis_cache_sum(const void *payload, size_t size);
+
+// Writes the decoded instructions and the image to path in the
+// struct dis_bin_header format
+bool dis_bin_write(struct dis *dis, const char *path);
+
+bool dis_bin_open(struct dis_bin *bin, const char *path);
+
+void dis_bin_close(struct dis_bin *bin);
+
+// The instruction starting at addr, or NULL. Iterating bin->recs visits
+// every instruction in address order.
+const struct insn_rec *dis_bin_lookup(const struct dis_bin *bin, uint32_t addr);
+
+// Splits what the traversal decoded into basic blocks and links them,
+// dis isn't needed afterwards
+void cfg_build(struct cfg *cfg, struct dis *dis);
+
+void cfg_deinit(struct cfg *cfg);
+
+// Block of the instruction starting at addr, or CFG_NONE
+uint32_t cfg_block_of(const struct cfg *cfg, uint32_t addr);
+
+void dis_xref_add(struct dis *dis, struct insn *ins);
+
+// Branches to target, sorted by source. Returns how many and points
+// xrefs at them, valid until the next instruction is decoded. Like
+// dis_lookup this can replace the DIS_COMPACT view. Once a query has
+// sorted the index, queries change nothing and can run on threads.
+uint32_t dis_xrefs_to(struct dis *dis, uint32_t target, const struct xref **xrefs);
+
+// The branch of the instruction at source, or NULL
+const struct xref *dis_xref_from(struct dis *dis, uint32_t source);
+
+// Data references to offsets off up to off + len in segment seg, sorted
+// by offset and then source. The segment is the one the instruction
+// uses, DS unless overridden. Returns how many and points xrefs at
+// them, with the same lifetime as for dis_xrefs_to.
+uint32_t dis_data_xrefs_to(struct dis *dis, enum seg seg, uint16_t off, uint32_t len,
+                           const struct xref **xrefs);
+
+// The data reference of the instruction at source, or NULL
+const struct xref *dis_data_xref_from(struct dis *dis, uint32_t source);
+
+// Recovers functions from the entries, call targets and frame setup
+// code. A function owns the blocks it reaches by falling through and
+// jumping, stopping at returns and at other functions.
+void funcs_build(struct funcs *funcs, struct dis *dis, const struct cfg *cfg);
+
+void funcs_deinit(struct funcs *funcs);
+
+// Calls job once for every function on a pool of threads, in no
+// particular order. Use dis_lookup_r to read instructions from jobs.
+void funcs_run(const struct funcs *funcs, int threads,
+               void (*job)(void *ctx, uint32_t func), void *ctx);
+
+void callgraph_build(struct callgraph *graph, const struct cfg *cfg, const struct funcs *funcs);
+
+void callgraph_deinit(struct callgraph *graph);
+
+// Fills in the summaries bottom up, components whose callees are done
+// run in parallel on threads. The functions of a component are
+// evaluated again until their summaries stop changing.
+void callgraph_summarize(struct callgraph *graph, struct dis *dis, const struct cfg *cfg,
+                         const struct funcs *funcs, int threads);
+
+void dis_stream_init(struct dis_stream *stream, uint32_t base);
+
+void dis_stream_deinit(struct dis_stream *stream);
+
+// Copies as much of the chunk as fits in the window and returns how
+// many bytes were taken. Drain dis_stream_next before feeding again.
+size_t dis_stream_feed(struct dis_stream *stream, const uint8_t *bytes, size_t len);
+
+// No more input will follow, the last instructions can be decoded
+void dis_stream_finish(struct dis_stream *stream);
+
+// Next instruction in address order, false when more input is needed
+// or everything was decoded. The insn and its bytes are only valid
+// until the next call.
+bool dis_stream_next(struct dis_stream *stream, struct insn **ins, const uint8_t **bytes);
+
+extern const char *dis_handler_names[];
+
+extern const char *dis_phase_names[];
+
+extern const char *cfg_edge_names[];
+
+// Fills stats and returns true when the library was built with
+// -DI286_STATS. Otherwise stats is zeroed and false is returned.
+bool dis_get_stats(const struct dis *dis, struct dis_stats *stats);
+
+double dis_stats_now(void);
+
+// Worker copies of a struct dis start from zero and are added back to
+// the original once they are done
+void dis_stats_reset(struct dis *dis);
+
+void dis_stats_merge(struct dis *dis, const struct dis *from);
+
+// Takes back what dis_stats_merge added, for decodes that were thrown away
+void dis_stats_unmerge(struct dis *dis, const struct dis *from);
+
 void fmt_init(struct fmt *fmt, enum fmt_flag flags);
 
+// Picks the formatter specialised for fmt->flags, fmt_init already
+// does this and it only needs calling again after changing the flags
+void fmt_select(struct fmt *fmt);
+
 bool fmt_is_done(struct fmt *fmt);
 
 int fmt_iterate(struct fmt *fmt, struct insn *ins, char *buf, size_t size);
 
 int fmt_insn(struct fmt *fmt, struct insn *ins, char *buf, size_t size);
 
+// Same output as fmt_insn, without snprintf
+int fmt_insn_fast(struct fmt *fmt, struct insn *ins, char *buf, size_t size);
+
+// Writes val in decimal, after a minus sign when neg, the way
+// fmt_insn_fast does and returns how many characters it wrote. 12
+// bytes always fit.
+int fmt_dec(char *buf, size_t size, uint32_t val, bool neg);
+
 #endif
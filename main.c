@@ -1,94 +1,586 @@
 #include <stdio.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "i286dis.h"
 
 static unsigned base = 0x100;
 static unsigned entry = 0x100;
+static bool linear = false;
+static int threads = 1;
+static bool stats = false;
+static const char *cache = NULL;
+static const char *output = NULL;
+static bool xrefs = false;
+static bool funcs = false;
 
 #define SPACING 32
 
-int yellow(char *buf, size_t size, struct insn *ins)
+#define LISTING_BUF (1 << 16)
+// Room for the longest line, DIS_INSN_MAX bytes and their text
+#define LISTING_LINE 0x400
+// Branches named on a label line before the rest are only counted
+#define LISTING_XREFS 8
+
+// Lines are rendered straight into buf, which is written out to fd in
+// one go whenever it runs low. Without an fd, buf grows instead.
+struct listing {
+    char *buf;
+    size_t len;
+    size_t cap;
+    int fd;
+};
+
+static char listing_buf[LISTING_BUF];
+static struct listing listing = { listing_buf, 0, LISTING_BUF, 1 };
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static void listing_flush(struct listing *out)
+{
+    size_t off = 0;
+
+    while (off < out->len) {
+        ssize_t n = write(out->fd, out->buf + off, out->len - off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("Failed to write");
+            exit(1);
+        }
+
+        off += n;
+    }
+
+    out->len = 0;
+}
+
+static char *listing_line(struct listing *out)
+{
+    if (out->cap - out->len >= LISTING_LINE)
+        return out->buf + out->len;
+
+    if (out->fd >= 0) {
+        listing_flush(out);
+    } else {
+        out->cap = out->cap ? out->cap * 2 : LISTING_BUF;
+        out->buf = realloc(out->buf, out->cap);
+    }
+
+    return out->buf + out->len;
+}
+
+static char *put_hex(char *p, uint32_t val)
+{
+    int digits = 1;
+    while (digits < 8 && val >> (digits * 4))
+        digits++;
+
+    for (int i = digits - 1; i >= 0; i--)
+        *p++ = hex_digits[val >> (i * 4) & 0xF];
+
+    return p;
+}
+
+static char *put_dec(char *p, uint32_t val)
+{
+    return p + fmt_dec(p, 12, val, false);
+}
+
+static char *put_addr(char *p, uint32_t addr)
+{
+    p = put_hex(p, addr);
+    *p++ = ':';
+    return p;
+}
+
+static char *put_str(char *p, const char *str)
+{
+    size_t len = strlen(str);
+    memcpy(p, str, len);
+    return p + len;
+}
+
+static char *put_byte(char *p, uint8_t byte)
 {
-    (void)ins;
-    return snprintf(buf, size, "\e[93m");
+    *p++ = ' ';
+    *p++ = hex_digits[byte >> 4];
+    *p++ = hex_digits[byte & 0xF];
+    return p;
 }
 
-int reset(char *buf, size_t size, struct insn *ins)
+static char *put_padding(char *p, const char *line)
 {
-    (void)ins;
-    return snprintf(buf, size, "\e[0m");
+    while (p - line < SPACING)
+        *p++ = ' ';
+
+    return p;
+}
+
+static void listing_insn(struct listing *out, struct fmt *fmt, struct insn *ins, const uint8_t *bytes)
+{
+    char *line = listing_line(out), *p = line;
+
+    p = put_addr(p, ins->addr);
+    for (int i = 0; i < ins->len; i++)
+        p = put_byte(p, bytes[i]);
+
+    p = put_padding(p, line);
+    p += fmt_insn_fast(fmt, ins, p, 0x100);
+    *p++ = '\n';
+
+    out->len = p - out->buf;
+}
+
+// Label line for a branch target, with the first few branches to it
+static void listing_label(struct listing *out, uint32_t addr, const struct xref *xrefs, uint32_t n)
+{
+    char *line = listing_line(out), *p = line;
+
+    p = put_str(p, "loc_");
+    p = put_addr(p, addr);
+    p = put_padding(p, line);
+    p = put_str(p, "; from");
+
+    for (uint32_t i = 0; i < n && i < LISTING_XREFS; i++) {
+        p = put_str(p, i ? ", " : " ");
+        p = put_hex(p, xrefs[i].from);
+        *p++ = ' ';
+        p = put_str(p, cfg_edge_names[xrefs[i].kind]);
+    }
+
+    if (n > LISTING_XREFS) {
+        p = put_str(p, " and ");
+        p = put_dec(p, n - LISTING_XREFS);
+        p = put_str(p, " more");
+    }
+
+    *p++ = '\n';
+    out->len = p - out->buf;
+}
+
+static void listing_data(struct listing *out, uint32_t addr, uint8_t byte)
+{
+    char *line = listing_line(out), *p = line;
+
+    p = put_addr(p, addr);
+    p = put_byte(p, byte);
+    p = put_padding(p, line);
+
+    memcpy(p, "db '", 4);
+    p += 4;
+
+    if (isprint(byte)) {
+        *p++ = byte;
+    } else {
+        *p++ = '\\';
+        *p++ = 'x';
+        if (byte >> 4)
+            *p++ = hex_digits[byte >> 4];
+        *p++ = hex_digits[byte & 0xF];
+    }
+
+    *p++ = '\'';
+    *p++ = '\n';
+
+    out->len = p - out->buf;
+}
+
+static void print_stats(const struct dis *dis, double listing)
+{
+    struct dis_stats st;
+    if (!dis_get_stats(dis, &st)) {
+        fprintf(stderr, "Statistics need a build with STATS=1\n");
+        return;
+    }
+
+    uint64_t decoded = 0;
+    for (int i = 0; i < I286_OPCODE_N; i++)
+        decoded += st.opcodes[i];
+
+    fprintf(stderr, "decoded        %llu\n", (unsigned long long)decoded);
+    fprintf(stderr, "bad truncated  %llu\n", (unsigned long long)st.bad_truncated);
+    fprintf(stderr, "bad invalid    %llu\n", (unsigned long long)st.bad_invalid);
+    fprintf(stderr, "entry pushes   %llu\n", (unsigned long long)st.pushes);
+    fprintf(stderr, "entry drops    %llu\n", (unsigned long long)st.drops);
+    fprintf(stderr, "allocated      %llu bytes\n", (unsigned long long)st.allocated);
+
+    for (int i = 0; i < DIS_PHASE_N; i++) {
+        if (st.phases[i] > 0)
+            fprintf(stderr, "phase %-8s %.6fs\n", dis_phase_names[i], st.phases[i]);
+    }
+    fprintf(stderr, "phase listing  %.6fs\n", listing);
+
+    for (int i = 0; i < DIS_HANDLER_N; i++)
+        fprintf(stderr, "handler %-6s %llu\n", dis_handler_names[i], (unsigned long long)st.handlers[i]);
+
+    for (int i = 0; i < I286_OPCODE_N; i++) {
+        if (st.opcodes[i])
+            fprintf(stderr, "opcode %-7s %llu\n", opcode_mnemonics[i], (unsigned long long)st.opcodes[i]);
+    }
+}
+
+static void listing_func_header(struct listing *out, const struct func *func,
+                                const struct summary *sum)
+{
+    char *line = listing_line(out), *p = line;
+
+    *p++ = '\n';
+    p = put_str(p, "func_");
+    p = put_addr(p, func->start);
+    p = put_padding(p, line + 1);
+    p = put_str(p, "; ");
+    p = put_dec(p, func->nblocks);
+    p = put_str(p, " blocks, ");
+    p = put_dec(p, func->ninsns);
+    p = put_str(p, " insns, ");
+    p = put_dec(p, func->exits);
+    p = put_str(p, " exits, ");
+    p = put_dec(p, func->tails);
+    p = put_str(p, " tails");
+
+    if (func->flags & FUNC_FRAME)
+        p = put_str(p, ", frame");
+    if (func->flags & FUNC_FAR)
+        p = put_str(p, ", far");
+
+    *p++ = '\n';
+    line = p;
+    p = put_padding(p, line);
+
+    if (sum->flags & SUMMARY_NORETURN) {
+        p = put_str(p, "; noreturn");
+    } else if (sum->flags & SUMMARY_NODELTA) {
+        p = put_str(p, "; returns, sp ?");
+    } else {
+        p = put_str(p, sum->delta < 0 ? "; returns, sp -" : "; returns, sp +");
+        p = put_dec(p, sum->delta < 0 ? -(uint32_t)sum->delta : (uint32_t)sum->delta);
+    }
+
+    if (sum->flags & SUMMARY_INDIRECT)
+        p = put_str(p, ", indirect");
+
+    if (sum->clobbers)
+        p = put_str(p, ", clobbers");
+
+    for (int i = 0; i < 8; i++) {
+        if (sum->clobbers & 1u << i) {
+            *p++ = ' ';
+            p = put_str(p, reg_mnemonics[I286_REG_AX + i]);
+        }
+    }
+
+    for (int i = 0; i < 4; i++) {
+        if (sum->clobbers & 1u << (8 + i)) {
+            *p++ = ' ';
+            p = put_str(p, seg_mnemonics[i]);
+        }
+    }
+
+    *p++ = '\n';
+    out->len = p - out->buf;
+}
+
+// What the function listing jobs share, each renders into its own out
+struct func_listing {
+    struct dis *dis;
+    const struct cfg *cfg;
+    const struct funcs *funcs;
+    const struct callgraph *graph;
+    const uint8_t *bytes;
+    struct listing *out;
+};
+
+static void listing_block(struct listing *out, struct fmt *fmt, struct func_listing *ctx, uint32_t b)
+{
+    struct dis *dis = ctx->dis;
+    uint32_t addr = ctx->cfg->start[b];
+
+    const struct xref *to;
+    uint32_t n = xrefs ? dis_xrefs_to(dis, addr, &to) : 0;
+    if (n)
+        listing_label(out, addr, to, n);
+
+    for (uint32_t j = 0; j < ctx->cfg->ninsns[b]; j++) {
+        struct insn buf, *ins = dis_lookup_r(dis, addr, &buf);
+        listing_insn(out, fmt, ins, ctx->bytes + addr - dis->base);
+        addr += ins->len;
+    }
+}
+
+static void listing_func(void *arg, uint32_t f)
+{
+    struct func_listing *ctx = arg;
+    const struct funcs *funcs = ctx->funcs;
+    struct listing *out = &ctx->out[f];
+
+    struct fmt fmt;
+    fmt_init(&fmt, FMT_DEFAULT | FMT_COLOR);
+
+    listing_func_header(out, &funcs->items[f], &ctx->graph->summaries[f]);
+
+    for (uint32_t i = funcs->block_idx[f]; i < funcs->block_idx[f + 1]; i++)
+        listing_block(out, &fmt, ctx, funcs->blocks[i]);
+}
+
+// Functions are rendered on the thread pool and written in address
+// order once all are done
+static void disasm_funcs(struct dis *dis, const uint8_t *bytes)
+{
+    struct cfg cfg;
+    cfg_build(&cfg, dis);
+
+    struct funcs funcs;
+    funcs_build(&funcs, dis, &cfg);
+
+    struct callgraph graph;
+    callgraph_build(&graph, &cfg, &funcs);
+    callgraph_summarize(&graph, dis, &cfg, &funcs, threads);
+
+    // Sort the index now, the jobs only read it
+    const struct xref *to;
+    if (xrefs)
+        dis_xrefs_to(dis, dis->base, &to);
+
+    struct func_listing ctx = {
+        .dis = dis,
+        .cfg = &cfg,
+        .funcs = &funcs,
+        .graph = &graph,
+        .bytes = bytes,
+        .out = calloc(funcs.n ? funcs.n : 1, sizeof(struct listing)),
+    };
+
+    for (uint32_t f = 0; f < funcs.n; f++)
+        ctx.out[f].fd = -1;
+
+    funcs_run(&funcs, threads, listing_func, &ctx);
+
+    listing_flush(&listing);
+    for (uint32_t f = 0; f < funcs.n; f++) {
+        ctx.out[f].fd = 1;
+        listing_flush(&ctx.out[f]);
+        free(ctx.out[f].buf);
+    }
+
+    free(ctx.out);
+    callgraph_deinit(&graph);
+    funcs_deinit(&funcs);
+    cfg_deinit(&cfg);
 }
 
 void disasm(uint8_t *bytes, size_t len)
 {
     struct dis dis;
-    dis_init(&dis, bytes, len, base);
-    dis_push_entry(&dis, entry);
-    dis_disasm(&dis);
+    dis_init(&dis, bytes, len, base, DIS_COMPACT | DIS_PADDED | (xrefs ? DIS_XREFS : 0));
 
-    char buf[0x100];
-    uint32_t off = 0;
+    if (linear) {
+        dis_sweep(&dis, threads);
+    } else {
+        dis_push_entry(&dis, entry);
+
+        if (!cache || !dis_cache_load(&dis, cache)) {
+            dis_disasm_parallel(&dis, threads);
+
+            if (cache && !dis_cache_save(&dis, cache))
+                fprintf(stderr, "Could not write to the cache in %s\n", cache);
+        }
+    }
+
+    if (output) {
+        if (!dis_bin_write(&dis, output))
+            fprintf(stderr, "Could not write the output to %s\n", output);
+
+        dis_deinit(&dis);
+        return;
+    }
+
+    double start = dis_stats_now();
+
+    if (funcs) {
+        disasm_funcs(&dis, bytes);
+
+        if (stats)
+            print_stats(&dis, dis_stats_now() - start);
+
+        dis_deinit(&dis);
+        return;
+    }
 
     struct insn *ins;
     uint32_t idx = 0;
 
     struct fmt fmt;
-    fmt_init(&fmt, FMT_DEFAULT);
-    fmt.opcode_pre = yellow;
-    fmt.opcode_post = reset;
+    fmt_init(&fmt, FMT_DEFAULT | FMT_COLOR);
 
     while (dis_iterate(&dis, &idx, &ins)) {
         if (!ins) {
-            uint8_t byte = bytes[idx - 1];
-            int space = printf("%x: %02hhx", idx + dis.base - 1, byte);
+            listing_data(&listing, idx + dis.base - 1, bytes[idx - 1]);
+            continue;
+        }
+
+        if (xrefs) {
+            uint32_t addr = ins->addr;
+            const struct xref *to;
+            uint32_t n = dis_xrefs_to(&dis, addr, &to);
+
+            if (n)
+                listing_label(&listing, addr, to, n);
+
+            // The query may have reused the view
+            ins = dis_lookup(&dis, addr);
+        }
+
+        listing_insn(&listing, &fmt, ins, bytes + idx - ins->len);
+    }
+
+    listing_flush(&listing);
+
+    if (stats)
+        print_stats(&dis, dis_stats_now() - start);
+
+    dis_deinit(&dis);
+}
+
+struct input {
+    uint8_t *bytes;
+    size_t len;
+    // Size of the mapping, zero when the input was read
+    size_t mapped;
+};
+
+// Pipes and anything else that can't be mapped is read whole
+static bool read_input(int fd, struct input *in)
+{
+    size_t cap = 1 << 16;
+    in->bytes = malloc(cap + DIS_PAD);
+    in->len = 0;
+    in->mapped = 0;
 
-            for (int i = space; i < SPACING; i++)
-                putchar(' ');
+    for (;;) {
+        if (in->len == cap) {
+            cap *= 2;
+            in->bytes = realloc(in->bytes, cap + DIS_PAD);
+        }
 
-            if (isprint(byte))
-                printf("db '%c'\n", byte);
-            else
-                printf("db '\\x%hhx'\n", byte);
+        ssize_t n = read(fd, in->bytes + in->len, cap - in->len);
+        if (n < 0 && errno == EINTR)
             continue;
+        if (n < 0) {
+            free(in->bytes);
+            return false;
         }
+        if (n == 0)
+            break;
 
-        int space = printf("%x:", ins->addr);
-        off = 0;
+        in->len += n;
+    }
 
-        //while (insn_is_prefix(ins)) {
-        //    space += printf(" %02x", bytes[idx - 1]);
+    memset(in->bytes + in->len, 0, DIS_PAD);
+    return true;
+}
 
-        //    off += snprintf(buf + off, sizeof(buf) - off, "%s ", opcode_mnemonics[ins->op]);
+static bool open_input(int fd, struct input *in, int advice)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode))
+        return read_input(fd, in);
 
-        //    if (!dis_iterate(&dis, &idx, &ins) || !ins)
-        //        break;
-        //}
+    // Reserve zeroed pages for the padding and map the file over the
+    // front, so the decoder can run in DIS_PADDED mode
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = st.st_size;
+    size_t size = (len + DIS_PAD + page - 1) & ~(page - 1);
 
-        for (int i = 0; i < ins->len; i++)
-            space += printf(" %02x", bytes[idx - ins->len + i]);
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED)
+        return read_input(fd, in);
 
-        fmt_insn(&fmt, ins, buf + off, sizeof(buf) - off);
+    if (len && mmap(addr, len, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(addr, size);
+        return read_input(fd, in);
+    }
 
-        for (int i = space; i < SPACING; i++)
-            putchar(' ');
+    madvise(addr, len, advice);
+    in->bytes = addr;
+    in->len = len;
+    in->mapped = size;
+    return true;
+}
 
-        printf("%s\n", buf);
+static void close_input(struct input *in)
+{
+    if (in->mapped)
+        munmap(in->bytes, in->mapped);
+    else
+        free(in->bytes);
+}
+
+// Linear sweep over stdin, only a window of the input is kept around
+void sweep(void)
+{
+    struct dis_stream stream;
+    dis_stream_init(&stream, base);
+
+    struct fmt fmt;
+    fmt_init(&fmt, FMT_DEFAULT | FMT_COLOR);
+
+    uint8_t chunk[0x4000];
+
+    for (;;) {
+        ssize_t n = read(0, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            perror("Failed to read");
+        if (n <= 0)
+            dis_stream_finish(&stream);
+
+        size_t off = 0;
+        do {
+            if (n > 0)
+                off += dis_stream_feed(&stream, chunk + off, n - off);
+
+            struct insn *ins;
+            const uint8_t *bytes;
+            while (dis_stream_next(&stream, &ins, &bytes))
+                listing_insn(&listing, &fmt, ins, bytes);
+        } while (n > 0 && off < (size_t)n);
+
+        if (n <= 0)
+            break;
     }
 
-    dis_deinit(&dis);
+    listing_flush(&listing);
+
+    if (stats)
+        print_stats(&stream.dis, 0);
+
+    dis_stream_deinit(&stream);
 }
 
 #define usage(x) \
-    fprintf(stderr, "Usage: %s [-b BASE] [-e ENTRY] FILE\n", x);
+    fprintf(stderr, "Usage: %s [--stats] [-b BASE] [-e ENTRY [-c CACHE] [-f] | -l] [-j THREADS] [-o OUT] [-x] FILE|-\n" \
+                    "       %s [--stats] [-b BASE] -s\n", x, x);
 
 int main(int argc, char **argv)
 {
     int opt;
+    bool stream = false;
+
+    static const struct option options[] = {
+        { "stats", no_argument, NULL, 'S' },
+        { 0 },
+    };
 
-    while ((opt = getopt(argc, argv, "b:e:")) != -1) {
+    while ((opt = getopt_long(argc, argv, "b:e:lj:sc:o:xf", options, NULL)) != -1) {
         switch (opt) {
             case 'b':
                 base = strtol(optarg, NULL, 0);
@@ -97,46 +589,65 @@ int main(int argc, char **argv)
             case 'e':
                 entry = strtol(optarg, NULL, 0);
                 break;
+            case 'l':
+                linear = true;
+                break;
+            case 'j':
+                threads = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                stream = true;
+                break;
+            case 'c':
+                cache = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'f':
+                funcs = true;
+                break;
+            case 'x':
+                xrefs = true;
+                break;
+            case 'S':
+                stats = true;
+                break;
             default:
                 usage(argv[0]);
                 return 1;
         }
     }
 
-	if (optind != argc - 1) {
-		usage(argv[0]);
-		return 1;
-	}
+    if (stream) {
+        if (optind != argc) {
+            usage(argv[0]);
+            return 1;
+        }
+
+        sweep();
+        return 0;
+    }
 
-	FILE *fp = fopen(argv[optind], "rb");
-	if (!fp) {
-		perror("Failed to open file");
+	if (optind != argc - 1 || (funcs && linear)) {
+		usage(argv[0]);
 		return 1;
 	}
 
-    if (fseek(fp, 0, SEEK_END) < 0) {
-        perror("Failed to seek");
+    int fd = strcmp(argv[optind], "-") ? open(argv[optind], O_RDONLY) : 0;
+    if (fd < 0) {
+        perror("Failed to open file");
         return 1;
     }
 
-    size_t size = ftell(fp);
-    rewind(fp);
-
-	uint8_t *buf = malloc(size);
-    if (!buf) {
-        perror("Failed to allocate");
+    struct input in;
+    if (!open_input(fd, &in, linear ? MADV_SEQUENTIAL : MADV_WILLNEED)) {
+        perror("Could not read the file");
         return 1;
     }
 
-    size_t len = fread(buf, 1, size, fp);
-	if (len != size) {
-		fprintf(stderr, "Could not read the file\n");
-		fclose(fp);
-		return 1;
-	}
-
-	fclose(fp);
-	disasm(buf, size);
-    free(buf);
+    close(fd);
+    disasm(in.bytes, in.len);
+    close_input(&in);
 	return 0;
 }
@@ -0,0 +1,98 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <string.h>
+#include <time.h>
+
+#include "i286dis.h"
+
+const char *dis_handler_names[] = {
+    "prefix",
+    "modrm",
+    "group1",
+    "group2",
+    "group3",
+    "group4",
+    "group6",
+    "group7",
+};
+
+const char *dis_phase_names[] = {
+    "disasm",
+    "sweep",
+};
+
+double dis_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void dis_stats_reset(struct dis *dis)
+{
+    memset(&dis->stats, 0, sizeof(struct dis_stats));
+}
+
+static void dis_stats_add(struct dis *dis, const struct dis *from, int64_t sign)
+{
+    for (int i = 0; i < I286_OPCODE_N; i++)
+        dis->stats.opcodes[i] += sign * from->stats.opcodes[i];
+
+    for (int i = 0; i < DIS_HANDLER_N; i++)
+        dis->stats.handlers[i] += sign * from->stats.handlers[i];
+
+    dis->stats.bad_truncated += sign * from->stats.bad_truncated;
+    dis->stats.bad_invalid += sign * from->stats.bad_invalid;
+}
+
+void dis_stats_merge(struct dis *dis, const struct dis *from)
+{
+    dis_stats_add(dis, from, 1);
+}
+
+void dis_stats_unmerge(struct dis *dis, const struct dis *from)
+{
+    dis_stats_add(dis, from, -1);
+}
+
+// Memory owned by struct dis right now
+static uint64_t dis_allocated(const struct dis *dis)
+{
+    uint32_t len = dis->limit - dis->base;
+    uint64_t size = dis->entries.cap * sizeof(uint32_t)
+                  + (len + 63) / 64 * sizeof(uint64_t);
+
+    if (dis->flags & DIS_COMPACT) {
+        const struct store *store = &dis->store;
+        return size + store->words * (sizeof(uint64_t) + sizeof(uint32_t))
+                    + store->cap * (2 * sizeof(uint32_t) + 4)
+                    + store->opers_cap * sizeof(struct oper_rec);
+    }
+
+    size += len * sizeof(struct insn *);
+    if (dis->flags & DIS_ARENA)
+        return size + dis->arena.total;
+
+    for (uint32_t i = 0; i < len; i++) {
+        if (dis->decoded[i])
+            size += sizeof(struct insn);
+    }
+
+    return size;
+}
+
+bool dis_get_stats(const struct dis *dis, struct dis_stats *stats)
+{
+#ifdef I286_STATS
+    *stats = dis->stats;
+    stats->pushes = dis->entries.pushes;
+    stats->drops = dis->entries.dups + dis->entries.out_of_range;
+    stats->allocated = dis_allocated(dis);
+    return true;
+#else
+    (void)dis;
+    (void)dis_allocated;
+    memset(stats, 0, sizeof(struct dis_stats));
+    return false;
+#endif
+}
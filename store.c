@@ -0,0 +1,316 @@
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "i286dis.h"
+
+#define STORE_MIN 1024
+
+static int oper_slots(const struct insn_rec *rec)
+{
+    int slots = rec->nopers;
+    for (int i = 0; i < rec->nopers; i++) {
+        if (rec->opers[i].flags == I286_OPER_IMM32)
+            slots++;
+    }
+
+    return slots;
+}
+
+static void store_grow(struct store *store)
+{
+    store->cap = store->cap ? store->cap * 2 : STORE_MIN;
+    store->addr = realloc(store->addr, store->cap * sizeof(uint32_t));
+    store->oper = realloc(store->oper, store->cap * sizeof(uint32_t));
+    store->len = realloc(store->len, store->cap);
+    store->op = realloc(store->op, store->cap);
+    store->pref = realloc(store->pref, store->cap);
+    store->nopers = realloc(store->nopers, store->cap);
+}
+
+void store_init(struct store *store, uint32_t base, uint32_t len)
+{
+    memset(store, 0, sizeof(struct store));
+    store->base = base;
+    store->words = (len + 63) / 64;
+    store->code = calloc(store->words, sizeof(uint64_t));
+    store->rank = calloc(store->words, sizeof(uint32_t));
+    store->sorted = true;
+}
+
+void store_deinit(struct store *store)
+{
+    free(store->code);
+    free(store->rank);
+    free(store->addr);
+    free(store->oper);
+    free(store->len);
+    free(store->op);
+    free(store->pref);
+    free(store->nopers);
+    free(store->opers);
+}
+
+bool store_has(const struct store *store, uint32_t off)
+{
+    return store->code[off / 64] >> (off % 64) & 1;
+}
+
+bool store_next(const struct store *store, uint32_t off, uint32_t *next)
+{
+    uint32_t word = off / 64;
+    if (word >= store->words)
+        return false;
+
+    // Skip whole words of data at once
+    uint64_t bits = store->code[word] & (~0ULL << (off % 64));
+    while (!bits) {
+        if (++word >= store->words)
+            return false;
+        bits = store->code[word];
+    }
+
+    *next = word * 64 + __builtin_ctzll(bits);
+    return true;
+}
+
+// Operand slots of the instruction at index i
+static int store_slots(const struct store *store, uint32_t i)
+{
+    const struct oper_rec *opers = store->opers + store->oper[i];
+    int slots = 0;
+    for (int j = 0; j < store->nopers[i]; j++)
+        slots += opers[slots].flags == I286_OPER_IMM32 ? 2 : 1;
+
+    return slots;
+}
+
+static uint32_t store_index(const struct store *store, uint32_t off)
+{
+    uint64_t below = store->code[off / 64] & ((1ULL << (off % 64)) - 1);
+    return store->rank[off / 64] + __builtin_popcountll(below);
+}
+
+void store_finalize(struct store *store)
+{
+    if (store->ranked)
+        return;
+
+    // Close the gaps left by store_remove, the bitmap no longer has
+    // their bits
+    if (store->holes) {
+        uint32_t n = 0;
+        for (uint32_t i = 0; i < store->n; i++) {
+            if (!store_has(store, store->addr[i] - store->base)) {
+                store->opers_dead += store_slots(store, i);
+                continue;
+            }
+
+            store->addr[n] = store->addr[i];
+            store->oper[n] = store->oper[i];
+            store->len[n] = store->len[i];
+            store->op[n] = store->op[i];
+            store->pref[n] = store->pref[i];
+            store->nopers[n] = store->nopers[i];
+            n++;
+        }
+
+        store->n = n;
+        store->holes = false;
+    }
+
+    uint32_t sum = 0;
+    for (uint32_t i = 0; i < store->words; i++) {
+        store->rank[i] = sum;
+        sum += __builtin_popcountll(store->code[i]);
+    }
+
+    assert(sum == store->n);
+    store->ranked = true;
+
+    if (store->sorted)
+        return;
+
+    // Scatter every instruction to its rank, the bitmap already
+    // knows the address order
+    uint32_t *addr = malloc(store->n * sizeof(uint32_t));
+    uint32_t *oper = malloc(store->n * sizeof(uint32_t));
+    uint8_t *len = malloc(store->n);
+    uint8_t *op = malloc(store->n);
+    uint8_t *pref = malloc(store->n);
+    uint8_t *nopers = malloc(store->n);
+
+    for (uint32_t i = 0; i < store->n; i++) {
+        uint32_t j = store_index(store, store->addr[i] - store->base);
+        addr[j] = store->addr[i];
+        oper[j] = store->oper[i];
+        len[j] = store->len[i];
+        op[j] = store->op[i];
+        pref[j] = store->pref[i];
+        nopers[j] = store->nopers[i];
+    }
+
+    free(store->addr);
+    free(store->oper);
+    free(store->len);
+    free(store->op);
+    free(store->pref);
+    free(store->nopers);
+
+    store->addr = addr;
+    store->oper = oper;
+    store->len = len;
+    store->op = op;
+    store->pref = pref;
+    store->nopers = nopers;
+    store->cap = store->n;
+    store->sorted = true;
+}
+
+// Moves the operand slots of every instruction back to back, dropping
+// the dead ones. Removed instructions must be gone already.
+static void store_compact(struct store *store)
+{
+    struct oper_rec *opers = malloc(store->opers_cap * sizeof(struct oper_rec));
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < store->n; i++) {
+        int slots = store_slots(store, i);
+        memcpy(opers + n, store->opers + store->oper[i], slots * sizeof(struct oper_rec));
+        store->oper[i] = n;
+        n += slots;
+    }
+
+    free(store->opers);
+    store->opers = opers;
+    store->opers_n = n;
+    store->opers_dead = 0;
+}
+
+void store_insert(struct store *store, uint32_t off, const struct insn_rec *rec)
+{
+    int slots = oper_slots(rec);
+    if (store->opers_n + slots > store->opers_cap) {
+        // Removed instructions only count as dead once finalized
+        if (store->holes)
+            store_finalize(store);
+
+        if (store->opers_dead && store->opers_dead >= store->opers_n / 2)
+            store_compact(store);
+    }
+
+    uint32_t i;
+    bool reuse = false;
+    if (store_has(store, off)) {
+        // Replace in place, keeping the old operand slots when the new
+        // ones fit
+        store_finalize(store);
+        i = store_index(store, off);
+
+        int old = store_slots(store, i);
+        reuse = slots <= old;
+        store->opers_dead += reuse ? old - slots : old;
+    } else {
+        // The removed copy of this address must be gone before a new
+        // one is appended
+        if (store->holes)
+            store_finalize(store);
+
+        if (store->n == store->cap)
+            store_grow(store);
+
+        if (store->n && rec->addr < store->addr[store->n - 1])
+            store->sorted = false;
+
+        i = store->n++;
+        store->code[off / 64] |= 1ULL << (off % 64);
+        store->ranked = false;
+    }
+
+    store->addr[i] = rec->addr;
+    store->len[i] = rec->len;
+    store->op[i] = rec->op;
+    store->pref[i] = rec->pref;
+    store->nopers[i] = rec->nopers;
+
+    if (reuse) {
+        memcpy(store->opers + store->oper[i], rec->opers, slots * sizeof(struct oper_rec));
+        return;
+    }
+
+    while (store->opers_n + slots > store->opers_cap) {
+        store->opers_cap = store->opers_cap ? store->opers_cap * 2 : STORE_MIN;
+        store->opers = realloc(store->opers, store->opers_cap * sizeof(struct oper_rec));
+    }
+
+    store->oper[i] = store->opers_n;
+    if (slots) {
+        memcpy(store->opers + store->opers_n, rec->opers, slots * sizeof(struct oper_rec));
+        store->opers_n += slots;
+    }
+}
+
+bool store_lookup(struct store *store, uint32_t off, struct insn_rec *rec)
+{
+    if (!store_has(store, off))
+        return false;
+
+    store_finalize(store);
+    uint32_t i = store_index(store, off);
+
+    memset(rec, 0, sizeof(struct insn_rec));
+    rec->addr = store->addr[i];
+    rec->len = store->len[i];
+    rec->op = store->op[i];
+    rec->pref = store->pref[i];
+    rec->nopers = store->nopers[i];
+
+    memcpy(rec->opers, store->opers + store->oper[i], store_slots(store, i) * sizeof(struct oper_rec));
+    return true;
+}
+
+void store_remove(struct store *store, uint32_t off)
+{
+    if (!store_has(store, off))
+        return;
+
+    store->code[off / 64] &= ~(1ULL << (off % 64));
+    store->ranked = false;
+    store->holes = true;
+}
+
+void store_load(struct store *store, uint32_t n, const uint32_t *addr, const uint8_t *len,
+                const uint8_t *op, const uint8_t *pref, const uint8_t *nopers,
+                const struct oper_rec *opers, uint32_t slots)
+{
+    while (store->cap < n)
+        store_grow(store);
+
+    if (store->opers_cap < slots) {
+        store->opers_cap = slots;
+        store->opers = realloc(store->opers, slots * sizeof(struct oper_rec));
+    }
+
+    memcpy(store->addr, addr, n * sizeof(uint32_t));
+    memcpy(store->len, len, n);
+    memcpy(store->op, op, n);
+    memcpy(store->pref, pref, n);
+    memcpy(store->nopers, nopers, n);
+    memcpy(store->opers, opers, slots * sizeof(struct oper_rec));
+
+    uint32_t slot = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t off = addr[i] - store->base;
+        store->code[off / 64] |= 1ULL << (off % 64);
+        store->oper[i] = slot;
+
+        for (int j = 0; j < nopers[i]; j++)
+            slot += opers[slot].flags == I286_OPER_IMM32 ? 2 : 1;
+    }
+
+    store->n = n;
+    store->opers_n = slots;
+    store->sorted = true;
+    store->ranked = false;
+    store_finalize(store);
+}
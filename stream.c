@@ -0,0 +1,78 @@
+#include <string.h>
+
+#include "i286dis.h"
+
+void dis_stream_init(struct dis_stream *stream, uint32_t base)
+{
+    // The window never holds more than DIS_STREAM_WINDOW bytes, the
+    // decoder is only moved along it
+    dis_init(&stream->dis, stream->buf, DIS_STREAM_WINDOW, base, DIS_COMPACT | DIS_PADDED);
+    memset(stream->buf, 0, sizeof(stream->buf));
+    stream->addr = base;
+    stream->len = 0;
+    stream->pos = 0;
+    stream->eof = false;
+}
+
+void dis_stream_deinit(struct dis_stream *stream)
+{
+    dis_deinit(&stream->dis);
+}
+
+size_t dis_stream_feed(struct dis_stream *stream, const uint8_t *bytes, size_t len)
+{
+    // Drop what was already decoded, the partial instruction at the
+    // end moves to the front
+    if (stream->pos) {
+        stream->len -= stream->pos;
+        memmove(stream->buf, stream->buf + stream->pos, stream->len);
+        stream->addr += stream->pos;
+        stream->pos = 0;
+    }
+
+    size_t room = DIS_STREAM_WINDOW - stream->len;
+    if (len > room)
+        len = room;
+
+    memcpy(stream->buf + stream->len, bytes, len);
+    stream->len += len;
+    return len;
+}
+
+void dis_stream_finish(struct dis_stream *stream)
+{
+    memset(stream->buf + stream->len, 0, DIS_PAD);
+    stream->eof = true;
+}
+
+bool dis_stream_next(struct dis_stream *stream, struct insn **ins, const uint8_t **bytes)
+{
+    if (stream->pos >= stream->len)
+        return false;
+
+    // Only decode once the instruction can't depend on bytes that have
+    // not arrived yet. A window made only of prefixes is decoded as is,
+    // it has nowhere left to grow.
+    if (!stream->eof && (stream->pos || stream->len < DIS_STREAM_WINDOW)) {
+        uint32_t p = stream->pos;
+        while (p < stream->len && dis_is_prefix(stream->buf[p]))
+            p++;
+
+        if (stream->len - p < DIS_PAD)
+            return false;
+    }
+
+    struct dis *dis = &stream->dis;
+    dis->base = stream->addr;
+    dis->limit = stream->addr + stream->len;
+    dis->ip = stream->addr + stream->pos;
+
+    struct insn_rec rec;
+    dis_decode_rec(dis, &rec);
+    insn_unpack(&dis->view, &rec);
+
+    *ins = &dis->view;
+    *bytes = stream->buf + stream->pos;
+    stream->pos += rec.len;
+    return true;
+}
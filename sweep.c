@@ -0,0 +1,146 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "i286dis.h"
+
+struct region {
+    struct dis dis;
+    uint32_t start;
+    uint32_t end;
+    struct insn_rec *recs;
+    uint32_t n;
+    uint32_t cap;
+};
+
+static void *region_sweep(void *arg)
+{
+    struct region *region = arg;
+    struct dis *dis = &region->dis;
+
+    dis->ip = region->start;
+    while (dis->ip < region->end) {
+        if (region->n == region->cap) {
+            region->cap *= 2;
+            region->recs = realloc(region->recs, region->cap * sizeof(struct insn_rec));
+        }
+
+        dis_decode_rec(dis, &region->recs[region->n++]);
+    }
+
+    return NULL;
+}
+
+// Takes the first n instructions of the region back out of its
+// statistics, the seam resync decoded them again
+static void region_discard(struct region *region, uint32_t n)
+{
+#ifdef I286_STATS
+    struct dis scratch = region->dis;
+    struct insn_rec rec;
+
+    dis_stats_reset(&scratch);
+    for (uint32_t i = 0; i < n; i++) {
+        scratch.ip = region->recs[i].addr;
+        dis_decode_rec(&scratch, &rec);
+    }
+
+    dis_stats_unmerge(&region->dis, &scratch);
+#else
+    (void)region;
+    (void)n;
+#endif
+}
+
+static bool region_find(const struct region *region, uint32_t addr, uint32_t *index)
+{
+    uint32_t lo = 0, hi = region->n;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (region->recs[mid].addr < addr)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *index = lo;
+    return lo < region->n && region->recs[lo].addr == addr;
+}
+
+void dis_sweep(struct dis *dis, int threads)
+{
+    uint32_t len = dis->limit - dis->base;
+    if (threads > (int)(len / SWEEP_REGION_MIN))
+        threads = len / SWEEP_REGION_MIN;
+
+    DIS_PHASE_BEGIN();
+
+    if (threads <= 1) {
+        dis->ip = dis->base;
+        while (dis->ip < dis->limit)
+            dis_decode(dis);
+
+        if (dis->flags & DIS_COMPACT)
+            store_finalize(&dis->store);
+
+        DIS_PHASE_END(dis, DIS_PHASE_SWEEP);
+        return;
+    }
+
+    struct region *regions = calloc(threads, sizeof(struct region));
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+
+    for (int i = 0; i < threads; i++) {
+        struct region *region = &regions[i];
+
+        // Workers only need the image and their own fetch state from
+        // the copy, everything they decode stays in the region
+        region->dis = *dis;
+        dis_stats_reset(&region->dis);
+        region->start = dis->base + (uint64_t)len * i / threads;
+        region->end = dis->base + (uint64_t)len * (i + 1) / threads;
+        region->cap = (region->end - region->start) / 2;
+        region->recs = malloc(region->cap * sizeof(struct insn_rec));
+
+        pthread_create(&tids[i], NULL, region_sweep, region);
+    }
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    // Every region but the first guessed its start. Follow the real
+    // stream from where the previous region ended until it lands on an
+    // instruction the region already decoded, from there on they agree.
+    dis->ip = dis->base;
+    for (int i = 0; i < threads; i++) {
+        struct region *region = &regions[i];
+        uint32_t index;
+
+        while (dis->ip < region->end && !region_find(region, dis->ip, &index))
+            dis_decode(dis);
+
+        // Only count the instructions that are kept, or the statistics
+        // would depend on the number of threads
+        if (dis->ip < region->end) {
+            region_discard(region, index);
+            for (; index < region->n; index++)
+                dis_insert(dis, &region->recs[index]);
+
+            const struct insn_rec *last = &region->recs[region->n - 1];
+            dis->ip = last->addr + last->len;
+        } else {
+            region_discard(region, region->n);
+        }
+
+        dis_stats_merge(dis, &region->dis);
+        free(region->recs);
+    }
+
+    free(regions);
+    free(tids);
+
+    if (dis->flags & DIS_COMPACT)
+        store_finalize(&dis->store);
+
+    DIS_PHASE_END(dis, DIS_PHASE_SWEEP);
+}
@@ -0,0 +1,21 @@
+#include <stdlib.h>
+
+#include "testdata.h"
+
+uint32_t next_rand(uint32_t *seed)
+{
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+uint8_t *random_bytes(uint32_t len, uint32_t seed)
+{
+    uint8_t *bytes = malloc(len);
+
+    for (uint32_t i = 0; i < len; i++)
+        bytes[i] = next_rand(&seed);
+
+    return bytes;
+}
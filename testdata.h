@@ -0,0 +1,12 @@
+#ifndef TESTDATA_H
+#define TESTDATA_H
+
+#include <stdint.h>
+
+// xorshift32, so every run sees the same bytes
+uint32_t next_rand(uint32_t *seed);
+
+// len bytes from next_rand, to be freed by the caller
+uint8_t *random_bytes(uint32_t len, uint32_t seed);
+
+#endif
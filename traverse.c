@@ -0,0 +1,328 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "i286dis.h"
+
+// Pending targets of one worker. The owner pushes and pops at the
+// tail, idle workers steal from the head.
+struct deque {
+    pthread_mutex_t lock;
+    uint32_t *items;
+    uint32_t head;
+    uint32_t tail;
+    uint32_t cap;
+};
+
+struct pool;
+
+struct worker {
+    struct pool *pool;
+    struct dis dis;
+    struct deque deque;
+    struct insn_rec *recs;
+    uint32_t n;
+    uint32_t cap;
+    uint32_t pushes;
+    uint32_t dups;
+    uint32_t out_of_range;
+    int id;
+};
+
+struct pool {
+    struct worker *workers;
+    int threads;
+    // One bit per byte, set by the worker that decodes the address
+    _Atomic uint64_t *claimed;
+    // Targets queued or being followed, the traversal is over at zero
+    atomic_uint pending;
+    // Targets sitting in a deque. Idle workers wait on cond for either
+    // to change, idle counts them so pushes only signal when needed.
+    atomic_uint queued;
+    atomic_int idle;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static void deque_push(struct deque *deque, uint32_t addr)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->cap) {
+        if (deque->head) {
+            deque->tail -= deque->head;
+            memmove(deque->items, deque->items + deque->head, deque->tail * sizeof(uint32_t));
+            deque->head = 0;
+        } else {
+            deque->cap = deque->cap ? deque->cap * 2 : 64;
+            deque->items = realloc(deque->items, deque->cap * sizeof(uint32_t));
+        }
+    }
+
+    deque->items[deque->tail++] = addr;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static bool deque_pop(struct deque *deque, uint32_t *addr)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    bool ok = deque->head < deque->tail;
+    if (ok)
+        *addr = deque->items[--deque->tail];
+
+    pthread_mutex_unlock(&deque->lock);
+    return ok;
+}
+
+static bool deque_steal(struct deque *deque, uint32_t *addr)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    bool ok = deque->head < deque->tail;
+    if (ok)
+        *addr = deque->items[deque->head++];
+
+    pthread_mutex_unlock(&deque->lock);
+    return ok;
+}
+
+static void pool_push(struct pool *pool, struct deque *deque, uint32_t addr)
+{
+    atomic_fetch_add(&pool->pending, 1);
+    deque_push(deque, addr);
+    atomic_fetch_add(&pool->queued, 1);
+
+    if (atomic_load(&pool->idle) > 0) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void pool_done(struct pool *pool)
+{
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+// Sleeps until some deque has a target, false once the traversal is over
+static bool pool_wait(struct pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->idle, 1);
+
+    while (atomic_load(&pool->queued) == 0 && atomic_load(&pool->pending) > 0)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+
+    atomic_fetch_sub(&pool->idle, 1);
+    bool more = atomic_load(&pool->pending) > 0;
+    pthread_mutex_unlock(&pool->lock);
+    return more;
+}
+
+static bool pool_is_claimed(struct pool *pool, uint32_t off)
+{
+    uint64_t word = atomic_load_explicit(&pool->claimed[off / 64], memory_order_relaxed);
+    return word >> (off % 64) & 1;
+}
+
+static bool pool_claim(struct pool *pool, uint32_t off)
+{
+    _Atomic uint64_t *word = &pool->claimed[off / 64];
+    uint64_t bit = 1ULL << (off % 64);
+    uint64_t old = atomic_load_explicit(word, memory_order_relaxed);
+
+    do {
+        if (old & bit)
+            return false;
+    } while (!atomic_compare_exchange_weak(word, &old, old | bit));
+
+    return true;
+}
+
+static void worker_push(struct worker *worker, uint32_t addr)
+{
+    struct pool *pool = worker->pool;
+    struct dis *dis = &worker->dis;
+
+    if (addr < dis->base || addr >= dis->limit) {
+        worker->out_of_range++;
+        return;
+    }
+
+    if (pool_is_claimed(pool, addr - dis->base)) {
+        worker->dups++;
+        return;
+    }
+
+    worker->pushes++;
+    pool_push(pool, &worker->deque, addr);
+}
+
+// Same walk as dis_disasm, but every address has to be claimed first
+static void worker_follow(struct worker *worker, uint32_t addr)
+{
+    struct dis *dis = &worker->dis;
+    struct insn ins;
+
+    dis->ip = addr;
+    while (dis->ip < dis->limit) {
+        if (!pool_claim(worker->pool, dis->ip - dis->base))
+            break;
+
+        if (worker->n == worker->cap) {
+            worker->cap = worker->cap ? worker->cap * 2 : 1024;
+            worker->recs = realloc(worker->recs, worker->cap * sizeof(struct insn_rec));
+        }
+
+        struct insn_rec *rec = &worker->recs[worker->n++];
+        dis_decode_rec(dis, rec);
+        insn_unpack(&ins, rec);
+
+        if (insn_is_bad(&ins))
+            break;
+
+        uint32_t branch;
+        if (insn_get_branch(&ins, &branch))
+            worker_push(worker, branch);
+
+        if (insn_is_terminator(&ins))
+            break;
+    }
+}
+
+static bool worker_steal(struct worker *worker, uint32_t *addr)
+{
+    struct pool *pool = worker->pool;
+
+    for (int i = 1; i < pool->threads; i++) {
+        struct worker *victim = &pool->workers[(worker->id + i) % pool->threads];
+        if (deque_steal(&victim->deque, addr))
+            return true;
+    }
+
+    return false;
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *worker = arg;
+    struct pool *pool = worker->pool;
+    uint32_t addr;
+
+    for (;;) {
+        if (!deque_pop(&worker->deque, &addr) && !worker_steal(worker, &addr)) {
+            if (!pool_wait(pool))
+                break;
+
+            continue;
+        }
+
+        atomic_fetch_sub(&pool->queued, 1);
+        worker_follow(worker, addr);
+        pool_done(pool);
+    }
+
+    return NULL;
+}
+
+static int rec_cmp(const void *a, const void *b)
+{
+    uint32_t x = ((const struct insn_rec *)a)->addr;
+    uint32_t y = ((const struct insn_rec *)b)->addr;
+    return (x > y) - (x < y);
+}
+
+void dis_disasm_parallel(struct dis *dis, int threads)
+{
+    if (threads <= 1) {
+        dis_disasm(dis);
+        return;
+    }
+
+    DIS_PHASE_BEGIN();
+
+    uint32_t len = dis->limit - dis->base;
+    struct pool pool;
+    pool.threads = threads;
+    pool.workers = calloc(threads, sizeof(struct worker));
+    pool.claimed = calloc((len + 63) / 64, sizeof(uint64_t));
+    atomic_init(&pool.pending, 0);
+    atomic_init(&pool.queued, 0);
+    atomic_init(&pool.idle, 0);
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+
+    // Whatever is already decoded stays as it is
+    for (uint32_t off = 0; off < len; off++) {
+        if (dis_is_decoded(dis, off + dis->base))
+            pool.claimed[off / 64] |= 1ULL << (off % 64);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        struct worker *worker = &pool.workers[i];
+        worker->pool = &pool;
+        worker->dis = *dis;
+        dis_stats_reset(&worker->dis);
+        worker->id = i;
+        pthread_mutex_init(&worker->deque.lock, NULL);
+    }
+
+    // The entries were already counted when they were queued
+    uint32_t entry;
+    for (int i = 0; dis_pop_entry(dis, &entry); i++)
+        pool_push(&pool, &pool.workers[i % threads].deque, entry);
+
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, worker_run, &pool.workers[i]);
+
+    for (int i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+
+    // The decoded set is the same for any schedule, inserting it in
+    // address order makes the store the same too
+    uint32_t n = 0;
+    for (int i = 0; i < threads; i++)
+        n += pool.workers[i].n;
+
+    struct insn_rec *recs = malloc((n ? n : 1) * sizeof(struct insn_rec));
+    n = 0;
+
+    for (int i = 0; i < threads; i++) {
+        struct worker *worker = &pool.workers[i];
+
+        if (worker->n)
+            memcpy(recs + n, worker->recs, worker->n * sizeof(struct insn_rec));
+        n += worker->n;
+
+        dis_stats_merge(dis, &worker->dis);
+        dis->entries.pushes += worker->pushes;
+        dis->entries.dups += worker->dups;
+        dis->entries.out_of_range += worker->out_of_range;
+        free(worker->recs);
+        free(worker->deque.items);
+        pthread_mutex_destroy(&worker->deque.lock);
+    }
+
+    qsort(recs, n, sizeof(struct insn_rec), rec_cmp);
+    for (uint32_t i = 0; i < n; i++)
+        dis_insert(dis, &recs[i]);
+
+    free(recs);
+    free(tids);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    free((void *)pool.claimed);
+    free(pool.workers);
+
+    if (dis->flags & DIS_COMPACT)
+        store_finalize(&dis->store);
+
+    DIS_PHASE_END(dis, DIS_PHASE_DISASM);
+}
@@ -0,0 +1,249 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "i286dis.h"
+
+#define XREFS_MIN 1024
+
+static bool code_ref(struct insn *ins, struct xref *xref)
+{
+    uint32_t target;
+    if (!insn_is_branch(ins) || !insn_get_branch(ins, &target))
+        return false;
+
+    xref->from = ins->addr;
+    xref->to = target;
+    xref->kind = insn_branch_kind(ins);
+    return true;
+}
+
+static enum seg data_seg(const struct insn *ins)
+{
+    if (ins->pref & PRE_CS)
+        return I286_SEG_CS;
+    if (ins->pref & PRE_ES)
+        return I286_SEG_ES;
+    if (ins->pref & PRE_SS)
+        return I286_SEG_SS;
+
+    return I286_SEG_DS;
+}
+
+// How the instruction uses a memory operand, first is whether it's
+// the first operand, where the destination goes
+static enum data_access data_access(const struct insn *ins, bool first)
+{
+    switch (ins->op) {
+        case I286_LEA:
+            return DATA_ADDR;
+
+        case I286_XCHG:
+            return DATA_READ | DATA_WRITE;
+
+        default:
+            if (!first)
+                return DATA_READ;
+            break;
+    }
+
+    switch (ins->op) {
+        case I286_MOV:
+        case I286_POP:
+        case I286_SGDT:
+        case I286_SIDT:
+        case I286_SLDT:
+        case I286_SMSW:
+        case I286_STR:
+            return DATA_WRITE;
+
+        case I286_CMP:
+        case I286_TEST:
+        case I286_PUSH:
+        case I286_CALL:
+        case I286_CALLF:
+        case I286_JMP:
+        case I286_JMPF:
+        case I286_MUL:
+        case I286_IMUL:
+        case I286_DIV:
+        case I286_IDIV:
+        case I286_LGDT:
+        case I286_LIDT:
+        case I286_LLDT:
+        case I286_LMSW:
+        case I286_LTR:
+        case I286_VERR:
+        case I286_VERW:
+            return DATA_READ;
+
+        default:
+            return DATA_READ | DATA_WRITE;
+    }
+}
+
+// Absolute memory operands, and the immediate of mov r16, imm16 as an
+// address taken. No instruction has more than one of these.
+static bool data_ref(struct insn *ins, struct xref *xref)
+{
+    bool first = true;
+
+    for (struct oper *oper = ins->opers; oper; oper = oper->next, first = false) {
+        if (oper->flags == I286_OPER_MEM
+            && (oper->mem.mode == I286_MEM_ABS || oper->mem.mode == I286_MEM_MOFF)) {
+            xref->to = DIS_DATA_ADDR(data_seg(ins), (uint16_t)oper->mem.disp);
+            xref->kind = data_access(ins, first);
+            xref->from = ins->addr;
+            return true;
+        }
+    }
+
+    struct oper *oper = ins->opers;
+    if (ins->op == I286_MOV && oper && oper->flags == I286_OPER_REG && oper->reg >= I286_REG_AX
+        && oper->next && oper->next->flags == I286_OPER_IMM16) {
+        xref->to = DIS_DATA_ADDR(I286_SEG_DS, oper->next->imm16);
+        xref->kind = DATA_ADDR;
+        xref->from = ins->addr;
+        return true;
+    }
+
+    return false;
+}
+
+static void xrefs_add(struct xrefs *xrefs, const struct xref *xref)
+{
+    if (xrefs->n == xrefs->cap) {
+        xrefs->cap = xrefs->cap ? xrefs->cap * 2 : XREFS_MIN;
+        xrefs->items = realloc(xrefs->items, xrefs->cap * sizeof(struct xref));
+    }
+
+    xrefs->items[xrefs->n++] = *xref;
+    xrefs->sorted = false;
+}
+
+void dis_xref_add(struct dis *dis, struct insn *ins)
+{
+    struct xref xref;
+
+    if (code_ref(ins, &xref))
+        xrefs_add(&dis->xrefs, &xref);
+
+    if (data_ref(ins, &xref))
+        xrefs_add(&dis->data_xrefs, &xref);
+}
+
+static int compare_from(const void *a, const void *b)
+{
+    const struct xref *x = a, *y = b;
+    return (x->from > y->from) - (x->from < y->from);
+}
+
+static int compare_to(const void *a, const void *b)
+{
+    const struct xref *x = a, *y = b;
+    if (x->to != y->to)
+        return (x->to > y->to) - (x->to < y->to);
+
+    return compare_from(a, b);
+}
+
+// Sorts both views, dropping the xrefs of instructions that were
+// removed or decoded again since they were recorded. get gives the
+// xref the instruction has now.
+static void xrefs_finalize(struct dis *dis, struct xrefs *xrefs,
+                           bool (*get)(struct insn *, struct xref *))
+{
+    if (xrefs->sorted)
+        return;
+
+    qsort(xrefs->items, xrefs->n, sizeof(struct xref), compare_from);
+
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < xrefs->n; i++) {
+        const struct xref *xref = &xrefs->items[i];
+        if (n && xrefs->items[n - 1].from == xref->from)
+            continue;
+
+        struct insn *ins = dis_lookup(dis, xref->from);
+        struct xref now;
+        if (!ins || !get(ins, &now) || now.to != xref->to || now.kind != xref->kind)
+            continue;
+
+        xrefs->items[n++] = *xref;
+    }
+
+    xrefs->n = n;
+    xrefs->by_target = realloc(xrefs->by_target, (n ? n : 1) * sizeof(struct xref));
+    memcpy(xrefs->by_target, xrefs->items, n * sizeof(struct xref));
+    qsort(xrefs->by_target, n, sizeof(struct xref), compare_to);
+
+    xrefs->sorted = true;
+}
+
+// First of the n xrefs with the key at least key, by to or by from
+static uint32_t xrefs_bound(const struct xref *items, uint32_t n, uint32_t key, bool to)
+{
+    uint32_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((to ? items[mid].to : items[mid].from) < key)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static const struct xref *xrefs_from(const struct xrefs *xrefs, uint32_t source)
+{
+    uint32_t i = xrefs_bound(xrefs->items, xrefs->n, source, false);
+    if (i == xrefs->n || xrefs->items[i].from != source)
+        return NULL;
+
+    return &xrefs->items[i];
+}
+
+uint32_t dis_xrefs_to(struct dis *dis, uint32_t target, const struct xref **xrefs)
+{
+    xrefs_finalize(dis, &dis->xrefs, code_ref);
+
+    const struct xref *items = dis->xrefs.by_target;
+    uint32_t first = xrefs_bound(items, dis->xrefs.n, target, true);
+    uint32_t last = first;
+
+    while (last < dis->xrefs.n && items[last].to == target)
+        last++;
+
+    *xrefs = items + first;
+    return last - first;
+}
+
+const struct xref *dis_xref_from(struct dis *dis, uint32_t source)
+{
+    xrefs_finalize(dis, &dis->xrefs, code_ref);
+    return xrefs_from(&dis->xrefs, source);
+}
+
+uint32_t dis_data_xrefs_to(struct dis *dis, enum seg seg, uint16_t off, uint32_t len,
+                           const struct xref **xrefs)
+{
+    xrefs_finalize(dis, &dis->data_xrefs, data_ref);
+
+    // Offsets past the end of the segment don't wrap around
+    uint32_t lo = DIS_DATA_ADDR(seg, off);
+    uint32_t hi = lo + (len < 0x10000u - off ? len : 0x10000u - off);
+
+    const struct xref *items = dis->data_xrefs.by_target;
+    uint32_t first = xrefs_bound(items, dis->data_xrefs.n, lo, true);
+    uint32_t last = xrefs_bound(items, dis->data_xrefs.n, hi, true);
+
+    *xrefs = items + first;
+    return last - first;
+}
+
+const struct xref *dis_data_xref_from(struct dis *dis, uint32_t source)
+{
+    xrefs_finalize(dis, &dis->data_xrefs, data_ref);
+    return xrefs_from(&dis->data_xrefs, source);
+}